@@ -10,106 +10,243 @@ Rcpp::Rostream<true>&  Rcpp::Rcout = Rcpp::Rcpp_cout_get();
 Rcpp::Rostream<false>& Rcpp::Rcerr = Rcpp::Rcpp_cerr_get();
 #endif
 
+// rcpp_bam_prefetch_init
+SEXP rcpp_bam_prefetch_init(int nthreads);
+RcppExport SEXP _epialleleR_rcpp_bam_prefetch_init(SEXP nthreadsSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< int >::type nthreads(nthreadsSEXP);
+    rcpp_result_gen = Rcpp::wrap(rcpp_bam_prefetch_init(nthreads));
+    return rcpp_result_gen;
+END_RCPP
+}
+// rcpp_bam_prefetch_start
+void rcpp_bam_prefetch_start(SEXP prefetch_xptr, std::string fn, int min_mapq, int min_baseq, bool skip_duplicates, bool packed, bool sparse, bool keep_unpaired, std::vector<std::string> regions);
+RcppExport SEXP _epialleleR_rcpp_bam_prefetch_start(SEXP prefetch_xptrSEXP, SEXP fnSEXP, SEXP min_mapqSEXP, SEXP min_baseqSEXP, SEXP skip_duplicatesSEXP, SEXP packedSEXP, SEXP sparseSEXP, SEXP keep_unpairedSEXP, SEXP regionsSEXP) {
+BEGIN_RCPP
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< SEXP >::type prefetch_xptr(prefetch_xptrSEXP);
+    Rcpp::traits::input_parameter< std::string >::type fn(fnSEXP);
+    Rcpp::traits::input_parameter< int >::type min_mapq(min_mapqSEXP);
+    Rcpp::traits::input_parameter< int >::type min_baseq(min_baseqSEXP);
+    Rcpp::traits::input_parameter< bool >::type skip_duplicates(skip_duplicatesSEXP);
+    Rcpp::traits::input_parameter< bool >::type packed(packedSEXP);
+    Rcpp::traits::input_parameter< bool >::type sparse(sparseSEXP);
+    Rcpp::traits::input_parameter< bool >::type keep_unpaired(keep_unpairedSEXP);
+    Rcpp::traits::input_parameter< std::vector<std::string> >::type regions(regionsSEXP);
+    rcpp_bam_prefetch_start(prefetch_xptr, fn, min_mapq, min_baseq, skip_duplicates, packed, sparse, keep_unpaired, regions);
+    return R_NilValue;
+END_RCPP
+}
+// rcpp_bam_prefetch_wait
+Rcpp::DataFrame rcpp_bam_prefetch_wait(SEXP prefetch_xptr);
+RcppExport SEXP _epialleleR_rcpp_bam_prefetch_wait(SEXP prefetch_xptrSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< SEXP >::type prefetch_xptr(prefetch_xptrSEXP);
+    rcpp_result_gen = Rcpp::wrap(rcpp_bam_prefetch_wait(prefetch_xptr));
+    return rcpp_result_gen;
+END_RCPP
+}
 // rcpp_cx_report
-Rcpp::DataFrame rcpp_cx_report(Rcpp::DataFrame& df, Rcpp::LogicalVector& pass, std::string ctx);
-RcppExport SEXP _epialleleR_rcpp_cx_report(SEXP dfSEXP, SEXP passSEXP, SEXP ctxSEXP) {
+Rcpp::DataFrame rcpp_cx_report(Rcpp::DataFrame& df, Rcpp::RawVector& pass, std::string ctx, int nthreads, std::string report_file, std::string layout, bool gzip);
+RcppExport SEXP _epialleleR_rcpp_cx_report(SEXP dfSEXP, SEXP passSEXP, SEXP ctxSEXP, SEXP nthreadsSEXP, SEXP report_fileSEXP, SEXP layoutSEXP, SEXP gzipSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< Rcpp::DataFrame& >::type df(dfSEXP);
+    Rcpp::traits::input_parameter< Rcpp::RawVector& >::type pass(passSEXP);
+    Rcpp::traits::input_parameter< std::string >::type ctx(ctxSEXP);
+    Rcpp::traits::input_parameter< int >::type nthreads(nthreadsSEXP);
+    Rcpp::traits::input_parameter< std::string >::type report_file(report_fileSEXP);
+    Rcpp::traits::input_parameter< std::string >::type layout(layoutSEXP);
+    Rcpp::traits::input_parameter< bool >::type gzip(gzipSEXP);
+    rcpp_result_gen = Rcpp::wrap(rcpp_cx_report(df, pass, ctx, nthreads, report_file, layout, gzip));
+    return rcpp_result_gen;
+END_RCPP
+}
+// rcpp_cx_report_multi
+Rcpp::List rcpp_cx_report_multi(Rcpp::DataFrame& df, Rcpp::List pass, std::vector<int> pass_id, std::vector<std::string> ctx, std::vector<std::string> report_file, std::vector<std::string> layout, Rcpp::LogicalVector gzip, int nthreads);
+RcppExport SEXP _epialleleR_rcpp_cx_report_multi(SEXP dfSEXP, SEXP passSEXP, SEXP pass_idSEXP, SEXP ctxSEXP, SEXP report_fileSEXP, SEXP layoutSEXP, SEXP gzipSEXP, SEXP nthreadsSEXP) {
 BEGIN_RCPP
     Rcpp::RObject rcpp_result_gen;
     Rcpp::RNGScope rcpp_rngScope_gen;
     Rcpp::traits::input_parameter< Rcpp::DataFrame& >::type df(dfSEXP);
-    Rcpp::traits::input_parameter< Rcpp::LogicalVector& >::type pass(passSEXP);
+    Rcpp::traits::input_parameter< Rcpp::List >::type pass(passSEXP);
+    Rcpp::traits::input_parameter< std::vector<int> >::type pass_id(pass_idSEXP);
+    Rcpp::traits::input_parameter< std::vector<std::string> >::type ctx(ctxSEXP);
+    Rcpp::traits::input_parameter< std::vector<std::string> >::type report_file(report_fileSEXP);
+    Rcpp::traits::input_parameter< std::vector<std::string> >::type layout(layoutSEXP);
+    Rcpp::traits::input_parameter< Rcpp::LogicalVector >::type gzip(gzipSEXP);
+    Rcpp::traits::input_parameter< int >::type nthreads(nthreadsSEXP);
+    rcpp_result_gen = Rcpp::wrap(rcpp_cx_report_multi(df, pass, pass_id, ctx, report_file, layout, gzip, nthreads));
+    return rcpp_result_gen;
+END_RCPP
+}
+// rcpp_cx_report_stream
+Rcpp::DataFrame rcpp_cx_report_stream(std::string fn, int min_mapq, int min_baseq, bool skip_duplicates, int nthreads, bool threshold_reads, std::string ctx_meth, std::string ctx_unmeth, std::string ooctx_meth, std::string ooctx_unmeth, unsigned int min_n_ctx, double min_ctx_meth_frac, double max_ooctx_meth_frac, std::string ctx, std::string report_file, std::string layout, bool gzip);
+RcppExport SEXP _epialleleR_rcpp_cx_report_stream(SEXP fnSEXP, SEXP min_mapqSEXP, SEXP min_baseqSEXP, SEXP skip_duplicatesSEXP, SEXP nthreadsSEXP, SEXP threshold_readsSEXP, SEXP ctx_methSEXP, SEXP ctx_unmethSEXP, SEXP ooctx_methSEXP, SEXP ooctx_unmethSEXP, SEXP min_n_ctxSEXP, SEXP min_ctx_meth_fracSEXP, SEXP max_ooctx_meth_fracSEXP, SEXP ctxSEXP, SEXP report_fileSEXP, SEXP layoutSEXP, SEXP gzipSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< std::string >::type fn(fnSEXP);
+    Rcpp::traits::input_parameter< int >::type min_mapq(min_mapqSEXP);
+    Rcpp::traits::input_parameter< int >::type min_baseq(min_baseqSEXP);
+    Rcpp::traits::input_parameter< bool >::type skip_duplicates(skip_duplicatesSEXP);
+    Rcpp::traits::input_parameter< int >::type nthreads(nthreadsSEXP);
+    Rcpp::traits::input_parameter< bool >::type threshold_reads(threshold_readsSEXP);
+    Rcpp::traits::input_parameter< std::string >::type ctx_meth(ctx_methSEXP);
+    Rcpp::traits::input_parameter< std::string >::type ctx_unmeth(ctx_unmethSEXP);
+    Rcpp::traits::input_parameter< std::string >::type ooctx_meth(ooctx_methSEXP);
+    Rcpp::traits::input_parameter< std::string >::type ooctx_unmeth(ooctx_unmethSEXP);
+    Rcpp::traits::input_parameter< unsigned int >::type min_n_ctx(min_n_ctxSEXP);
+    Rcpp::traits::input_parameter< double >::type min_ctx_meth_frac(min_ctx_meth_fracSEXP);
+    Rcpp::traits::input_parameter< double >::type max_ooctx_meth_frac(max_ooctx_meth_fracSEXP);
     Rcpp::traits::input_parameter< std::string >::type ctx(ctxSEXP);
-    rcpp_result_gen = Rcpp::wrap(rcpp_cx_report(df, pass, ctx));
+    Rcpp::traits::input_parameter< std::string >::type report_file(report_fileSEXP);
+    Rcpp::traits::input_parameter< std::string >::type layout(layoutSEXP);
+    Rcpp::traits::input_parameter< bool >::type gzip(gzipSEXP);
+    rcpp_result_gen = Rcpp::wrap(rcpp_cx_report_stream(fn, min_mapq, min_baseq, skip_duplicates, nthreads, threshold_reads, ctx_meth, ctx_unmeth, ooctx_meth, ooctx_unmeth, min_n_ctx, min_ctx_meth_frac, max_ooctx_meth_frac, ctx, report_file, layout, gzip));
     return rcpp_result_gen;
 END_RCPP
 }
 // rcpp_extract_patterns
-Rcpp::DataFrame rcpp_extract_patterns(Rcpp::DataFrame& df, unsigned int target_rname, unsigned int target_start, unsigned int target_end, signed int min_overlap, std::string& ctx, double min_ctx_freq, bool clip, unsigned int reverse_offset, Rcpp::IntegerVector& hlght);
-RcppExport SEXP _epialleleR_rcpp_extract_patterns(SEXP dfSEXP, SEXP target_rnameSEXP, SEXP target_startSEXP, SEXP target_endSEXP, SEXP min_overlapSEXP, SEXP ctxSEXP, SEXP min_ctx_freqSEXP, SEXP clipSEXP, SEXP reverse_offsetSEXP, SEXP hlghtSEXP) {
+Rcpp::List rcpp_extract_patterns(Rcpp::DataFrame& df, Rcpp::IntegerVector& target_rname, Rcpp::IntegerVector& target_start, Rcpp::IntegerVector& target_end, signed int min_overlap, std::string& ctx, double min_ctx_freq, bool clip, unsigned int reverse_offset, Rcpp::IntegerVector& hlght, bool summarize);
+RcppExport SEXP _epialleleR_rcpp_extract_patterns(SEXP dfSEXP, SEXP target_rnameSEXP, SEXP target_startSEXP, SEXP target_endSEXP, SEXP min_overlapSEXP, SEXP ctxSEXP, SEXP min_ctx_freqSEXP, SEXP clipSEXP, SEXP reverse_offsetSEXP, SEXP hlghtSEXP, SEXP summarizeSEXP) {
 BEGIN_RCPP
     Rcpp::RObject rcpp_result_gen;
     Rcpp::RNGScope rcpp_rngScope_gen;
     Rcpp::traits::input_parameter< Rcpp::DataFrame& >::type df(dfSEXP);
-    Rcpp::traits::input_parameter< unsigned int >::type target_rname(target_rnameSEXP);
-    Rcpp::traits::input_parameter< unsigned int >::type target_start(target_startSEXP);
-    Rcpp::traits::input_parameter< unsigned int >::type target_end(target_endSEXP);
+    Rcpp::traits::input_parameter< Rcpp::IntegerVector& >::type target_rname(target_rnameSEXP);
+    Rcpp::traits::input_parameter< Rcpp::IntegerVector& >::type target_start(target_startSEXP);
+    Rcpp::traits::input_parameter< Rcpp::IntegerVector& >::type target_end(target_endSEXP);
     Rcpp::traits::input_parameter< signed int >::type min_overlap(min_overlapSEXP);
     Rcpp::traits::input_parameter< std::string& >::type ctx(ctxSEXP);
     Rcpp::traits::input_parameter< double >::type min_ctx_freq(min_ctx_freqSEXP);
     Rcpp::traits::input_parameter< bool >::type clip(clipSEXP);
     Rcpp::traits::input_parameter< unsigned int >::type reverse_offset(reverse_offsetSEXP);
     Rcpp::traits::input_parameter< Rcpp::IntegerVector& >::type hlght(hlghtSEXP);
-    rcpp_result_gen = Rcpp::wrap(rcpp_extract_patterns(df, target_rname, target_start, target_end, min_overlap, ctx, min_ctx_freq, clip, reverse_offset, hlght));
+    Rcpp::traits::input_parameter< bool >::type summarize(summarizeSEXP);
+    rcpp_result_gen = Rcpp::wrap(rcpp_extract_patterns(df, target_rname, target_start, target_end, min_overlap, ctx, min_ctx_freq, clip, reverse_offset, hlght, summarize));
     return rcpp_result_gen;
 END_RCPP
 }
 // rcpp_fep
-std::vector<double> rcpp_fep(Rcpp::DataFrame& df, std::vector<std::string> colnames);
-RcppExport SEXP _epialleleR_rcpp_fep(SEXP dfSEXP, SEXP colnamesSEXP) {
+Rcpp::List rcpp_fep(Rcpp::DataFrame& df, std::vector<std::string> colnames, int nthreads);
+RcppExport SEXP _epialleleR_rcpp_fep(SEXP dfSEXP, SEXP colnamesSEXP, SEXP nthreadsSEXP) {
 BEGIN_RCPP
     Rcpp::RObject rcpp_result_gen;
     Rcpp::RNGScope rcpp_rngScope_gen;
     Rcpp::traits::input_parameter< Rcpp::DataFrame& >::type df(dfSEXP);
     Rcpp::traits::input_parameter< std::vector<std::string> >::type colnames(colnamesSEXP);
-    rcpp_result_gen = Rcpp::wrap(rcpp_fep(df, colnames));
+    Rcpp::traits::input_parameter< int >::type nthreads(nthreadsSEXP);
+    rcpp_result_gen = Rcpp::wrap(rcpp_fep(df, colnames, nthreads));
     return rcpp_result_gen;
 END_RCPP
 }
 // rcpp_get_base_freqs
-Rcpp::NumericMatrix rcpp_get_base_freqs(Rcpp::DataFrame& df, std::vector<bool> pass, Rcpp::DataFrame& vcf);
-RcppExport SEXP _epialleleR_rcpp_get_base_freqs(SEXP dfSEXP, SEXP passSEXP, SEXP vcfSEXP) {
+Rcpp::NumericMatrix rcpp_get_base_freqs(Rcpp::DataFrame& df, Rcpp::RawVector pass, Rcpp::DataFrame& vcf, int nthreads);
+RcppExport SEXP _epialleleR_rcpp_get_base_freqs(SEXP dfSEXP, SEXP passSEXP, SEXP vcfSEXP, SEXP nthreadsSEXP) {
 BEGIN_RCPP
     Rcpp::RObject rcpp_result_gen;
     Rcpp::RNGScope rcpp_rngScope_gen;
     Rcpp::traits::input_parameter< Rcpp::DataFrame& >::type df(dfSEXP);
-    Rcpp::traits::input_parameter< std::vector<bool> >::type pass(passSEXP);
+    Rcpp::traits::input_parameter< Rcpp::RawVector >::type pass(passSEXP);
     Rcpp::traits::input_parameter< Rcpp::DataFrame& >::type vcf(vcfSEXP);
-    rcpp_result_gen = Rcpp::wrap(rcpp_get_base_freqs(df, pass, vcf));
+    Rcpp::traits::input_parameter< int >::type nthreads(nthreadsSEXP);
+    rcpp_result_gen = Rcpp::wrap(rcpp_get_base_freqs(df, pass, vcf, nthreads));
+    return rcpp_result_gen;
+END_RCPP
+}
+// rcpp_get_bed_ecdf
+Rcpp::List rcpp_get_bed_ecdf(Rcpp::DataFrame& df, Rcpp::IntegerVector& bed_match, int ntargets, std::string ctx_meth, std::string ctx_unmeth, std::string ooctx_meth, std::string ooctx_unmeth, int nthreads);
+RcppExport SEXP _epialleleR_rcpp_get_bed_ecdf(SEXP dfSEXP, SEXP bed_matchSEXP, SEXP ntargetsSEXP, SEXP ctx_methSEXP, SEXP ctx_unmethSEXP, SEXP ooctx_methSEXP, SEXP ooctx_unmethSEXP, SEXP nthreadsSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< Rcpp::DataFrame& >::type df(dfSEXP);
+    Rcpp::traits::input_parameter< Rcpp::IntegerVector& >::type bed_match(bed_matchSEXP);
+    Rcpp::traits::input_parameter< int >::type ntargets(ntargetsSEXP);
+    Rcpp::traits::input_parameter< std::string >::type ctx_meth(ctx_methSEXP);
+    Rcpp::traits::input_parameter< std::string >::type ctx_unmeth(ctx_unmethSEXP);
+    Rcpp::traits::input_parameter< std::string >::type ooctx_meth(ooctx_methSEXP);
+    Rcpp::traits::input_parameter< std::string >::type ooctx_unmeth(ooctx_unmethSEXP);
+    Rcpp::traits::input_parameter< int >::type nthreads(nthreadsSEXP);
+    rcpp_result_gen = Rcpp::wrap(rcpp_get_bed_ecdf(df, bed_match, ntargets, ctx_meth, ctx_unmeth, ooctx_meth, ooctx_unmeth, nthreads));
+    return rcpp_result_gen;
+END_RCPP
+}
+// rcpp_get_bed_report
+Rcpp::IntegerMatrix rcpp_get_bed_report(Rcpp::DataFrame& df, Rcpp::DataFrame& bed, bool amplicon, int tolerance, signed int min_overlap, bool threshold_reads, std::string ctx_meth, std::string ctx_unmeth, std::string ooctx_meth, std::string ooctx_unmeth, unsigned int min_n_ctx, double min_ctx_meth_frac, double max_ooctx_meth_frac, int nthreads);
+RcppExport SEXP _epialleleR_rcpp_get_bed_report(SEXP dfSEXP, SEXP bedSEXP, SEXP ampliconSEXP, SEXP toleranceSEXP, SEXP min_overlapSEXP, SEXP threshold_readsSEXP, SEXP ctx_methSEXP, SEXP ctx_unmethSEXP, SEXP ooctx_methSEXP, SEXP ooctx_unmethSEXP, SEXP min_n_ctxSEXP, SEXP min_ctx_meth_fracSEXP, SEXP max_ooctx_meth_fracSEXP, SEXP nthreadsSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< Rcpp::DataFrame& >::type df(dfSEXP);
+    Rcpp::traits::input_parameter< Rcpp::DataFrame& >::type bed(bedSEXP);
+    Rcpp::traits::input_parameter< bool >::type amplicon(ampliconSEXP);
+    Rcpp::traits::input_parameter< int >::type tolerance(toleranceSEXP);
+    Rcpp::traits::input_parameter< signed int >::type min_overlap(min_overlapSEXP);
+    Rcpp::traits::input_parameter< bool >::type threshold_reads(threshold_readsSEXP);
+    Rcpp::traits::input_parameter< std::string >::type ctx_meth(ctx_methSEXP);
+    Rcpp::traits::input_parameter< std::string >::type ctx_unmeth(ctx_unmethSEXP);
+    Rcpp::traits::input_parameter< std::string >::type ooctx_meth(ooctx_methSEXP);
+    Rcpp::traits::input_parameter< std::string >::type ooctx_unmeth(ooctx_unmethSEXP);
+    Rcpp::traits::input_parameter< unsigned int >::type min_n_ctx(min_n_ctxSEXP);
+    Rcpp::traits::input_parameter< double >::type min_ctx_meth_frac(min_ctx_meth_fracSEXP);
+    Rcpp::traits::input_parameter< double >::type max_ooctx_meth_frac(max_ooctx_meth_fracSEXP);
+    Rcpp::traits::input_parameter< int >::type nthreads(nthreadsSEXP);
+    rcpp_result_gen = Rcpp::wrap(rcpp_get_bed_report(df, bed, amplicon, tolerance, min_overlap, threshold_reads, ctx_meth, ctx_unmeth, ooctx_meth, ooctx_unmeth, min_n_ctx, min_ctx_meth_frac, max_ooctx_meth_frac, nthreads));
     return rcpp_result_gen;
 END_RCPP
 }
 // rcpp_get_xm_beta
-std::vector<double> rcpp_get_xm_beta(Rcpp::DataFrame& df, std::string ctx_meth, std::string ctx_unmeth);
-RcppExport SEXP _epialleleR_rcpp_get_xm_beta(SEXP dfSEXP, SEXP ctx_methSEXP, SEXP ctx_unmethSEXP) {
+Rcpp::NumericVector rcpp_get_xm_beta(Rcpp::DataFrame& df, std::string ctx_meth, std::string ctx_unmeth, int nthreads);
+RcppExport SEXP _epialleleR_rcpp_get_xm_beta(SEXP dfSEXP, SEXP ctx_methSEXP, SEXP ctx_unmethSEXP, SEXP nthreadsSEXP) {
 BEGIN_RCPP
     Rcpp::RObject rcpp_result_gen;
     Rcpp::RNGScope rcpp_rngScope_gen;
     Rcpp::traits::input_parameter< Rcpp::DataFrame& >::type df(dfSEXP);
     Rcpp::traits::input_parameter< std::string >::type ctx_meth(ctx_methSEXP);
     Rcpp::traits::input_parameter< std::string >::type ctx_unmeth(ctx_unmethSEXP);
-    rcpp_result_gen = Rcpp::wrap(rcpp_get_xm_beta(df, ctx_meth, ctx_unmeth));
+    Rcpp::traits::input_parameter< int >::type nthreads(nthreadsSEXP);
+    rcpp_result_gen = Rcpp::wrap(rcpp_get_xm_beta(df, ctx_meth, ctx_unmeth, nthreads));
     return rcpp_result_gen;
 END_RCPP
 }
 // rcpp_match_amplicon
-std::vector<int> rcpp_match_amplicon(Rcpp::DataFrame& df, Rcpp::DataFrame& bed, int tolerance);
-RcppExport SEXP _epialleleR_rcpp_match_amplicon(SEXP dfSEXP, SEXP bedSEXP, SEXP toleranceSEXP) {
+Rcpp::IntegerVector rcpp_match_amplicon(Rcpp::DataFrame& df, Rcpp::DataFrame& bed, int tolerance, int nthreads);
+RcppExport SEXP _epialleleR_rcpp_match_amplicon(SEXP dfSEXP, SEXP bedSEXP, SEXP toleranceSEXP, SEXP nthreadsSEXP) {
 BEGIN_RCPP
     Rcpp::RObject rcpp_result_gen;
     Rcpp::RNGScope rcpp_rngScope_gen;
     Rcpp::traits::input_parameter< Rcpp::DataFrame& >::type df(dfSEXP);
     Rcpp::traits::input_parameter< Rcpp::DataFrame& >::type bed(bedSEXP);
     Rcpp::traits::input_parameter< int >::type tolerance(toleranceSEXP);
-    rcpp_result_gen = Rcpp::wrap(rcpp_match_amplicon(df, bed, tolerance));
+    Rcpp::traits::input_parameter< int >::type nthreads(nthreadsSEXP);
+    rcpp_result_gen = Rcpp::wrap(rcpp_match_amplicon(df, bed, tolerance, nthreads));
     return rcpp_result_gen;
 END_RCPP
 }
 // rcpp_match_capture
-std::vector<int> rcpp_match_capture(Rcpp::DataFrame& df, Rcpp::DataFrame& bed, signed int min_overlap);
-RcppExport SEXP _epialleleR_rcpp_match_capture(SEXP dfSEXP, SEXP bedSEXP, SEXP min_overlapSEXP) {
+Rcpp::IntegerVector rcpp_match_capture(Rcpp::DataFrame& df, Rcpp::DataFrame& bed, signed int min_overlap, int nthreads);
+RcppExport SEXP _epialleleR_rcpp_match_capture(SEXP dfSEXP, SEXP bedSEXP, SEXP min_overlapSEXP, SEXP nthreadsSEXP) {
 BEGIN_RCPP
     Rcpp::RObject rcpp_result_gen;
     Rcpp::RNGScope rcpp_rngScope_gen;
     Rcpp::traits::input_parameter< Rcpp::DataFrame& >::type df(dfSEXP);
     Rcpp::traits::input_parameter< Rcpp::DataFrame& >::type bed(bedSEXP);
     Rcpp::traits::input_parameter< signed int >::type min_overlap(min_overlapSEXP);
-    rcpp_result_gen = Rcpp::wrap(rcpp_match_capture(df, bed, min_overlap));
+    Rcpp::traits::input_parameter< int >::type nthreads(nthreadsSEXP);
+    rcpp_result_gen = Rcpp::wrap(rcpp_match_capture(df, bed, min_overlap, nthreads));
     return rcpp_result_gen;
 END_RCPP
 }
 // rcpp_read_bam_paired
-Rcpp::DataFrame rcpp_read_bam_paired(std::string fn, int min_mapq, int min_baseq, bool skip_duplicates, int nthreads);
-RcppExport SEXP _epialleleR_rcpp_read_bam_paired(SEXP fnSEXP, SEXP min_mapqSEXP, SEXP min_baseqSEXP, SEXP skip_duplicatesSEXP, SEXP nthreadsSEXP) {
+Rcpp::DataFrame rcpp_read_bam_paired(std::string fn, int min_mapq, int min_baseq, bool skip_duplicates, int nthreads, bool packed, bool sparse, bool keep_unpaired, std::vector<std::string> regions, double max_memory, std::string spill_prefix, double max_depth, int depth_bin, double seed);
+RcppExport SEXP _epialleleR_rcpp_read_bam_paired(SEXP fnSEXP, SEXP min_mapqSEXP, SEXP min_baseqSEXP, SEXP skip_duplicatesSEXP, SEXP nthreadsSEXP, SEXP packedSEXP, SEXP sparseSEXP, SEXP keep_unpairedSEXP, SEXP regionsSEXP, SEXP max_memorySEXP, SEXP spill_prefixSEXP, SEXP max_depthSEXP, SEXP depth_binSEXP, SEXP seedSEXP) {
 BEGIN_RCPP
     Rcpp::RObject rcpp_result_gen;
     Rcpp::RNGScope rcpp_rngScope_gen;
@@ -118,13 +255,57 @@ BEGIN_RCPP
     Rcpp::traits::input_parameter< int >::type min_baseq(min_baseqSEXP);
     Rcpp::traits::input_parameter< bool >::type skip_duplicates(skip_duplicatesSEXP);
     Rcpp::traits::input_parameter< int >::type nthreads(nthreadsSEXP);
-    rcpp_result_gen = Rcpp::wrap(rcpp_read_bam_paired(fn, min_mapq, min_baseq, skip_duplicates, nthreads));
+    Rcpp::traits::input_parameter< bool >::type packed(packedSEXP);
+    Rcpp::traits::input_parameter< bool >::type sparse(sparseSEXP);
+    Rcpp::traits::input_parameter< bool >::type keep_unpaired(keep_unpairedSEXP);
+    Rcpp::traits::input_parameter< std::vector<std::string> >::type regions(regionsSEXP);
+    Rcpp::traits::input_parameter< double >::type max_memory(max_memorySEXP);
+    Rcpp::traits::input_parameter< std::string >::type spill_prefix(spill_prefixSEXP);
+    Rcpp::traits::input_parameter< double >::type max_depth(max_depthSEXP);
+    Rcpp::traits::input_parameter< int >::type depth_bin(depth_binSEXP);
+    Rcpp::traits::input_parameter< double >::type seed(seedSEXP);
+    rcpp_result_gen = Rcpp::wrap(rcpp_read_bam_paired(fn, min_mapq, min_baseq, skip_duplicates, nthreads, packed, sparse, keep_unpaired, regions, max_memory, spill_prefix, max_depth, depth_bin, seed));
+    return rcpp_result_gen;
+END_RCPP
+}
+// rcpp_read_cache
+Rcpp::DataFrame rcpp_read_cache(std::string fn);
+RcppExport SEXP _epialleleR_rcpp_read_cache(SEXP fnSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< std::string >::type fn(fnSEXP);
+    rcpp_result_gen = Rcpp::wrap(rcpp_read_cache(fn));
+    return rcpp_result_gen;
+END_RCPP
+}
+// rcpp_simulate_bam
+Rcpp::NumericVector rcpp_simulate_bam(std::string fn, int ntargets, int target_width, int target_spacing, int depth, int read_length, int min_insert, int max_insert, double methylation, bool amplicon, bool single_end, bool sorted, double seed, int nthreads);
+RcppExport SEXP _epialleleR_rcpp_simulate_bam(SEXP fnSEXP, SEXP ntargetsSEXP, SEXP target_widthSEXP, SEXP target_spacingSEXP, SEXP depthSEXP, SEXP read_lengthSEXP, SEXP min_insertSEXP, SEXP max_insertSEXP, SEXP methylationSEXP, SEXP ampliconSEXP, SEXP single_endSEXP, SEXP sortedSEXP, SEXP seedSEXP, SEXP nthreadsSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< std::string >::type fn(fnSEXP);
+    Rcpp::traits::input_parameter< int >::type ntargets(ntargetsSEXP);
+    Rcpp::traits::input_parameter< int >::type target_width(target_widthSEXP);
+    Rcpp::traits::input_parameter< int >::type target_spacing(target_spacingSEXP);
+    Rcpp::traits::input_parameter< int >::type depth(depthSEXP);
+    Rcpp::traits::input_parameter< int >::type read_length(read_lengthSEXP);
+    Rcpp::traits::input_parameter< int >::type min_insert(min_insertSEXP);
+    Rcpp::traits::input_parameter< int >::type max_insert(max_insertSEXP);
+    Rcpp::traits::input_parameter< double >::type methylation(methylationSEXP);
+    Rcpp::traits::input_parameter< bool >::type amplicon(ampliconSEXP);
+    Rcpp::traits::input_parameter< bool >::type single_end(single_endSEXP);
+    Rcpp::traits::input_parameter< bool >::type sorted(sortedSEXP);
+    Rcpp::traits::input_parameter< double >::type seed(seedSEXP);
+    Rcpp::traits::input_parameter< int >::type nthreads(nthreadsSEXP);
+    rcpp_result_gen = Rcpp::wrap(rcpp_simulate_bam(fn, ntargets, target_width, target_spacing, depth, read_length, min_insert, max_insert, methylation, amplicon, single_end, sorted, seed, nthreads));
     return rcpp_result_gen;
 END_RCPP
 }
 // rcpp_threshold_reads
-std::vector<bool> rcpp_threshold_reads(Rcpp::DataFrame& df, std::string ctx_meth, std::string ctx_unmeth, std::string ooctx_meth, std::string ooctx_unmeth, unsigned int min_n_ctx, double min_ctx_meth_frac, double max_ooctx_meth_frac);
-RcppExport SEXP _epialleleR_rcpp_threshold_reads(SEXP dfSEXP, SEXP ctx_methSEXP, SEXP ctx_unmethSEXP, SEXP ooctx_methSEXP, SEXP ooctx_unmethSEXP, SEXP min_n_ctxSEXP, SEXP min_ctx_meth_fracSEXP, SEXP max_ooctx_meth_fracSEXP) {
+Rcpp::RawVector rcpp_threshold_reads(Rcpp::DataFrame& df, std::string ctx_meth, std::string ctx_unmeth, std::string ooctx_meth, std::string ooctx_unmeth, unsigned int min_n_ctx, double min_ctx_meth_frac, double max_ooctx_meth_frac, int nthreads);
+RcppExport SEXP _epialleleR_rcpp_threshold_reads(SEXP dfSEXP, SEXP ctx_methSEXP, SEXP ctx_unmethSEXP, SEXP ooctx_methSEXP, SEXP ooctx_unmethSEXP, SEXP min_n_ctxSEXP, SEXP min_ctx_meth_fracSEXP, SEXP max_ooctx_meth_fracSEXP, SEXP nthreadsSEXP) {
 BEGIN_RCPP
     Rcpp::RObject rcpp_result_gen;
     Rcpp::RNGScope rcpp_rngScope_gen;
@@ -136,21 +317,88 @@ BEGIN_RCPP
     Rcpp::traits::input_parameter< unsigned int >::type min_n_ctx(min_n_ctxSEXP);
     Rcpp::traits::input_parameter< double >::type min_ctx_meth_frac(min_ctx_meth_fracSEXP);
     Rcpp::traits::input_parameter< double >::type max_ooctx_meth_frac(max_ooctx_meth_fracSEXP);
-    rcpp_result_gen = Rcpp::wrap(rcpp_threshold_reads(df, ctx_meth, ctx_unmeth, ooctx_meth, ooctx_unmeth, min_n_ctx, min_ctx_meth_frac, max_ooctx_meth_frac));
+    Rcpp::traits::input_parameter< int >::type nthreads(nthreadsSEXP);
+    rcpp_result_gen = Rcpp::wrap(rcpp_threshold_reads(df, ctx_meth, ctx_unmeth, ooctx_meth, ooctx_unmeth, min_n_ctx, min_ctx_meth_frac, max_ooctx_meth_frac, nthreads));
+    return rcpp_result_gen;
+END_RCPP
+}
+// rcpp_threshold_reads_multi
+Rcpp::List rcpp_threshold_reads_multi(Rcpp::DataFrame& df, std::vector<std::string> ctx_meth, std::vector<std::string> ctx_unmeth, std::vector<std::string> ooctx_meth, std::vector<std::string> ooctx_unmeth, std::vector<unsigned int> min_n_ctx, std::vector<double> min_ctx_meth_frac, std::vector<double> max_ooctx_meth_frac, int nthreads);
+RcppExport SEXP _epialleleR_rcpp_threshold_reads_multi(SEXP dfSEXP, SEXP ctx_methSEXP, SEXP ctx_unmethSEXP, SEXP ooctx_methSEXP, SEXP ooctx_unmethSEXP, SEXP min_n_ctxSEXP, SEXP min_ctx_meth_fracSEXP, SEXP max_ooctx_meth_fracSEXP, SEXP nthreadsSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< Rcpp::DataFrame& >::type df(dfSEXP);
+    Rcpp::traits::input_parameter< std::vector<std::string> >::type ctx_meth(ctx_methSEXP);
+    Rcpp::traits::input_parameter< std::vector<std::string> >::type ctx_unmeth(ctx_unmethSEXP);
+    Rcpp::traits::input_parameter< std::vector<std::string> >::type ooctx_meth(ooctx_methSEXP);
+    Rcpp::traits::input_parameter< std::vector<std::string> >::type ooctx_unmeth(ooctx_unmethSEXP);
+    Rcpp::traits::input_parameter< std::vector<unsigned int> >::type min_n_ctx(min_n_ctxSEXP);
+    Rcpp::traits::input_parameter< std::vector<double> >::type min_ctx_meth_frac(min_ctx_meth_fracSEXP);
+    Rcpp::traits::input_parameter< std::vector<double> >::type max_ooctx_meth_frac(max_ooctx_meth_fracSEXP);
+    Rcpp::traits::input_parameter< int >::type nthreads(nthreadsSEXP);
+    rcpp_result_gen = Rcpp::wrap(rcpp_threshold_reads_multi(df, ctx_meth, ctx_unmeth, ooctx_meth, ooctx_unmeth, min_n_ctx, min_ctx_meth_frac, max_ooctx_meth_frac, nthreads));
+    return rcpp_result_gen;
+END_RCPP
+}
+// rcpp_window_report
+Rcpp::DataFrame rcpp_window_report(Rcpp::DataFrame& df, int window_size, int window_step, signed int min_overlap, bool threshold_reads, std::string ctx_meth, std::string ctx_unmeth, std::string ooctx_meth, std::string ooctx_unmeth, unsigned int min_n_ctx, double min_ctx_meth_frac, double max_ooctx_meth_frac, int nthreads);
+RcppExport SEXP _epialleleR_rcpp_window_report(SEXP dfSEXP, SEXP window_sizeSEXP, SEXP window_stepSEXP, SEXP min_overlapSEXP, SEXP threshold_readsSEXP, SEXP ctx_methSEXP, SEXP ctx_unmethSEXP, SEXP ooctx_methSEXP, SEXP ooctx_unmethSEXP, SEXP min_n_ctxSEXP, SEXP min_ctx_meth_fracSEXP, SEXP max_ooctx_meth_fracSEXP, SEXP nthreadsSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< Rcpp::DataFrame& >::type df(dfSEXP);
+    Rcpp::traits::input_parameter< int >::type window_size(window_sizeSEXP);
+    Rcpp::traits::input_parameter< int >::type window_step(window_stepSEXP);
+    Rcpp::traits::input_parameter< signed int >::type min_overlap(min_overlapSEXP);
+    Rcpp::traits::input_parameter< bool >::type threshold_reads(threshold_readsSEXP);
+    Rcpp::traits::input_parameter< std::string >::type ctx_meth(ctx_methSEXP);
+    Rcpp::traits::input_parameter< std::string >::type ctx_unmeth(ctx_unmethSEXP);
+    Rcpp::traits::input_parameter< std::string >::type ooctx_meth(ooctx_methSEXP);
+    Rcpp::traits::input_parameter< std::string >::type ooctx_unmeth(ooctx_unmethSEXP);
+    Rcpp::traits::input_parameter< unsigned int >::type min_n_ctx(min_n_ctxSEXP);
+    Rcpp::traits::input_parameter< double >::type min_ctx_meth_frac(min_ctx_meth_fracSEXP);
+    Rcpp::traits::input_parameter< double >::type max_ooctx_meth_frac(max_ooctx_meth_fracSEXP);
+    Rcpp::traits::input_parameter< int >::type nthreads(nthreadsSEXP);
+    rcpp_result_gen = Rcpp::wrap(rcpp_window_report(df, window_size, window_step, min_overlap, threshold_reads, ctx_meth, ctx_unmeth, ooctx_meth, ooctx_unmeth, min_n_ctx, min_ctx_meth_frac, max_ooctx_meth_frac, nthreads));
+    return rcpp_result_gen;
+END_RCPP
+}
+// rcpp_write_cache
+Rcpp::NumericMatrix rcpp_write_cache(Rcpp::DataFrame& df, std::string fn);
+RcppExport SEXP _epialleleR_rcpp_write_cache(SEXP dfSEXP, SEXP fnSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< Rcpp::DataFrame& >::type df(dfSEXP);
+    Rcpp::traits::input_parameter< std::string >::type fn(fnSEXP);
+    rcpp_result_gen = Rcpp::wrap(rcpp_write_cache(df, fn));
     return rcpp_result_gen;
 END_RCPP
 }
 
 static const R_CallMethodDef CallEntries[] = {
-    {"_epialleleR_rcpp_cx_report", (DL_FUNC) &_epialleleR_rcpp_cx_report, 3},
-    {"_epialleleR_rcpp_extract_patterns", (DL_FUNC) &_epialleleR_rcpp_extract_patterns, 10},
-    {"_epialleleR_rcpp_fep", (DL_FUNC) &_epialleleR_rcpp_fep, 2},
-    {"_epialleleR_rcpp_get_base_freqs", (DL_FUNC) &_epialleleR_rcpp_get_base_freqs, 3},
-    {"_epialleleR_rcpp_get_xm_beta", (DL_FUNC) &_epialleleR_rcpp_get_xm_beta, 3},
-    {"_epialleleR_rcpp_match_amplicon", (DL_FUNC) &_epialleleR_rcpp_match_amplicon, 3},
-    {"_epialleleR_rcpp_match_capture", (DL_FUNC) &_epialleleR_rcpp_match_capture, 3},
-    {"_epialleleR_rcpp_read_bam_paired", (DL_FUNC) &_epialleleR_rcpp_read_bam_paired, 5},
-    {"_epialleleR_rcpp_threshold_reads", (DL_FUNC) &_epialleleR_rcpp_threshold_reads, 8},
+    {"_epialleleR_rcpp_bam_prefetch_init", (DL_FUNC) &_epialleleR_rcpp_bam_prefetch_init, 1},
+    {"_epialleleR_rcpp_bam_prefetch_start", (DL_FUNC) &_epialleleR_rcpp_bam_prefetch_start, 9},
+    {"_epialleleR_rcpp_bam_prefetch_wait", (DL_FUNC) &_epialleleR_rcpp_bam_prefetch_wait, 1},
+    {"_epialleleR_rcpp_cx_report", (DL_FUNC) &_epialleleR_rcpp_cx_report, 7},
+    {"_epialleleR_rcpp_cx_report_multi", (DL_FUNC) &_epialleleR_rcpp_cx_report_multi, 8},
+    {"_epialleleR_rcpp_cx_report_stream", (DL_FUNC) &_epialleleR_rcpp_cx_report_stream, 17},
+    {"_epialleleR_rcpp_extract_patterns", (DL_FUNC) &_epialleleR_rcpp_extract_patterns, 11},
+    {"_epialleleR_rcpp_fep", (DL_FUNC) &_epialleleR_rcpp_fep, 3},
+    {"_epialleleR_rcpp_get_base_freqs", (DL_FUNC) &_epialleleR_rcpp_get_base_freqs, 4},
+    {"_epialleleR_rcpp_get_bed_ecdf", (DL_FUNC) &_epialleleR_rcpp_get_bed_ecdf, 8},
+    {"_epialleleR_rcpp_get_bed_report", (DL_FUNC) &_epialleleR_rcpp_get_bed_report, 14},
+    {"_epialleleR_rcpp_get_xm_beta", (DL_FUNC) &_epialleleR_rcpp_get_xm_beta, 4},
+    {"_epialleleR_rcpp_match_amplicon", (DL_FUNC) &_epialleleR_rcpp_match_amplicon, 4},
+    {"_epialleleR_rcpp_match_capture", (DL_FUNC) &_epialleleR_rcpp_match_capture, 4},
+    {"_epialleleR_rcpp_read_bam_paired", (DL_FUNC) &_epialleleR_rcpp_read_bam_paired, 14},
+    {"_epialleleR_rcpp_read_cache", (DL_FUNC) &_epialleleR_rcpp_read_cache, 1},
+    {"_epialleleR_rcpp_simulate_bam", (DL_FUNC) &_epialleleR_rcpp_simulate_bam, 14},
+    {"_epialleleR_rcpp_threshold_reads", (DL_FUNC) &_epialleleR_rcpp_threshold_reads, 9},
+    {"_epialleleR_rcpp_threshold_reads_multi", (DL_FUNC) &_epialleleR_rcpp_threshold_reads_multi, 9},
+    {"_epialleleR_rcpp_window_report", (DL_FUNC) &_epialleleR_rcpp_window_report, 13},
+    {"_epialleleR_rcpp_write_cache", (DL_FUNC) &_epialleleR_rcpp_write_cache, 2},
     {NULL, NULL, 0}
 };
 
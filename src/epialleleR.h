@@ -0,0 +1,639 @@
+#ifndef EPIALLELER_H
+#define EPIALLELER_H
+
+#include <Rcpp.h>
+#include <vector>
+#include <array>
+#include <string>
+#include <cstdint>
+#include <chrono>
+#include <ctime>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <exception>
+#include <type_traits>
+#include <memory>
+
+// Common definitions shared by epialleleR kernels.
+//
+// Merged, reference-spaced templates produced by rcpp_read_bam_paired are
+// attached to the data frame with BAM data as an external pointer (templ_xptr
+// attribute) to T_templates. All templates are kept back to back in a single
+// buffer (arena) and are accessed through offset and width arrays, so there
+// is no per-template allocation. Readers always lay them out in the order of
+// rows, i.e. by rname and start, so kernels scan the memory sequentially and
+// can binary-search the rows.
+//
+// Default layout stores XM chars followed by SEQ chars, i.e. two bytes per
+// reference position. Compact (packed) layout keeps one byte per position:
+//
+//   bits 7..4 - SEQ base as HTSlib's nt16 code  ("=ACMGRSVTWYHKDBN")
+//   bits 3..0 - XM call as ctx_to_idx code     (see rcpp_cx_report.cpp)
+//
+// '+' and '-' share the same ctx_to_idx code and are unpacked as '-'. None of
+// the kernels distinguishes between them.
+//
+// Either layout can be sparse: only the covered segments of every template
+// are stored, after a header with the number of segments and their positions
+// (T_segment). Gaps between the mates of large inserts and within long reads
+// take no memory then. Kernels visit bases through for_each_segment of the
+// accessors, which sees dense template as a single segment.
+//
+// Kernels are templated on the accessors below, so that layout is resolved
+// once per call and not in the hot loop.
+
+
+// ctx_to_idx conversion is described in the rcpp_cx_report.cpp
+#define ctx_to_idx(c) ((c+2)>>2) & 15
+
+// ctx_to_idx code -> XM char
+const char idx_to_ctx[] = {'-','-','H','-','-','U','X','Z',
+                           '-','-','h','-','.','u','x','z'};
+// nt16 code -> SEQ char
+const char nt16_to_seq[] = "=ACMGRSVTWYHKDBN";
+// ctx_to_idx code -> slot in T_counts, 8 if not counted
+const uint8_t idx_to_slot[] = {8,8,0,8,8,1,2,3,
+                               8,8,4,8,8,5,6,7};
+
+
+// per-template counts of XM chars H, U, X, Z, h, u, x, z (in this order).
+// Allow thresholding and beta values without rescanning. 32-bit, as long
+// reads can have more than 65535 cytosines of the same context
+typedef std::array<uint32_t,8> T_counts;
+
+// slots of XM chars from the string, to sum counts up
+inline std::vector<uint8_t> ctx_to_slots(const std::string &ctx) {
+  std::vector<uint8_t> slots;
+  for (size_t i=0; i<ctx.size(); i++) {
+    const uint8_t slot = idx_to_slot[ctx_to_idx(ctx[i])];
+    if ((slot<8) && (idx_to_ctx[ctx_to_idx(ctx[i])]==ctx[i])) slots.push_back(slot);
+  }
+  return slots;
+}
+
+// sum of counts for the slots
+inline unsigned int sum_counts(const T_counts &counts, const std::vector<uint8_t> &slots) {
+  unsigned int res = 0;
+  for (size_t i=0; i<slots.size(); i++) res += counts[slots[i]];
+  return res;
+}
+
+
+// mask of T_counts: all bits set for slots of XM chars of the string, else 0
+inline T_counts ctx_to_mask(const std::string &ctx) {
+  T_counts mask = {0};
+  const std::vector<uint8_t> slots = ctx_to_slots(ctx);
+  for (size_t i=0; i<slots.size(); i++) mask[slots[i]] = 0xFFFFFFFF;
+  return mask;
+}
+
+// sum of masked counts. Fixed length without branches, so compilers turn it
+// into a few 128-bit vector operations (SSE2/NEON)
+inline unsigned int sum_masked(const T_counts &counts, const T_counts &mask) {
+  unsigned int res = 0;
+  for (size_t i=0; i<8; i++) res += counts[i] & mask[i];
+  return res;
+}
+
+
+// read thresholding criteria, see rcpp_threshold_reads.cpp
+struct T_threshold {
+  T_counts ctx_meth_mask, ctx_unmeth_mask;                                      // masks of within-the-context XM chars
+  T_counts ooctx_meth_mask, ooctx_unmeth_mask;                                  // masks of out-of-context XM chars
+  unsigned int min_n_ctx;                                                       // minimum number of context bases
+  double min_ctx_meth_frac;                                                     // min context beta value
+  double max_ooctx_meth_frac;                                                   // max out-of-context beta value
+  
+  T_threshold(const std::string &ctx_meth, const std::string &ctx_unmeth,
+              const std::string &ooctx_meth, const std::string &ooctx_unmeth,
+              unsigned int min_n_ctx, double min_ctx_meth_frac,
+              double max_ooctx_meth_frac) :
+    ctx_meth_mask(ctx_to_mask(ctx_meth)),
+    ctx_unmeth_mask(ctx_to_mask(ctx_unmeth)),
+    ooctx_meth_mask(ctx_to_mask(ooctx_meth)),
+    ooctx_unmeth_mask(ctx_to_mask(ooctx_unmeth)),
+    min_n_ctx(min_n_ctx), min_ctx_meth_frac(min_ctx_meth_frac),
+    max_ooctx_meth_frac(max_ooctx_meth_frac) {}
+  
+  inline bool pass(const T_counts &counts) const {                              // TRUE if template passes, no branches
+    const unsigned int n_ctx_meth = sum_masked(counts, ctx_meth_mask);
+    const unsigned int n_ctx_all = n_ctx_meth + sum_masked(counts, ctx_unmeth_mask);
+    const unsigned int n_ooctx_meth = sum_masked(counts, ooctx_meth_mask);
+    const unsigned int n_ooctx_all = n_ooctx_meth + sum_masked(counts, ooctx_unmeth_mask);
+    const double ctx_meth_frac = (double)n_ctx_meth / n_ctx_all;                // NaN if no context bases, not used then
+    const double ooctx_meth_frac = (double)n_ooctx_meth / n_ooctx_all;          // NaN if no out-of-context bases, not used then
+    return (n_ctx_meth>0) & (n_ctx_all>=min_n_ctx) &
+      !(ctx_meth_frac<min_ctx_meth_frac) &
+      ((n_ooctx_meth==0) | !(ooctx_meth_frac>max_ooctx_meth_frac));
+  }
+};
+
+// bit-packed pass mask, 8 templates per byte, least significant bit first
+// (as in rawToBits, so it is unpacked in R as as.logical(rawToBits(mask)))
+struct T_pass_mask {
+  const uint8_t *bits;
+  
+  T_pass_mask(const Rcpp::RawVector &mask) : bits(mask.begin()) {}
+  inline bool operator[](size_t x) const { return (bits[x>>3] >> (x&7)) & 1; }
+};
+
+// intervals [start, end] of BED targets, sorted by reference and start. Every
+// reference is an implicit augmented interval tree: node at index i of level
+// k has i's k lowest bits set, max_end holds the max end within its subtree
+struct T_interval_index {
+  struct T_interval {
+    int start, end;                                                             // 1-based, closed
+    int max_end;                                                                // max end of the subtree
+    int id;                                                                     // 0-based row of BED
+  };
+  struct T_ref {
+    size_t offset = 0, n = 0;                                                   // intervals of this reference
+    int max_level = -1;                                                         // level of the root, -1 if none
+  };
+  std::vector<T_interval> intervals;
+  std::vector<T_ref> refs;                                                      // by rname
+  
+  T_interval_index() {}
+  
+  // intervals with NA_INTEGER rname are skipped
+  T_interval_index(const std::vector<int> &rname, const std::vector<int> &start,
+                   const std::vector<int> &end) {
+    std::vector<std::pair<int,size_t>> order;                                   // (rname, id)
+    for (size_t i=0; i<rname.size(); i++) {
+      if (rname[i]==NA_INTEGER || rname[i]<0) continue;
+      order.emplace_back(rname[i], i);
+      if ((size_t)rname[i] >= refs.size()) refs.resize(rname[i] + 1);
+    }
+    std::sort(order.begin(), order.end(),
+              [&start] (const std::pair<int,size_t> &a, const std::pair<int,size_t> &b) {
+                return (a.first < b.first) ||
+                  ((a.first == b.first) && (start[a.second] < start[b.second]));
+              });
+    intervals.reserve(order.size());
+    for (size_t i=0; i<order.size(); i++) {
+      const size_t id = order[i].second;
+      intervals.push_back({start[id], end[id], end[id], (int)id});
+      T_ref &ref = refs[order[i].first];
+      if (ref.n==0) ref.offset = i;
+      ref.n++;
+    }
+    for (size_t r=0; r<refs.size(); r++)
+      refs[r].max_level = index(intervals.data() + refs[r].offset, refs[r].n);
+  }
+  
+  // augments the tree, returns the level of the root
+  static int index(T_interval *a, const size_t n) {
+    if (n==0) return -1;
+    size_t last_i = 0;
+    int last = 0, k;
+    for (size_t i=0; i<n; i+=2) { last_i = i; last = a[i].max_end = a[i].end; } // leaves
+    for (k=1; ((size_t)1<<k) <= n; k++) {
+      const size_t x = (size_t)1 << (k-1), i0 = (x<<1) - 1, step = x<<2;
+      for (size_t i=i0; i<n; i+=step) {
+        const int el = a[i-x].max_end;                                          // max end of the left child
+        const int er = i+x < n ? a[i+x].max_end : last;                         // max end of the right child
+        a[i].max_end = std::max(a[i].end, std::max(el, er));
+      }
+      last_i = (last_i>>k & 1) ? last_i - x : last_i + x;
+      if ((last_i < n) && (a[last_i].max_end > last)) last = a[last_i].max_end;
+    }
+    return k - 1;
+  }
+  
+  // min id of intervals with start <= qend and end >= qstart, -1 if none.
+  // Bounds may be inverted: capture queries of reads shorter than
+  // 2*min_overlap-1 bases have qstart > qend, yet overlap long targets
+  int first_overlap(int rname, int qstart, int qend) const {
+    if ((rname<0) || ((size_t)rname >= refs.size())) return -1;
+    const T_ref &ref = refs[rname];
+    if (ref.n==0) return -1;
+    const T_interval *a = intervals.data() + ref.offset;
+    const size_t n = ref.n;
+    int res = -1;
+    #define check_interval(i) {      /* overlapping and earlier in BED order */\
+      if ((qstart <= a[i].end) && ((res<0) || (a[i].id<res))) res = a[i].id;   \
+    }
+    struct T_node { size_t x; int k; bool visited; } stack[64];
+    int t = 0;
+    stack[t++] = {((size_t)1 << ref.max_level) - 1, ref.max_level, false};     // root
+    while (t > 0) {
+      const T_node z = stack[--t];
+      if (z.k <= 3) {                                                           // small subtree, linear scan
+        const size_t i0 = z.x >> z.k << z.k;
+        const size_t i1 = std::min(n, i0 + ((size_t)1 << (z.k+1)) - 1);
+        for (size_t i=i0; (i<i1) && (a[i].start<=qend); i++) check_interval(i);
+      } else if (!z.visited) {                                                  // left child first
+        const size_t y = z.x - ((size_t)1 << (z.k-1));
+        stack[t++] = {z.x, z.k, true};
+        if ((y >= n) || (a[y].max_end >= qstart)) stack[t++] = {y, z.k-1, false};
+      } else if ((z.x < n) && (a[z.x].start <= qend)) {                         // this node and its right child
+        check_interval(z.x);
+        stack[t++] = {z.x + ((size_t)1 << (z.k-1)), z.k-1, false};
+      }
+    }
+    #undef check_interval
+    return res;
+  }
+};
+
+// matches templates to BED targets: amplicons by start *or* end plus/minus
+// tolerance, capture targets by overlap of at least min_overlap bases
+struct T_target_matcher {
+  bool amplicon;
+  int tolerance, min_overlap;
+  T_interval_index starts, ends;                                                // amplicon starts and ends as points, or capture targets
+  
+  T_target_matcher(Rcpp::DataFrame &bed, bool amplicon, int tolerance,
+                   int min_overlap) :
+    amplicon(amplicon), tolerance(tolerance), min_overlap(min_overlap) {
+    std::vector<int> bed_chr = Rcpp::as<std::vector<int>>(bed["seqnames"]);     // BED rname
+    std::vector<int> bed_start = Rcpp::as<std::vector<int>>(bed["start"]);      // BED start
+    std::vector<int> bed_end = Rcpp::as<std::vector<int>>(bed["end"]);          // BED end
+    if (amplicon) {
+      starts = T_interval_index(bed_chr, bed_start, bed_start);
+      ends = T_interval_index(bed_chr, bed_end, bed_end);
+    } else {
+      for (size_t i=0; i<bed_chr.size(); i++)                                   // targets shorter than min overlap never match
+        if (bed_end[i] - bed_start[i] + 1 < min_overlap) bed_chr[i] = NA_INTEGER;
+      starts = T_interval_index(bed_chr, bed_start, bed_end);
+    }
+  }
+  
+  // 0-based BED row of the first matching target, -1 if none. For capture,
+  // overlap = min(ends) - max(starts) + 1 >= min_overlap, i.e. target starts
+  // at or before read end - min_overlap + 1, and ends at or after
+  // read start + min_overlap - 1 (given both are at least min_overlap long)
+  inline int match(int rname, int start, int end) const {
+    if (amplicon) {
+      const int by_start = starts.first_overlap(rname, start - tolerance, start + tolerance);
+      const int by_end = ends.first_overlap(rname, end - tolerance, end + tolerance);
+      return (by_start<0) || ((by_end>=0) && (by_end<by_start)) ? by_end : by_start;
+    }
+    if (end - start + 1 < min_overlap) return -1;
+    return starts.first_overlap(rname, start + min_overlap - 1, end - min_overlap + 1);
+  }
+};
+
+
+// covered segment of sparse template
+struct T_segment {
+  uint32_t pos, len;                                                            // 0-based start within the template, length
+};
+
+// storage of templates. Vectors are filled while loading, while kernels use
+// pointers that are set by sync() - to vectors or to memory-mapped cache file
+struct T_templates {
+  bool packed = false;                                                          // layout: XM+SEQ chars or 4+4 bits
+  bool sparse = false;                                                          // covered segments only, uint32 nseg + T_segment[nseg] before their bytes
+  std::vector<uint8_t> arena;                                                   // bytes of all templates, back to back
+  std::vector<uint64_t> offset;                                                 // offset of every template within arena
+  std::vector<uint32_t> width;                                                  // length of every template
+  std::vector<T_counts> counts;                                                 // XM char counts of every template
+  
+  size_t n = 0;                                                                 // number of templates
+  uint64_t arena_size = 0;                                                      // and their total size in bytes
+  const uint8_t *arena_p = NULL;                                                // read-only data used by kernels
+  const uint64_t *offset_p = NULL;
+  const uint32_t *width_p = NULL;
+  const T_counts *counts_p = NULL;
+  void *map_addr = NULL;                                                        // memory-mapped cache file, if any
+  size_t map_size = 0;
+  std::string map_file;                                                         // and its name
+  unsigned int seg_n[9];                                                        // counts of the sparse template being pushed
+  size_t seg_pos = 0;                                                           // and the position of its next T_segment in arena
+  
+  T_templates() {}
+  T_templates(const T_templates&) = delete;
+  ~T_templates() { unmap(); }
+  
+  inline size_t ntempls() const { return n; }
+  inline const uint8_t* data(size_t x) const { return arena_p + offset_p[x]; }
+  
+  void sync() {                                                                 // to call after vectors were changed
+    n = width.size(); arena_size = arena.size();
+    arena_p = arena.data(); offset_p = offset.data();
+    width_p = width.data(); counts_p = counts.data();
+  }
+  
+  void unmap();                                                                 // release cache file, see rcpp_cache.cpp
+  
+  inline void put(const uint8_t *seq, const uint8_t *xm, uint32_t size,        // bytes of SEQ chars (nt16 codes if packed) and XM chars
+                  unsigned int *n) {                                            // while counting XM chars
+    if (packed) {
+      for (uint32_t i=0; i<size; i++) {
+        const uint8_t idx = ctx_to_idx(xm[i]);
+        n[idx_to_slot[idx]]++;
+        arena.push_back((seq[i] << 4) | idx);
+      }
+    } else {
+      for (uint32_t i=0; i<size; i++) n[idx_to_slot[ctx_to_idx(xm[i])]]++;
+      arena.insert(arena.end(), xm, xm+size);
+      arena.insert(arena.end(), seq, seq+size);
+    }
+  }
+  
+  inline void push_counts(const unsigned int *n) {                              // first 8 slots, the rest is not counted
+    T_counts c;
+    std::copy(n, n + c.size(), c.begin());
+    counts.push_back(c);
+  }
+  
+  inline void push(const uint8_t *seq, const uint8_t *xm, uint32_t size) {      // dense template
+    offset.push_back(arena.size());
+    width.push_back(size);
+    unsigned int n[9] = {0};                                                    // counts + 1 slot for the rest
+    put(seq, xm, size, n);
+    push_counts(n);
+  }
+  
+  inline void begin_segments(uint32_t size, uint32_t nseg) {                    // sparse template, followed by nseg push_segment calls
+    offset.push_back(arena.size());
+    width.push_back(size);
+    std::fill(seg_n, seg_n + 9, 0);
+    const uint8_t *p = (const uint8_t*) &nseg;
+    arena.insert(arena.end(), p, p + sizeof(nseg));
+    seg_pos = arena.size();
+    arena.resize(seg_pos + nseg * sizeof(T_segment));
+  }
+  
+  inline void push_segment(uint32_t pos, const uint8_t *seq,                    // segment, in order of positions
+                           const uint8_t *xm, uint32_t len) {
+    const T_segment seg = {pos, len};
+    memcpy(arena.data() + seg_pos, &seg, sizeof(seg));
+    seg_pos += sizeof(seg);
+    put(seq, xm, len, seg_n);
+  }
+  
+  inline void end_segments() { push_counts(seg_n); }
+  
+  void clear() {                                                                // keeping capacity
+    arena.clear(); offset.clear(); width.clear(); counts.clear();
+  }
+  
+  void append(const T_templates &other) {                                       // templates of the same layout, e.g. from another thread
+    const uint64_t shift = arena.size();
+    arena.insert(arena.end(), other.arena.begin(), other.arena.end());
+    for (size_t x=0; x<other.offset.size(); x++)
+      offset.push_back(other.offset[x] + shift);
+    width.insert(width.end(), other.width.begin(), other.width.end());
+    counts.insert(counts.end(), other.counts.begin(), other.counts.end());
+  }
+  
+  inline void push_copy(const T_templates &other, size_t x) {                   // template x of the same layout, other must be synced
+    offset.push_back(arena.size());
+    width.push_back(other.width_p[x]);
+    counts.push_back(other.counts_p[x]);
+    arena.insert(arena.end(), other.data(x), other.data(x) + other.bytes(x));
+  }
+  
+  inline uint64_t bytes(size_t x) const {                                       // bytes occupied by template
+    if (!sparse) return packed ? width_p[x] : (uint64_t)width_p[x] << 1;
+    uint64_t covered = 0;
+    for_each_segment(x, [&] (uint32_t, uint32_t len, const uint8_t*) { covered += len; });
+    uint32_t nseg;
+    memcpy(&nseg, data(x), sizeof(nseg));
+    return sizeof(nseg) + nseg * sizeof(T_segment) + (packed ? covered : covered << 1);
+  }
+  
+  template <class F>
+  inline void for_each_segment(size_t x, F fn) const {                          // fn(pos, len, bytes) for every covered segment
+    const uint8_t *p = data(x);
+    if (!sparse) { fn(0, width_p[x], p); return; }
+    uint32_t nseg;
+    memcpy(&nseg, p, sizeof(nseg));
+    const uint8_t *seg_p = p + sizeof(nseg);
+    p = seg_p + nseg * sizeof(T_segment);
+    for (uint32_t k=0; k<nseg; k++) {
+      T_segment seg;
+      memcpy(&seg, seg_p + k * sizeof(seg), sizeof(seg));                       // arena is not aligned
+      fn(seg.pos, seg.len, p);
+      p += packed ? seg.len : seg.len << 1;
+    }
+  }
+  
+  void relayout(const int *order, size_t nrows) {                               // copy templates in the given order, renumbering them
+    std::vector<uint8_t> new_arena;
+    std::vector<uint64_t> new_offset;
+    std::vector<uint32_t> new_width;
+    std::vector<T_counts> new_counts;
+    new_arena.reserve(arena_size);
+    new_offset.reserve(nrows);
+    new_width.reserve(nrows);
+    new_counts.reserve(nrows);
+    for (size_t i=0; i<nrows; i++) {
+      const size_t x = order[i];
+      new_offset.push_back(new_arena.size());
+      new_width.push_back(width_p[x]);
+      new_counts.push_back(counts_p[x]);
+      new_arena.insert(new_arena.end(), data(x), data(x) + bytes(x));
+    }
+    unmap();                                                                    // no need in cache file anymore
+    arena.swap(new_arena);
+    offset.swap(new_offset);
+    width.swap(new_width);
+    counts.swap(new_counts);
+    sync();
+  }
+};
+
+
+// accessor for default layout: XM and SEQ chars. xm() and seq() are for
+// dense templates, for_each_segment(x, fn) calls fn(pos, len, xm, seq) for
+// every covered segment of either
+struct T_unpacked_view {
+  const T_templates *templs;
+  
+  inline size_t ntempls() const { return templs->n; }
+  inline size_t size(size_t x) const { return templs->width_p[x]; }
+  inline const uint8_t* xm(size_t x) const { return templs->data(x); }
+  inline const uint8_t* seq(size_t x) const { return xm(x) + templs->width_p[x]; }
+  template <class F> inline void for_each_segment(size_t x, F fn) const {
+    templs->for_each_segment(x, [&] (uint32_t pos, uint32_t len, const uint8_t *p) { fn(pos, len, p, p + len); });
+  }
+  static inline char xm_char(const uint8_t *p, size_t i) { return p[i]; }
+  static inline unsigned int xm_idx(const uint8_t *p, size_t i) { return ctx_to_idx(p[i]); }
+  static inline char seq_char(const uint8_t *p, size_t i) { return p[i]; }
+};
+
+// accessor for compact layout: XM and SEQ share the same byte
+struct T_packed_view {
+  const T_templates *templs;
+  
+  inline size_t ntempls() const { return templs->n; }
+  inline size_t size(size_t x) const { return templs->width_p[x]; }
+  inline const uint8_t* xm(size_t x) const { return templs->data(x); }
+  inline const uint8_t* seq(size_t x) const { return xm(x); }
+  template <class F> inline void for_each_segment(size_t x, F fn) const {
+    templs->for_each_segment(x, [&] (uint32_t pos, uint32_t len, const uint8_t *p) { fn(pos, len, p, p); });
+  }
+  static inline char xm_char(const uint8_t *p, size_t i) { return idx_to_ctx[p[i] & 15]; }
+  static inline unsigned int xm_idx(const uint8_t *p, size_t i) { return p[i] & 15; }
+  static inline char seq_char(const uint8_t *p, size_t i) { return nt16_to_seq[p[i] >> 4]; }
+};
+
+
+// wall and CPU time (in seconds) of kernel stages, returned by kernels as
+// "timing" attribute. CPU time is of the whole process, i.e. includes HTSlib
+// and worker threads. Laps with the same stage name are summed up
+struct T_timer {
+  std::vector<std::string> stages;
+  std::vector<double> wall, cpu;
+  std::chrono::steady_clock::time_point wall_last;
+  std::clock_t cpu_last;
+  
+  T_timer() { reset(); }
+  
+  inline void reset() {                                                         // start next lap
+    wall_last = std::chrono::steady_clock::now();
+    cpu_last = std::clock();
+  }
+  
+  void lap(const std::string &stage) {                                          // time since the last lap goes to the stage
+    const std::chrono::steady_clock::time_point wall_now = std::chrono::steady_clock::now();
+    const std::clock_t cpu_now = std::clock();
+    size_t i = 0;
+    while ((i<stages.size()) && (stages[i]!=stage)) i++;
+    if (i==stages.size()) {
+      stages.push_back(stage); wall.push_back(0); cpu.push_back(0);
+    }
+    wall[i] += std::chrono::duration<double>(wall_now - wall_last).count();
+    cpu[i] += (double)(cpu_now - cpu_last) / CLOCKS_PER_SEC;
+    wall_last = wall_now; cpu_last = cpu_now;
+  }
+  
+  Rcpp::NumericMatrix wrap() const {                                            // matrix of stages x (wall, cpu)
+    Rcpp::NumericMatrix res (stages.size(), 2);
+    for (size_t i=0; i<stages.size(); i++) {
+      res[i] = wall[i];
+      res[i + stages.size()] = cpu[i];
+    }
+    std::vector<std::string> cols = {"wall", "cpu"};
+    res.attr("dimnames") = Rcpp::List::create(stages, cols);
+    return res;
+  }
+};
+
+
+// consumer of templates of coordinate-sorted BAM file, which are passed
+// in windows instead of being kept in memory (see stream_bam). Templates of
+// the later windows of the same reference have no bases before safe_pos
+struct T_template_sink {
+  std::vector<std::string> chromosomes;                                         // reference names, set before the first window
+  virtual ~T_template_sink() {}
+  virtual void consume(const std::vector<int> &rname,                           // RNAME+1, POS+1 and STRAND of templates in the window
+                       const std::vector<int> &strand,
+                       const std::vector<int> &start,
+                       const T_templates &templs,                               // their SEQ+XM, default layout
+                       const int safe_pos) = 0;                                 // 1-based
+};
+
+// templates spilled to disk while loading BAM file with limited memory, see
+// rcpp_cache.cpp. Every spill is a run of templates sorted by rname and start,
+// written as a cache file. When loading is complete, runs are merged into a
+// single cache file which is memory-mapped, so that templates are paged in and
+// out by OS. Temporary files are removed when going out of scope, i.e. also
+// on error or interrupt. Methods return error message, empty if none
+struct T_spill {
+  std::string prefix;                                                           // run files are prefix.1, prefix.2, ...
+  bool main_thread;                                                             // TRUE if R interrupts can be checked
+  std::vector<std::string> files;                                               // temporary files
+  
+  T_spill(const std::string &prefix, bool main_thread) :
+    prefix(prefix), main_thread(main_thread) {}
+  T_spill(const T_spill&) = delete;
+  ~T_spill();
+  
+  std::string write_run(const std::vector<std::string> &levels,                 // sorts and writes templates, which can be cleared then
+                        const std::vector<int> &rname,
+                        const std::vector<int> &strand,
+                        const std::vector<int> &start,
+                        T_templates &templs);
+  std::string merge(const std::vector<std::string> &levels,                     // spills the rest and replaces all with the merged runs
+                    std::vector<int> &rname, std::vector<int> &strand,
+                    std::vector<int> &start,
+                    std::unique_ptr<T_templates> &templs);
+};
+
+// reads BAM file in windows of templates, see rcpp_read_bam.cpp. Returns
+// reader stats with timing attribute
+Rcpp::NumericVector stream_bam(const std::string &fn, int min_mapq,
+                               int min_baseq, bool skip_duplicates,
+                               int nthreads, std::vector<std::string> regions,
+                               T_template_sink *sink);
+
+
+// attaches timing to the kernel result, closing the last stage
+template <typename T>
+inline T with_timing(T res, T_timer &timer, const std::string &stage) {
+  timer.lap(stage);
+  res.attr("timing") = timer.wrap();
+  return res;
+}
+
+
+// templates attached to the data frame with BAM data
+#define get_templates(df)                                                      \
+  Rcpp::XPtr<T_templates>((SEXP)(df).attr("templ_xptr")).get()
+
+// calls kernel with the accessor matching the layout of BAM data
+#define dispatch_view(df, kernel, ...) (                                       \
+  (get_templates(df)->packed) ?                                                \
+    kernel(T_packed_view {get_templates(df)}, __VA_ARGS__) :                   \
+    kernel(T_unpacked_view {get_templates(df)}, __VA_ARGS__)                   \
+)
+
+
+// runs fn(from, to) over consecutive blocks of [0, n) items using nthreads
+// threads, the calling one included. Blocks are small enough to stay in
+// cache and are taken in order from the shared counter. User interrupts are
+// checked by the calling thread only, so fn must not call R API. If fn takes
+// the third argument, it gets the index of the thread in [0, nthreads), e.g.
+// to accumulate into per-thread buffers that are reduced afterwards. The
+// first exception thrown by fn in other threads stops all of them and is
+// thrown again by the calling thread
+template <class F>
+void parallel_blocks(const size_t n, const int nthreads, F fn,
+                     const size_t block = 0x10000)
+{
+  std::atomic<size_t> next (0);
+  std::atomic<bool> stop (false);
+  std::exception_ptr error;                                                     // the first one of other threads
+  std::mutex error_mtx;
+  auto work = [&] (const size_t thread) {
+    size_t done = 0;
+    for (size_t b=next++; !stop && (b*block < n); b=next++) {
+      if constexpr (std::is_invocable_v<F, size_t, size_t, size_t>)
+        fn(b*block, std::min(n, (b+1)*block), thread);
+      else
+        fn(b*block, std::min(n, (b+1)*block));
+      if ((thread==0) && ((++done & 0xF) == 0)) Rcpp::checkUserInterrupt();     // every 16 blocks
+    }
+  };
+  auto guarded_work = [&] (const size_t thread) {                               // for threads other than the calling one
+    try {
+      work(thread);
+    } catch (...) {
+      std::lock_guard<std::mutex> lock (error_mtx);
+      if (!error) error = std::current_exception();
+      stop = true;
+    }
+  };
+  
+  const size_t nblocks = (n + block - 1) / block;
+  std::vector<std::thread> workers;
+  for (size_t t=1; (t<(size_t)std::max(nthreads, 1)) && (t<nblocks); t++)
+    workers.emplace_back(guarded_work, t);
+  try {
+    work(0);
+  } catch (...) {                                                               // interrupted: let workers finish
+    stop = true;
+    for (size_t t=0; t<workers.size(); t++) workers[t].join();
+    throw;
+  }
+  for (size_t t=0; t<workers.size(); t++) workers[t].join();
+  if (error) std::rethrow_exception(error);
+}
+
+#endif // EPIALLELER_H
@@ -0,0 +1,486 @@
+#include <Rcpp.h>
+#include <cstdio>
+#include <queue>
+#include <memory>
+#include <atomic>
+#include "epialleleR.h"
+#include <sys/stat.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#else
+#include <process.h>
+#include <cstdlib>
+#endif
+// using namespace Rcpp;
+
+// Binary cache of preprocessed BAM data. Can be memory-mapped, so template
+// data is used in place (zero copy) and is shared between the processes
+// working with the same file. Columns of the data frame (12 bytes per template)
+// are copied. Cache must be read on the platform of the same endianness.
+// Files are written under a temporary name and renamed when complete, so the
+// pages mapped by this or other processes are never truncated.
+//
+// Layout, every section is aligned to 8 bytes:
+//   T_cache_header
+//   rname levels, NUL-terminated strings
+//   rname, strand, start (int32 x ntempls each)
+//   offset (uint64 x ntempls)
+//   width (uint32 x ntempls)
+//   counts (T_counts x ntempls)
+//   arena (arena_size bytes)
+
+#define CACHE_MAGIC "epiCACHE"
+#define CACHE_VERSION 3
+
+struct T_cache_header {
+  char magic[8];                                                                // CACHE_MAGIC, no trailing NUL
+  uint32_t version;                                                             // CACHE_VERSION
+  uint32_t endian;                                                              // 0x01020304 as written
+  uint32_t packed;                                                              // layout of templates
+  uint32_t sparse;                                                              // covered segments only
+  uint32_t nlevels;                                                             // number of rname levels
+  uint32_t reserved;                                                            // zero
+  uint64_t levels_size;                                                         // size of rname levels, bytes
+  uint64_t ntempls;                                                             // number of templates
+  uint64_t arena_size;                                                          // size of template arena, bytes
+};
+
+#define align8(x) (((x) + 7) & ~((uint64_t)7))
+
+
+// releases memory-mapped (or, on Windows, loaded) cache file
+void T_templates::unmap()
+{
+  if (map_addr==NULL) return;
+#ifndef _WIN32
+  munmap(map_addr, map_size);
+#else
+  free(map_addr);
+#endif
+  map_addr = NULL; map_size = 0;
+  map_file.clear();
+}
+
+
+// TRUE if both names point to the same existing file
+static bool same_file(const std::string &a, const std::string &b)
+{
+  if (a.empty() || b.empty()) return false;
+#ifndef _WIN32
+  struct stat sa, sb;
+  return (stat(a.c_str(), &sa) == 0) && (stat(b.c_str(), &sb) == 0) &&
+    (sa.st_dev == sb.st_dev) && (sa.st_ino == sb.st_ino);
+#else
+  char fa[_MAX_PATH], fb[_MAX_PATH];
+  return (_fullpath(fa, a.c_str(), _MAX_PATH) != NULL) &&
+    (_fullpath(fb, b.c_str(), _MAX_PATH) != NULL) && (_stricmp(fa, fb) == 0);
+#endif
+}
+
+
+#ifndef _WIN32
+#define fseek64 fseeko
+#else
+#define fseek64 _fseeki64
+#endif
+
+// writes cache file row by row. Sections are filled through small buffers,
+// i.e. the number of templates and the size of arena must be known in advance,
+// while memory use doesn't depend on them. Rows go to a temporary file next
+// to the target, which replaces the target only if everything was written
+struct T_cache_writer {
+  FILE *fp = NULL;
+  std::string fn, tmp_fn;                                                       // target and temporary file
+  bool ok = false;                                                              // FALSE if opening or writing failed
+  uint64_t ntempls, arena_size;                                                 // as promised in the header
+  uint64_t n = 0, arena_pos = 0;                                                // rows and arena bytes added so far
+  uint64_t pos[7];                                                              // current file positions of sections, rname..arena
+  std::vector<int32_t> rname, strand, start;                                    // buffers of sections
+  std::vector<uint64_t> offset;
+  std::vector<uint32_t> width;
+  std::vector<T_counts> counts;
+  std::vector<uint8_t> arena;
+  
+  T_cache_writer(const std::string &fn, const std::vector<std::string> &levels,
+                 const bool packed, const bool sparse, const uint64_t ntempls,
+                 const uint64_t arena_size) :
+    fn(fn), ntempls(ntempls), arena_size(arena_size) {
+    static std::atomic<unsigned int> serial (0);                                // unique within the process
+#ifndef _WIN32
+    const int pid = getpid();
+#else
+    const int pid = _getpid();
+#endif
+    tmp_fn = fn + "." + std::to_string(pid) + "." + std::to_string(serial++) + ".tmp";
+    T_cache_header hdr;
+    memcpy(hdr.magic, CACHE_MAGIC, 8);
+    hdr.version = CACHE_VERSION;
+    hdr.endian = 0x01020304;
+    hdr.packed = packed;
+    hdr.sparse = sparse;
+    hdr.nlevels = levels.size();
+    hdr.reserved = 0;
+    std::string levels_block;
+    for (size_t i=0; i<levels.size(); i++) levels_block.append(levels[i].c_str(), levels[i].size() + 1);
+    hdr.levels_size = levels_block.size();
+    hdr.ntempls = ntempls;
+    hdr.arena_size = arena_size;
+    
+    pos[0] = sizeof(hdr) + align8(hdr.levels_size);                             // rname
+    pos[1] = pos[0] + align8(ntempls * sizeof(int32_t));                        // strand
+    pos[2] = pos[1] + align8(ntempls * sizeof(int32_t));                        // start
+    pos[3] = pos[2] + align8(ntempls * sizeof(int32_t));                        // offset
+    pos[4] = pos[3] + align8(ntempls * sizeof(uint64_t));                       // width
+    pos[5] = pos[4] + align8(ntempls * sizeof(uint32_t));                       // counts
+    pos[6] = pos[5] + align8(ntempls * sizeof(T_counts));                       // arena
+    
+    fp = fopen(tmp_fn.c_str(), "wb");
+    ok = (fp!=NULL) && (fwrite(&hdr, sizeof(hdr), 1, fp) == 1) &&               // padding is left to the gaps between sections
+      (fwrite(levels_block.data(), 1, levels_block.size(), fp) == levels_block.size());
+  }
+  T_cache_writer(const T_cache_writer&) = delete;
+  ~T_cache_writer() {                                                           // on error or interrupt, target is left as it was
+    if (fp) { fclose(fp); std::remove(tmp_fn.c_str()); }
+  }
+  
+  template <typename T>
+  void flush(const int section, std::vector<T> &buf) {                          // buffer goes to its section
+    if (buf.empty()) return;
+    const size_t bytes = buf.size() * sizeof(T);
+    ok = ok && (fseek64(fp, pos[section], SEEK_SET) == 0) &&
+      (fwrite(buf.data(), 1, bytes, fp) == bytes);
+    pos[section] += bytes;
+    buf.clear();
+  }
+  
+  void flush_all() {
+    flush(0, rname); flush(1, strand); flush(2, start);
+    flush(3, offset); flush(4, width); flush(5, counts);
+    flush(6, arena);
+  }
+  
+  inline void add(const int rname_x, const int strand_x, const int start_x,     // row, and its template x
+                  const T_templates &templs, const size_t x) {
+    rname.push_back(rname_x);
+    strand.push_back(strand_x);
+    start.push_back(start_x);
+    offset.push_back(arena_pos);
+    width.push_back(templs.width_p[x]);
+    counts.push_back(templs.counts_p[x]);
+    arena.insert(arena.end(), templs.data(x), templs.data(x) + templs.bytes(x));
+    arena_pos += templs.bytes(x);
+    n++;
+    if (rname.size() >= 0xFFFF) flush_all();
+    else if (arena.size() >= 0xFFFFF) flush(6, arena);
+  }
+  
+  bool close() {                                                                // TRUE if everything was written and renamed
+    flush_all();
+    ok = ok && (n==ntempls) && (arena_pos==arena_size);
+    ok = (fp!=NULL) && (fclose(fp) == 0) && ok;
+    fp = NULL;
+#ifdef _WIN32
+    if (ok) std::remove(fn.c_str());                                            // rename doesn't replace files on Windows
+#endif
+    ok = ok && (std::rename(tmp_fn.c_str(), fn.c_str()) == 0);
+    if (!ok) std::remove(tmp_fn.c_str());
+    return ok;
+  }
+};
+
+
+// [[Rcpp::export("rcpp_write_cache")]]
+Rcpp::NumericMatrix rcpp_write_cache(Rcpp::DataFrame &df,                       // data frame with BAM data
+                                     std::string fn)                            // cache file name
+{
+  T_timer timer;
+  Rcpp::IntegerVector rname   = df["rname"];                                    // template rname
+  Rcpp::IntegerVector strand  = df["strand"];                                   // template strand
+  Rcpp::IntegerVector start   = df["start"];                                    // template start
+  Rcpp::IntegerVector templid = df["templid"];                                  // template id, effectively holds indexes of corresponding templates
+  T_templates *templs = get_templates(df);                                      // merged refspaced templates
+  std::vector<std::string> levels =                                             // reference names
+    Rcpp::as<std::vector<std::string>>(rname.attr("levels"));
+  const uint64_t n = templid.size();
+  if (same_file(fn, templs->map_file))
+    Rcpp::stop("Cache file can't be overwritten by the data it holds");
+  
+  // templates are written in the order of rows
+  uint64_t arena_size = 0;
+  for (uint64_t x=0; x<n; x++) arena_size += templs->bytes(templid[x]);
+  T_cache_writer writer (fn, levels, templs->packed, templs->sparse, n,
+                         arena_size);
+  if (!writer.ok) Rcpp::stop("Unable to open cache file for writing");
+  for (uint64_t x=0; x<n; x++) {
+    if ((x & 0xFFFFF) == 0) Rcpp::checkUserInterrupt();
+    writer.add(rname[x], strand[x], start[x], *templs, templid[x]);
+  }
+  if (!writer.close()) Rcpp::stop("Unable to write cache file");
+  
+  timer.lap("write");
+  return timer.wrap();                                                          // timing only
+}
+
+
+// cache file mapped into memory, released with its templates
+struct T_cache_map {
+  std::unique_ptr<T_templates> templs {new T_templates};                        // owns the memory
+  std::vector<std::string> chromosomes;                                         // vector of reference names
+  const int32_t *rname_p = NULL, *strand_p = NULL, *start_p = NULL;             // columns of the data frame
+};
+
+// TRUE if template x (and segments of sparse one) lies within the arena
+static bool template_fits(const T_templates &templs, const uint64_t x)
+{
+  const uint64_t offset = templs.offset_p[x], width = templs.width_p[x];
+  if (offset > templs.arena_size) return false;
+  const uint64_t avail = templs.arena_size - offset;
+  const uint64_t bpp = templs.packed ? 1 : 2;                                   // bytes per position
+  if (!templs.sparse) return width * bpp <= avail;
+  uint32_t nseg;
+  if (avail < sizeof(nseg)) return false;
+  memcpy(&nseg, templs.arena_p + offset, sizeof(nseg));
+  uint64_t used = sizeof(nseg) + (uint64_t)nseg * sizeof(T_segment);
+  if (used > avail) return false;
+  for (uint32_t k=0; k<nseg; k++) {
+    T_segment seg;
+    memcpy(&seg, templs.arena_p + offset + sizeof(nseg) + k * sizeof(seg), sizeof(seg));
+    if ((uint64_t)seg.pos + seg.len > width) return false;
+    used += seg.len * bpp;
+    if (used > avail) return false;
+  }
+  return true;
+}
+
+// maps (or reads) the whole file. Returns error message, empty if none.
+// Doesn't use R API
+static std::string map_cache(const std::string &fn, T_cache_map *cache)
+{
+  void *addr = NULL;
+  size_t size = 0;
+#ifndef _WIN32
+  int fd = open(fn.c_str(), O_RDONLY);
+  if (fd<0) return "Unable to open cache file for reading";
+  struct stat st;
+  if (fstat(fd, &st) != 0) { close(fd); return "Unable to get size of cache file"; }
+  size = st.st_size;
+  if (size < sizeof(T_cache_header)) { close(fd); return "Cache file is truncated"; }
+  addr = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);                        // shared between the processes using the same file
+  close(fd);
+  if (addr==MAP_FAILED) return "Unable to map cache file into memory";
+#else
+  FILE *fp = fopen(fn.c_str(), "rb");
+  if (fp==NULL) return "Unable to open cache file for reading";
+  _fseeki64(fp, 0, SEEK_END);
+  size = _ftelli64(fp);
+  _fseeki64(fp, 0, SEEK_SET);
+  addr = malloc(size);
+  if ((addr==NULL) || (fread(addr, 1, size, fp) != size)) {
+    fclose(fp); free(addr);
+    return "Unable to read cache file";
+  }
+  fclose(fp);
+#endif
+  
+  T_templates *templs = cache->templs.get();                                    // from now on owns the memory
+  templs->map_addr = addr;
+  templs->map_size = size;
+  templs->map_file = fn;
+  
+  // check header and sizes. Sizes are bounded by the size of file first, so
+  // that the sum of sections can't overflow
+  const uint8_t *p = (const uint8_t*) addr;
+  T_cache_header hdr;
+  memcpy(&hdr, p, sizeof(hdr));
+  if (memcmp(hdr.magic, CACHE_MAGIC, 8) != 0) return "Not a cache file";
+  if (hdr.version != CACHE_VERSION) return "Unsupported version of cache file";
+  if (hdr.endian != 0x01020304) return "Cache file was written on a platform with different byte order";
+  const uint64_t n = hdr.ntempls;
+  if ((hdr.levels_size > size) || (n > size) || (hdr.arena_size > size))
+    return "Cache file is truncated";
+  const uint64_t expected = sizeof(hdr) + align8(hdr.levels_size) +
+    3 * align8(n * sizeof(int32_t)) + align8(n * sizeof(uint64_t)) +
+    align8(n * sizeof(uint32_t)) + align8(n * sizeof(T_counts)) + hdr.arena_size;
+  if (size < expected) return "Cache file is truncated";
+  
+  // sections
+  p += sizeof(hdr);
+  const char *level = (const char*) p, *levels_end = level + hdr.levels_size;
+  for (uint32_t i=0; i<hdr.nlevels; i++) {                                      // every name ends within the block
+    const char *nul = (const char*) memchr(level, 0, levels_end - level);
+    if (nul==NULL) return "Cache file is corrupt (reference names)";
+    cache->chromosomes.emplace_back(level, nul - level);
+    level = nul + 1;
+  }
+  p += align8(hdr.levels_size);
+  cache->rname_p = (const int32_t*) p;              p += align8(n * sizeof(int32_t));
+  cache->strand_p = (const int32_t*) p;             p += align8(n * sizeof(int32_t));
+  cache->start_p = (const int32_t*) p;              p += align8(n * sizeof(int32_t));
+  templs->offset_p = (const uint64_t*) p;           p += align8(n * sizeof(uint64_t));
+  templs->width_p = (const uint32_t*) p;            p += align8(n * sizeof(uint32_t));
+  templs->counts_p = (const T_counts*) p;           p += align8(n * sizeof(T_counts));
+  templs->arena_p = p;
+  templs->arena_size = hdr.arena_size;
+  templs->n = n;
+  templs->packed = hdr.packed;
+  templs->sparse = hdr.sparse;
+  
+  // rows are checked once, so that kernels never read past the mapping
+  for (uint64_t x=0; x<n; x++) {
+    if ((cache->rname_p[x] < 1) || ((uint64_t)cache->rname_p[x] > hdr.nlevels) ||
+        (cache->strand_p[x] < 1) || (cache->strand_p[x] > 2))
+      return "Cache file is corrupt (row " + std::to_string(x+1) + ")";
+    if (!template_fits(*templs, x))
+      return "Cache file is corrupt (template " + std::to_string(x+1) + ")";
+  }
+  return "";
+}
+
+
+// [[Rcpp::export("rcpp_read_cache")]]
+Rcpp::DataFrame rcpp_read_cache(std::string fn)                                 // cache file name
+{
+  T_timer timer;
+  T_cache_map cache;
+  const std::string error = map_cache(fn, &cache);
+  if (!error.empty()) Rcpp::stop(error);                                        // the file is released on error as well
+  const uint64_t n = cache.templs->n;
+  const int32_t *col_rname_p = cache.rname_p;
+  const int32_t *col_strand_p = cache.strand_p;
+  const int32_t *col_start_p = cache.start_p;
+  timer.lap("map");
+  
+  // wrap and return the results
+  Rcpp::DataFrame res = Rcpp::DataFrame::create(                                // final DF
+    Rcpp::Named("rname") = Rcpp::IntegerVector(col_rname_p, col_rname_p + n),   // numeric ids (factor) for reference names
+    Rcpp::Named("strand") = Rcpp::IntegerVector(col_strand_p, col_strand_p + n),// numeric ids (factor) for reference strands
+    Rcpp::Named("start") = Rcpp::IntegerVector(col_start_p, col_start_p + n)    // start positions of reads
+  );
+  
+  // factor levels
+  std::vector<std::string> strands = {"+", "-"};
+  
+  Rcpp::IntegerVector col_rname = res["rname"];                                 // make rname a factor
+  col_rname.attr("class") = "factor";
+  col_rname.attr("levels") = cache.chromosomes;
+  
+  Rcpp::IntegerVector col_strand = res["strand"];                               // make strand a factor
+  col_strand.attr("class") = "factor";
+  col_strand.attr("levels") = strands;
+  
+  Rcpp::XPtr<T_templates> templ_xptr(cache.templs.release(), true);
+  res.attr("templ_xptr") = templ_xptr;                                          // external pointer to sequences and methylation strings
+  res.attr("templ_sorted") = true;                                              // written in the order of rows
+  timer.lap("output");
+  res.attr("timing") = timer.wrap();                                            // wall and CPU time of the stages
+  
+  return(res);
+}
+
+
+// Spilling of templates while loading BAM with limited memory (see T_spill in
+// epialleleR.h). Runs are cache files of sorted templates, which are mapped
+// and merged by a heap of their front rows. Ties are taken from the earlier
+// run, so the order is the same as after stable sorting of all templates
+
+T_spill::~T_spill()
+{
+  for (size_t i=0; i<files.size(); i++) std::remove(files[i].c_str());          // on error or interrupt as well
+}
+
+std::string T_spill::write_run(const std::vector<std::string> &levels,
+                               const std::vector<int> &rname,
+                               const std::vector<int> &strand,
+                               const std::vector<int> &start,
+                               T_templates &templs)
+{
+  templs.sync();
+  const size_t n = rname.size();
+  std::vector<uint32_t> order (n);
+  for (size_t x=0; x<n; x++) order[x] = x;
+  std::stable_sort(order.begin(), order.end(), [&] (uint32_t a, uint32_t b) {
+    return (rname[a] < rname[b]) || ((rname[a] == rname[b]) && (start[a] < start[b]));
+  });
+  
+  const std::string fn = prefix + "." + std::to_string(files.size() + 1);
+  files.push_back(fn);
+  T_cache_writer writer (fn, levels, templs.packed, templs.sparse, n,
+                         templs.arena_size);
+  for (size_t i=0; (i<n) && writer.ok; i++) {
+    if (main_thread && ((i & 0xFFFFF) == 0)) Rcpp::checkUserInterrupt();
+    writer.add(rname[order[i]], strand[order[i]], start[order[i]], templs, order[i]);
+  }
+  if (!writer.close()) return "Unable to write temporary file " + fn;
+  return "";
+}
+
+std::string T_spill::merge(const std::vector<std::string> &levels,
+                           std::vector<int> &rname, std::vector<int> &strand,
+                           std::vector<int> &start,
+                           std::unique_ptr<T_templates> &templs)
+{
+  std::string error;
+  if (!rname.empty()) {                                                         // the rest goes to the last run
+    error = write_run(levels, rname, strand, start, *templs);
+    if (!error.empty()) return error;
+  }
+  rname.clear(); strand.clear(); start.clear();
+  const bool packed = templs->packed, sparse = templs->sparse;
+  templs.reset(new T_templates);
+  
+  const size_t nruns = files.size();
+  std::vector<T_cache_map> runs (nruns);
+  uint64_t n = 0, arena_size = 0;
+  for (size_t r=0; r<nruns; r++) {
+    error = map_cache(files[r], &runs[r]);
+    if (!error.empty()) return error;
+    n += runs[r].templs->n;
+    arena_size += runs[r].templs->arena_size;
+  }
+  
+  // k-way merge
+  std::vector<uint64_t> next (nruns, 0);                                        // front rows of the runs
+  auto later = [&] (size_t a, size_t b) {                                       // TRUE if front row of run a goes after the one of b
+    const int32_t ra = runs[a].rname_p[next[a]], rb = runs[b].rname_p[next[b]];
+    const int32_t sa = runs[a].start_p[next[a]], sb = runs[b].start_p[next[b]];
+    return (ra > rb) || ((ra == rb) && ((sa > sb) || ((sa == sb) && (a > b))));
+  };
+  std::priority_queue<size_t, std::vector<size_t>, decltype(later)> heap (later);
+  for (size_t r=0; r<nruns; r++) if (runs[r].templs->n > 0) heap.push(r);
+  
+  const std::string fn = prefix + ".merged";
+  files.push_back(fn);
+  T_cache_writer writer (fn, levels, packed, sparse, n, arena_size);
+  for (uint64_t i=0; !heap.empty() && writer.ok; i++) {
+    if (main_thread && ((i & 0xFFFFF) == 0)) Rcpp::checkUserInterrupt();
+    const size_t r = heap.top();
+    heap.pop();
+    const uint64_t x = next[r]++;
+    const T_cache_map &run = runs[r];
+    writer.add(run.rname_p[x], run.strand_p[x], run.start_p[x], *run.templs, x);
+    if (next[r] < run.templs->n) heap.push(r);
+  }
+  if (!writer.close()) return "Unable to write temporary file " + fn;
+  runs.clear();                                                                 // unmap the runs
+  
+  // merged templates stay mapped, while the file itself can be removed (its
+  // pages are kept until unmapped). Not used on Windows, where cache files are
+  // read into memory (max.memory is rejected by preprocessBam)
+  T_cache_map merged;
+  error = map_cache(fn, &merged);
+  if (!error.empty()) return error;
+  rname.assign(merged.rname_p, merged.rname_p + n);
+  strand.assign(merged.strand_p, merged.strand_p + n);
+  start.assign(merged.start_p, merged.start_p + n);
+  templs.reset(merged.templs.release());
+  return "";
+}
+
+
+// #############################################################################
+// test code and sourcing don't work on OS X
+/*** R
+*/
+// #############################################################################
@@ -1,17 +1,23 @@
 #include <Rcpp.h>
 #include <array>
-#include <boost/container/flat_map.hpp>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+#include <memory>
+#include <charconv>
+#include <htslib/bgzf.h>
+#include "epialleleR.h"
+
+// [[Rcpp::depends(Rhtslib)]]
 
 // Was using C++17 for std::map::try_emplace
-// Very much required for boost::container::flat_map - 10x speed gain
 // [[Rcpp::plugins(cpp17)]]
 // 
-// Using boost::container::flat_map as it is >3x faster than any of std::*
-// [[Rcpp::depends(BH)]]
-// sparse_map - https://www.codeproject.com/Articles/866996/Fast-Implementations-of-Maps-with-Integer-Keys-in
-// can actually be the fastest map for the task, however I didn't try it yet
-// because it requires me to include non-standard header and change the way I
-// emplace new items.
+// Was using boost::container::flat_map as it is >3x faster than any of std::*,
+// now it's a dense ring buffer: templates are sorted, thus only the window
+// between the current start and the last C position is alive, and inserting
+// into the sorted map of deep overlapping reads was O(n) memmove
 
 
 // CX report, vectorised, summarising, context-aware, linearly scalable
@@ -23,146 +29,672 @@
 // Output report is a data.frame with six columns and rows for every cytosine:
 // rname (factor), strand (factor), pos, ctx (char), meth, unmeth
 // 
-// 1) all XM positions counted in int[16]: index is equal to char+2>>2&00001111
-// 2) when gap in reads or another chr - spit map to res, clear map
+// 1) all XM positions counted in uint32[8]: slot is chosen by idx, which is
+//    equal to char+2>>2&00001111
+// 2) positions before the current start are spit to res as window slides,
+//    when gap in reads or another chr - spit everything
 // 3) spit if within context and same context in more than 50% of the reads
 // 
 // Here's the ctx_to_idx conversion:
-// ctx  bin       +2        >>2&15  idx
-// +    00101011  00101101  1011    11
-// -    00101101  00101111  1011    11
-// .    00101110  00110000  1100    12
-// H    01001000  01001010  0010    2
-// U    01010101  01010111  0101    5
-// X    01011000  01011010  0110    6
-// Z    01011010  01011100  0111    7
-// h    01101000  01101010  1010    10
-// u    01110101  01110111  1101    13
-// x    01111000  01111010  1110    14
-// z    01111010  01111100  1111    15
+// ctx  bin       +2        >>2&15  idx  slot
+// +    00101011  00101101  1011    11   -
+// -    00101101  00101111  1011    11   -
+// .    00101110  00110000  1100    12   6
+// H    01001000  01001010  0010    2    0
+// U    01010101  01010111  0101    5    7 (coverage only)
+// X    01011000  01011010  0110    6    1
+// Z    01011010  01011100  0111    7    2
+// h    01101000  01101010  1010    10   3
+// u    01110101  01110111  1101    13   7 (coverage only)
+// x    01111000  01111010  1110    14   4
+// z    01111010  01111100  1111    15   5
 // 
-// [[Rcpp::export("rcpp_cx_report")]]
-Rcpp::DataFrame rcpp_cx_report(Rcpp::DataFrame &df,                             // data frame with BAM data
-                               Rcpp::LogicalVector &pass,                       // does it pass the threshold
-                               std::string ctx)                                 // context string for bases to report
-{
-  // walking trough bunch of reads <- filling the map
-  // pos<<2|strand -> {0: rname,  1: pos,       2: 'H',  3: '',    4: '',   5: 'U',  6: 'X',  7: 'Z',
-  //                   8: strand, 9: coverage, 10: 'h', 11: '+-', 12: '.', 13: 'u', 14: 'x', 15: 'z'}
-  // boost::container::flat_map<uint64_t, std::array<int,16>>
+// CX report rows written straight to the file, bypassing R. Compression is
+// BGZF, multithreaded if nthreads>1, so compressed files can be indexed
+// with tabix. Layouts:
+//   report   -- columns and header of the report returned to R;
+//               tabix -s 1 -b 3 -e 3 -S 1
+//   bismark  -- Bismark-like CX report without trinucleotide, no header:
+//               rname, pos, strand, meth, unmeth, context; tabix -s 1 -b 2 -e 2
+//   bedgraph -- rname, 0-based start, end, methylation percentage, no header;
+//               tabix -p bed
+enum {CX_LAYOUT_REPORT, CX_LAYOUT_BISMARK, CX_LAYOUT_BEDGRAPH};
+
+struct T_cx_writer {
+  BGZF *fp;
+  const int layout;
+  const std::vector<std::string> rnames;                                        // reference names, rname is 1-based
+  std::string buf;                                                              // rows waiting to be written
+  bool ok = true;
   
-  Rcpp::IntegerVector rname   = df["rname"];                                    // template rname
-  Rcpp::IntegerVector strand  = df["strand"];                                   // template strand
-  Rcpp::IntegerVector start   = df["start"];                                    // template start
-  Rcpp::IntegerVector templid = df["templid"];                                  // template id, effectively holds indexes of corresponding std::string in std::vector
-  
-  Rcpp::XPtr<std::vector<std::string>> xm((SEXP)df.attr("xm_xptr"));            // merged refspaced template XMs, as a pointer to std::vector<std::string>
-  
-  // main typedefs
-  typedef uint64_t T_key;                                                       // {62bit:pos, 2bit:strand}
-  typedef std::array<int,16> T_val;                                             // {0:rname, 1:pos, 8:strand, 9:coverage, and 10 more for 11 valid chars}
-  typedef boost::container::flat_map<T_key, T_val> T_cx_fmap;                   // attaboy
-  
-// macros
-#define ctx_to_idx(c) ((c+2)>>2) & 15
-#define spit_results {                           /* save aggregated counts  */ \
-  for (T_cx_fmap::iterator it=cx_map.begin(); it!=cx_map.end(); it++) {        \
-    it->second[9] /= 2;                               /* halve the coverage */ \
-    if (it->second[12] > it->second[9]) continue;     /* skip if most are . */ \
-    else if ((it->second[2] + it->second[10]) > it->second[9])                 \
-      max_freq_idx=2;                                                  /* H */ \
-    else if ((it->second[6] + it->second[14]) > it->second[9])                 \
-      max_freq_idx=6;                                                  /* X */ \
-    else if ((it->second[7] + it->second[15]) > it->second[9])                 \
-      max_freq_idx=7;                                                  /* Z */ \
-    else continue;                                 /* skip if none is > 50% */ \
-    if (ctx_map[max_freq_idx]) {                           /* if within ctx */ \
-      /* res_rname.push_back(it->second[0]);                          rname */ \
-      res_strand.push_back(it->second[8]);                        /* strand */ \
-      res_pos.push_back(it->second[1]);                              /* pos */ \
-      res_ctx.push_back(max_freq_idx);                           /* context */ \
-      res_meth.push_back(it->second[max_freq_idx]);                 /* meth */ \
-      res_unmeth.push_back(it->second[max_freq_idx | 8]);         /* unmeth */ \
-    }                                                                          \
-  }                                                                            \
-  res_rname.resize(res_strand.size(), map_val[0]);           /* same rname! */ \
-  max_pos=0;                                                                   \
-  cx_map.clear();                                                              \
-  hint = cx_map.end();                                                         \
+  T_cx_writer(const std::string &fn, const int layout, const bool gzip,
+              const int nthreads, const std::vector<std::string> &rnames) :
+    layout(layout), rnames(rnames) {
+    fp = bgzf_open(fn.c_str(), gzip ? "w" : "wu");
+    if (fp==NULL) Rcpp::stop("Unable to open report file for writing");
+    if (gzip && (nthreads>1)) bgzf_mt(fp, nthreads, 256);
+    buf.reserve(0x20000);
+    if (layout==CX_LAYOUT_REPORT) buf.append("rname\tstrand\tpos\tcontext\tmeth\tunmeth\n");
+  }
+  T_cx_writer(const T_cx_writer&) = delete;
+  ~T_cx_writer() { if (fp) bgzf_close(fp); }                                    // on error or interrupt
+  
+  inline void put(unsigned int x) {                                             // unsigned integer
+    char num [16];
+    buf.append(num, std::to_chars(num, num + sizeof(num), x).ptr);
+  }
+  
+  inline void row(int rname, int strand, int pos, unsigned int ctx,             // ctx is idx of H, X or Z
+                  unsigned int meth, unsigned int unmeth) {
+    const char *ctx_str = ctx==7 ? "CG" : (ctx==6 ? "CHG" : "CHH");
+    buf.append(rnames[rname-1]);
+    buf.push_back('\t');
+    switch (layout) {
+    case CX_LAYOUT_REPORT:
+      buf.append(strand==1 ? "+\t" : "-\t");
+      put(pos); buf.push_back('\t');
+      buf.append(ctx_str); buf.push_back('\t');
+      put(meth); buf.push_back('\t');
+      put(unmeth);
+      break;
+    case CX_LAYOUT_BISMARK:
+      put(pos); buf.push_back('\t');
+      buf.append(strand==1 ? "+\t" : "-\t");
+      put(meth); buf.push_back('\t');
+      put(unmeth); buf.push_back('\t');
+      buf.append(ctx_str);
+      break;
+    default: {                                                                  // CX_LAYOUT_BEDGRAPH
+      put(pos-1); buf.push_back('\t');
+      put(pos); buf.push_back('\t');
+      char num [32];
+      const int len = snprintf(num, sizeof(num), "%g", 100.0*meth/(meth+unmeth));
+      buf.append(num, len);
+    }
+    }
+    buf.push_back('\n');
+    if (buf.size() >= 0x10000) flush();
+  }
+  
+  void flush() {
+    if (!buf.empty() && (bgzf_write(fp, buf.data(), buf.size()) != (ssize_t)buf.size())) ok = false;
+    buf.clear();
+  }
+  
+  void close() {                                                                // stops if anything went wrong
+    flush();
+    const int res = bgzf_close(fp);
+    fp = NULL;
+    if ((res<0) || !ok) Rcpp::stop("Unable to write the report file");
+  }
+};
+
+// layout by name
+inline int cx_layout(const std::string &name) {
+  if (name=="report") return CX_LAYOUT_REPORT;
+  if (name=="bismark") return CX_LAYOUT_BISMARK;
+  if (name=="bedgraph") return CX_LAYOUT_BEDGRAPH;
+  Rcpp::stop("Unknown layout of the report file");
 }
 
-  // array of contexts to print
-  unsigned int ctx_map [16] = {0};
-  std::for_each(ctx.begin(), ctx.end(), [&ctx_map] (unsigned int const &c) {
-    ctx_map[ctx_to_idx(c)]=1;
-  });
 
+// rows of CX report for the requested contexts, to the file if writer is set
+struct T_cx_output {
+  unsigned int ctx_map [16] = {0};                                              // array of contexts to print
+  T_cx_writer *writer = NULL;                                                   // rows go there instead of the result, if set
+  
   // result
   std::vector<int> res_rname, res_strand, res_pos, res_ctx, res_meth, res_unmeth;
-  size_t nitems = std::min(rname.size()*pow(ctx.size()<<2,2), 3e+9);
-  res_rname.reserve(nitems); res_strand.reserve(nitems);
-  res_pos.reserve(nitems); res_ctx.reserve(nitems);
-  res_meth.reserve(nitems); res_unmeth.reserve(nitems);
-  
-  // iterating over XM vector, saving the results when necessary
-  T_cx_fmap cx_map;
-  T_cx_fmap::iterator hint;
-  T_val map_val = {0};
-  int max_pos = 0;
-  unsigned int max_freq_idx;
-  
-  cx_map.reserve(100000);                                                       // reserving helps?
-  for (unsigned int x=0; x<rname.size(); x++) {
+  
+  T_cx_output(const std::string &ctx) {
+    std::for_each(ctx.begin(), ctx.end(), [this] (unsigned int const &c) {
+      ctx_map[ctx_to_idx(c)]=1;
+    });
+  }
+  
+  void reserve(size_t nitems) {
+    res_rname.reserve(nitems); res_strand.reserve(nitems);
+    res_pos.reserve(nitems); res_ctx.reserve(nitems);
+    res_meth.reserve(nitems); res_unmeth.reserve(nitems);
+  }
+  
+  inline void row(int rname, int strand, int pos, unsigned int ctx,             // ctx is idx of H, X or Z
+                  unsigned int meth, unsigned int unmeth) {
+    if (!ctx_map[ctx]) return;                                                  // if within ctx
+    if (writer) {
+      writer->row(rname, strand, pos, ctx, meth, unmeth);
+      return;
+    }
+    res_rname.push_back(rname);                                                 // rname
+    res_strand.push_back(strand);                                               // strand
+    res_pos.push_back(pos);                                                     // pos
+    res_ctx.push_back(ctx);                                                     // context
+    res_meth.push_back(meth);                                                   // meth
+    res_unmeth.push_back(unmeth);                                               // unmeth
+  }
+  
+  // results of the following chunk, to the file if writer is set
+  void append(const T_cx_output &other) {
+    if (writer) {
+      for (size_t r=0; r<other.res_pos.size(); r++)
+        writer->row(other.res_rname[r], other.res_strand[r], other.res_pos[r],
+                    other.res_ctx[r], other.res_meth[r], other.res_unmeth[r]);
+      return;
+    }
+    res_rname.insert(res_rname.end(), other.res_rname.begin(), other.res_rname.end());
+    res_strand.insert(res_strand.end(), other.res_strand.begin(), other.res_strand.end());
+    res_pos.insert(res_pos.end(), other.res_pos.begin(), other.res_pos.end());
+    res_ctx.insert(res_ctx.end(), other.res_ctx.begin(), other.res_ctx.end());
+    res_meth.insert(res_meth.end(), other.res_meth.begin(), other.res_meth.end());
+    res_unmeth.insert(res_unmeth.end(), other.res_unmeth.begin(), other.res_unmeth.end());
+  }
+  
+  // final CX report of the chunks, in order. Columns are allocated once and
+  // filled chunk by chunk, releasing the buffers of every chunk, therefore
+  // the report is copied only once
+  static Rcpp::DataFrame wrap(T_cx_output **outs, size_t nchunks,
+                              SEXP rname_levels,                                // factor levels of rname and strand
+                              SEXP strand_levels) {
+    size_t n = 0;
+    for (size_t c=0; c<nchunks; c++) n += outs[c]->res_pos.size();
+    Rcpp::IntegerVector col_rname (Rcpp::no_init(n)), col_strand (Rcpp::no_init(n)),
+      col_pos (Rcpp::no_init(n)), col_context (Rcpp::no_init(n)),
+      col_meth (Rcpp::no_init(n)), col_unmeth (Rcpp::no_init(n));
+    for (size_t c=0, row=0; c<nchunks; c++) {
+      std::vector<int> *cols[] = {&outs[c]->res_rname, &outs[c]->res_strand,
+                                  &outs[c]->res_pos, &outs[c]->res_ctx,
+                                  &outs[c]->res_meth, &outs[c]->res_unmeth};
+      int *dest[] = {col_rname.begin(), col_strand.begin(), col_pos.begin(),
+                     col_context.begin(), col_meth.begin(), col_unmeth.begin()};
+      const size_t nrows = outs[c]->res_pos.size();
+      for (int k=0; k<6; k++) {
+        std::copy(cols[k]->begin(), cols[k]->end(), dest[k] + row);
+        std::vector<int>().swap(*cols[k]);                                      // release
+      }
+      row += nrows;
+    }
+    
+    col_rname.attr("class") = "factor";                                         // making rname a factor
+    col_rname.attr("levels") = rname_levels;
+    
+    col_strand.attr("class") = "factor";                                        // making strand a factor
+    col_strand.attr("levels") = strand_levels;
+    
+    Rcpp::CharacterVector contexts = Rcpp::CharacterVector::create(             // base contexts
+      "NA1","CHH","NA3","NA4","NA5","CHG","CG"
+    );
+    col_context.attr("class") = "factor";                                       // making context a factor
+    col_context.attr("levels") = contexts;
+    
+    return Rcpp::DataFrame::create(                                             // final CX report
+      Rcpp::Named("rname") = col_rname,                                         // numeric ids (factor) for reference names
+      Rcpp::Named("strand") = col_strand,                                       // numeric ids (factor) for reference strands
+      Rcpp::Named("pos") = col_pos,                                             // position of cytosine
+      Rcpp::Named("context") = col_context,                                     // cytosine context
+      Rcpp::Named("meth") = col_meth,                                           // number of methylated
+      Rcpp::Named("unmeth") = col_unmeth                                        // number of unmethylated
+    );
+  }
+  
+  inline Rcpp::DataFrame wrap(SEXP rname_levels, SEXP strand_levels) {          // final CX report of this output
+    T_cx_output *self = this;
+    return wrap(&self, 1, rname_levels, strand_levels);
+  }
+};
+
+
+// accumulator of XM counts, shared by in-memory and streaming CX reports.
+// Templates must come in coordinate order of their first informative base.
+// Several reports of different contexts can share the counts, as long as
+// templates are thresholded the same way
+struct T_cx_accumulator {
+  // counters of every position and strand, 32 bytes:
+  // {0: 'H', 1: 'X', 2: 'Z', 3: 'h', 4: 'x', 5: 'z', 6: '.', 7: coverage}
+  typedef std::array<uint32_t,8> T_cx_counts;
+  static constexpr uint8_t idx_to_cx[16] = {                                    // idx -> slot, 7 for chars that add to coverage only
+    7, 7, 0, 7, 7, 7, 1, 2, 7, 7, 3, 7, 6, 7, 4, 5
+  };
+  static constexpr unsigned int slot_to_ctx[3] = {2, 6, 7};                     // slot of uppercase -> idx of context (H, X, Z)
+  
+  std::vector<T_cx_counts> ring;                                                // power-of-two ring of positions, both strands
+  int mask;                                                                     // positions in the ring - 1
+  int base = 0;                                                                 // first position in the window
+  int max_pos = -1;                                                             // last position of C in the window, window is empty if < base
+  int cur_rname = 0;                                                            // reference of the window
+  std::vector<T_cx_output> outs;                                                // reports of these counts
+  
+  T_cx_accumulator(const std::vector<std::string> &ctxs) :
+    ring(2<<16), mask((1<<16)-1), outs(ctxs.begin(), ctxs.end()) {}
+  T_cx_accumulator(const std::string &ctx) :
+    T_cx_accumulator(std::vector<std::string> {ctx}) {}
+  
+  inline T_cx_counts& at(int pos, int strand) {                                 // strand is 1 or 2
+    return ring[((pos & mask) << 1) | (strand - 1)];
+  }
+  
+  // make room for positions up to last (exclusive)
+  void grow(int last) {
+    int size = mask + 1;
+    while (size < last - base) size <<= 1;
+    std::vector<T_cx_counts> grown (size << 1);
+    for (int pos=base; pos<=max_pos; pos++)
+      for (int s=0; s<2; s++)
+        grown[((pos & (size-1)) << 1) | s] = ring[((pos & mask) << 1) | s];
+    ring.swap(grown);
+    mask = size - 1;
+  }
+  
+  // save aggregated counts of positions before last, clear them
+  void spit(int last) {
+    const int end = std::min(last, max_pos + 1);
+    for (int pos=base; pos<end; pos++) {
+      for (int strand=1; strand<=2; strand++) {
+        T_cx_counts &c = at(pos, strand);
+        const unsigned int coverage = c[7] / 2;                                 // halve the coverage
+        if (c[7]==0) continue;                                                  // skip if no reads
+        unsigned int max_freq_slot;
+        if (c[6] > coverage) max_freq_slot=3;                                   // skip if most are .
+        else if ((c[0] + c[3]) > coverage) max_freq_slot=0;                     // H
+        else if ((c[1] + c[4]) > coverage) max_freq_slot=1;                     // X
+        else if ((c[2] + c[5]) > coverage) max_freq_slot=2;                     // Z
+        else max_freq_slot=3;                                                   // skip if none is > 50%
+        if (max_freq_slot<3)
+          for (size_t k=0; k<outs.size(); k++)
+            outs[k].row(cur_rname, strand, pos, slot_to_ctx[max_freq_slot],
+                        c[max_freq_slot], c[max_freq_slot + 3]);
+        c.fill(0);
+      }
+    }
+    if (last > base) base = last;
+  }
+  
+  // empty window for the next chunk, which may be upstream of this one
+  inline void reset() {
+    base = 0;
+    max_pos = -1;
+  }
+  
+  // all positions
+  inline void spit_all() {
+    spit(max_pos + 1);
+    max_pos = base - 1;
+  }
+  
+  // positions of the reference that can't be covered by the templates
+  // starting at pos or later
+  inline void spit_before(int rname, int pos) {
+    if (rname==cur_rname) spit(pos);
+  }
+  
+  // counting XM chars of one template
+  template <class T_view>
+  inline void add(const T_view &templs, size_t id, int rname, int strand, int start, bool pass) {
+    if ((start>max_pos) || (rname!=cur_rname)) {                                // if current position is further downstream or another reference
+      spit_all();
+      cur_rname = rname;
+      base = start;
+    }
+    const unsigned int pass_x = (!pass)<<3;                                     // should we lowercase this XM (TRUE==0, FALSE==8)
+    const int size_x = templs.size(id);                                         // length of the current read
+    if (start + size_x - base > mask + 1) grow(start + size_x);                 // window doesn't fit the ring
+    int last_pos = max_pos;
+    templs.for_each_segment(id, [&] (uint32_t pos, uint32_t len,                // XM of the covered segments, either layout
+                                     const uint8_t *xm_x, const uint8_t*) {
+      const int seg_start = start + pos;
+      for (uint32_t i=0; i<len; i++) {                                          // char by char - it's faster this way than using std::string in the cycle
+        const unsigned int idx = T_view::xm_idx(xm_x, i) | pass_x;              // see the table above; if not pass -> lowercase
+        if (idx==11) continue;                                                  // skip +-
+        T_cx_counts &c = at(seg_start+i, strand);
+        const unsigned int slot = idx_to_cx[idx];
+        c[slot]++;
+        c[7] += (slot!=7);                                                      // total coverage
+        last_pos = seg_start+i;
+      }
+    });
+    if (max_pos<last_pos) max_pos=last_pos;                                     // last position of C in the window
+  }
+};
+
+
+// bases of templates in a chunk of CX reports written to files
+static const uint64_t cx_chunk_bases = 1<<26;
+
+// counting templates [from, to) of sorted data frame, once per pass mask
+template <class T_view>
+static void cx_count(const T_view &templs, const int *rname, const int *strand,
+                     const int *start, const int *templid,
+                     const T_pass_mask *pass, size_t npass, size_t from,        // npass masks and accumulators
+                     size_t to, bool main_thread, T_cx_accumulator *acc)
+{
+  for (size_t x=from; x<to; x++) {
     // checking for the interrupt
-    if ((x & 0xFFFF) == 0) Rcpp::checkUserInterrupt();                          // every ~65k reads
+    if (main_thread && ((x & 0xFFFF) == 0)) Rcpp::checkUserInterrupt();        // every ~65k reads
+    for (size_t j=0; j<npass; j++) {                                            // template is hot in cache for the next mask
+      acc[j].spit_before(rname[x], start[x]);                                   // nothing before start can change
+      acc[j].add(templs, templid[x], rname[x], strand[x], start[x], pass[j][x]);
+    }
+  }
+  for (size_t j=0; j<npass; j++) acc[j].spit_all();
+}
+
+// CX reports of all pass masks in one sweep. Reports of the same mask share
+// the counts. Output: list of reports, by mask and then by context string
+template <class T_view>
+Rcpp::List cx_report(const T_view &templs,                                      // templates, either layout
+                     Rcpp::DataFrame &df,
+                     const std::vector<T_pass_mask> &passes,                    // does it pass the threshold, by mask
+                     const std::vector<std::vector<std::string>> &ctxs,         // context strings of reports, by mask
+                     const std::vector<std::vector<T_cx_writer*>> &writers,     // their files, NULL if returned
+                     int nthreads)
+{
+  Rcpp::IntegerVector rname   = df["rname"];                                    // template rname
+  Rcpp::IntegerVector strand  = df["strand"];                                   // template strand
+  Rcpp::IntegerVector start   = df["start"];                                    // template start
+  Rcpp::IntegerVector templid = df["templid"];                                  // template id, effectively holds indexes of corresponding templates
+  const size_t n = rname.size();
+  const size_t npass = passes.size();
+  
+  bool any_writer = false;                                                      // some reports go to files
+  for (size_t j=0; j<npass; j++)
+    for (size_t k=0; k<ctxs[j].size(); k++) any_writer |= (writers[j][k]!=NULL);
+  
+  // chunks end where no template overlaps the next one (another reference or
+  // a gap), thus can be counted independently. Cut into roughly equal number
+  // of bases, but not more than nthreads chunks. Reports written to files are
+  // cut further into chunks of at most cx_chunk_bases, which are written as
+  // they are ready, thus memory doesn't grow with the size of the report
+  std::vector<size_t> bounds = {0};
+  if (nthreads > 1) {
+    uint64_t total = 0;
+    for (size_t x=0; x<n; x++) total += templs.size(templid[x]);
+    uint64_t target = total / nthreads + 1;
+    if (any_writer) target = std::min(target, cx_chunk_bases);
+    uint64_t bases = 0;
+    int max_end = 0;                                                            // last base of templates of this reference so far
+    for (size_t x=0; x<n; x++) {
+      const bool new_rname = (x==0) || (rname[x]!=rname[x-1]);
+      if ((bases >= target) && (any_writer || ((int)bounds.size() < nthreads)) &&
+          (new_rname || (start[x]>max_end))) {
+        bounds.push_back(x);
+        bases = 0;
+      }
+      const int end_x = start[x] + templs.size(templid[x]) - 1;
+      if (new_rname || (max_end<end_x)) max_end = end_x;
+      bases += templs.size(templid[x]);
+    }
+  }
+  bounds.push_back(n);
+  const size_t nchunks = bounds.size() - 1;
+  
+  std::vector<std::vector<T_cx_output>> outs (nchunks * npass);                 // reports, chunk by chunk, mask by mask
+  if (nchunks == 1) {
+    std::vector<T_cx_accumulator> accs (ctxs.begin(), ctxs.end());              // mask by mask
+    for (size_t j=0; j<npass; j++) {
+      for (size_t k=0; k<ctxs[j].size(); k++) {
+        T_cx_output &out = accs[j].outs[k];
+        out.writer = writers[j][k];                                             // rows are written as they are ready
+        if (!out.writer) out.reserve(std::min(n*pow(ctxs[j][k].size()<<2,2), 3e+9));
+      }
+    }
+    cx_count(templs, rname.begin(), strand.begin(), start.begin(),
+             templid.begin(), passes.data(), npass, 0, n, true, accs.data());
+    for (size_t j=0; j<npass; j++) outs[j] = std::move(accs[j].outs);
+  } else {
+    // workers take the chunks in order, each into its own accumulators, and
+    // move the finished reports to outs. The main thread writes the
+    // reports of every chunk to the files as soon as it and all chunks before
+    // it are ready, while the following chunks are counted; no more than
+    // 2*nthreads chunks ahead of the written ones are kept in memory then
+    std::mutex mtx;
+    std::condition_variable cv;
+    size_t next = 0, written = 0;                                               // next chunk to count, chunks written so far
+    std::vector<char> done (nchunks, 0);
+    bool stop = false;
+    const size_t window = any_writer ? 2*nthreads : nchunks;
+    std::vector<std::exception_ptr> errors (nthreads);                          // of workers, thrown again by the main thread
+    auto work = [&] (const size_t t) {
+      try {
+        std::vector<T_cx_accumulator> acc (ctxs.begin(), ctxs.end());           // mask by mask
+        std::unique_lock<std::mutex> lock (mtx);
+        while (true) {
+          cv.wait(lock, [&] {return stop || (next>=nchunks) || (next<written+window);});
+          if (stop || (next>=nchunks)) break;
+          const size_t c = next++;
+          lock.unlock();
+          for (size_t j=0; j<npass; j++) acc[j].reset();
+          cx_count(templs, rname.begin(), strand.begin(), start.begin(),
+                   templid.begin(), passes.data(), npass, bounds[c],
+                   bounds[c+1], false, acc.data());
+          for (size_t j=0; j<npass; j++) {
+            outs[c*npass + j] = std::move(acc[j].outs);
+            acc[j].outs = std::vector<T_cx_output>(ctxs[j].begin(), ctxs[j].end());
+          }
+          lock.lock();
+          done[c] = 1;
+          cv.notify_all();
+        }
+      } catch (...) {                                                           // e.g. std::bad_alloc: stop everyone
+        std::lock_guard<std::mutex> lock (mtx);
+        errors[t] = std::current_exception();
+        stop = true;
+        cv.notify_all();
+      }
+    };
     
-    const int start_x = start[x];                                               // start of the current read
-    if ((start_x>max_pos) || (rname[x]!=map_val[0])) {                          // if current position is further downstream or another reference
-      spit_results;
-      map_val[0] = rname[x];
+    std::vector<T_cx_output> files;                                             // proxies of the reports written to files
+    for (size_t j=0; j<npass; j++) {
+      for (size_t k=0; k<ctxs[j].size(); k++) {
+        files.emplace_back(ctxs[j][k]);
+        files.back().writer = writers[j][k];
+      }
     }
-    map_val[8] = strand[x];
-    const unsigned int pass_x = (!pass[x])<<3;                                  // should we lowercase this XM (TRUE==0, FALSE==8)
-    const char* xm_x = xm->at(templid[x]).c_str();                              // xm->at(templid[x]) is a reference to a corresponding XM string
-    const unsigned int size_x = xm->at(templid[x]).size();                      // length of the current read
-    for (unsigned int i=0; i<size_x; i++) {                                     // char by char - it's faster this way than using std::string in the cycle
-      const unsigned int idx_to_increase = (ctx_to_idx(xm_x[i])) | pass_x;      // see the table above; if not pass -> lowercase
-      if (idx_to_increase==11) continue;                                        // skip +-
-      map_val[1] = start_x+i;
-      const T_key map_key = ((T_key)map_val[1] << 2) | map_val[8];
-      hint = cx_map.try_emplace(hint, map_key, map_val);
-      hint->second[idx_to_increase]++;
-      hint->second[9]++;                                                        // total coverage
+    std::vector<std::thread> workers;                                           // no R calls from there
+    for (size_t t=0; t<std::min((size_t)nthreads, nchunks); t++)
+      workers.emplace_back(work, t);
+    try {
+      for (size_t c=0; c<nchunks; c++) {
+        {
+          std::unique_lock<std::mutex> lock (mtx);
+          cv.wait(lock, [&] {return stop || (done[c]!=0);});
+          if (stop) break;                                                      // worker failed
+        }
+        for (size_t j=0, r=0; j<npass; j++) {
+          for (size_t k=0; k<ctxs[j].size(); k++, r++) {
+            if (!files[r].writer) continue;
+            T_cx_output &out = outs[c*npass + j][k];
+            files[r].append(out);                                               // written in order
+            out = T_cx_output(ctxs[j][k]);                                      // release
+          }
+        }
+        {
+          std::lock_guard<std::mutex> lock (mtx);
+          written = c + 1;
+        }
+        cv.notify_all();
+        Rcpp::checkUserInterrupt();
+      }
+    } catch (...) {                                                             // interrupted: let workers finish
+      {
+        std::lock_guard<std::mutex> lock (mtx);
+        stop = true;
+      }
+      cv.notify_all();
+      for (size_t t=0; t<workers.size(); t++) workers[t].join();
+      throw;
     }
-    if (max_pos<map_val[1]) max_pos=map_val[1];                                 // last position of C in cx_map
+    for (size_t t=0; t<workers.size(); t++) workers[t].join();
+    for (size_t t=0; t<errors.size(); t++)
+      if (errors[t]) std::rethrow_exception(errors[t]);
   }
-  spit_results;
   
-  Rcpp::DataFrame res = Rcpp::DataFrame::create(                                // final CX report
-    Rcpp::Named("rname") = res_rname,                                           // numeric ids (factor) for reference names
-    Rcpp::Named("strand") = res_strand,                                         // numeric ids (factor) for reference strands
-    Rcpp::Named("pos") = res_pos,                                               // position of cytosine
-    Rcpp::Named("context") = res_ctx,                                           // cytosine context
-    Rcpp::Named("meth") = res_meth,                                             // number of methylated
-    Rcpp::Named("unmeth") = res_unmeth                                          // number of unmethylated
-  );
+  size_t nreports = 0;
+  for (size_t j=0; j<npass; j++) nreports += ctxs[j].size();
+  Rcpp::List res (nreports);
+  for (size_t j=0, r=0; j<npass; j++) {
+    for (size_t k=0; k<ctxs[j].size(); k++) {
+      std::vector<T_cx_output*> chunks (nchunks);                               // the same report of every chunk, empty if written
+      for (size_t c=0; c<nchunks; c++) chunks[c] = &outs[c*npass + j][k];
+      res[r++] = T_cx_output::wrap(chunks.data(), nchunks,                      // results in order
+                                   rname.attr("levels"), strand.attr("levels"));
+    }
+  }
+  return res;
+}
+
+// [[Rcpp::export("rcpp_cx_report")]]
+Rcpp::DataFrame rcpp_cx_report(Rcpp::DataFrame &df,                             // data frame with BAM data
+                               Rcpp::RawVector &pass,                           // does it pass the threshold, bit-packed
+                               std::string ctx,                                 // context string for bases to report
+                               int nthreads,                                    // threads, >1 for multiple
+                               std::string report_file,                         // write the report there if not empty
+                               std::string layout,                              // layout of the report file
+                               bool gzip)                                       // compress the report file
+{
+  T_timer timer;
+  std::unique_ptr<T_cx_writer> writer;
+  if (!report_file.empty()) {
+    Rcpp::IntegerVector rname = df["rname"];
+    writer.reset(new T_cx_writer(
+      report_file, cx_layout(layout), gzip, nthreads,
+      Rcpp::as<std::vector<std::string>>(rname.attr("levels"))
+    ));
+  }
+  const std::vector<T_pass_mask> passes = {T_pass_mask(pass)};
+  const std::vector<std::vector<std::string>> ctxs = {{ctx}};
+  const std::vector<std::vector<T_cx_writer*>> writers = {{writer.get()}};
+  Rcpp::List reports = dispatch_view(df, cx_report, df, passes, ctxs, writers,  // merged refspaced template XMs, either layout
+                                     nthreads);
+  if (writer) writer->close();
+  Rcpp::DataFrame res = reports[0];
+  return with_timing<Rcpp::DataFrame>(res, timer, "report");
+}
+
+// Several CX reports in one sweep over templates, e.g. of different contexts
+// and thresholding criteria. Every report has its pass mask (reports of the
+// same mask share the counts), context string and file. Output: list of
+// reports, empty if written to the file
+// [[Rcpp::export("rcpp_cx_report_multi")]]
+Rcpp::List rcpp_cx_report_multi(Rcpp::DataFrame &df,                            // data frame with BAM data
+                                Rcpp::List pass,                                // distinct pass masks, bit-packed
+                                std::vector<int> pass_id,                       // 0-based mask of every report
+                                std::vector<std::string> ctx,                   // context string of every report
+                                std::vector<std::string> report_file,           // file of every report, returned if empty
+                                std::vector<std::string> layout,                // layout of every report file
+                                Rcpp::LogicalVector gzip,                       // compress every report file
+                                int nthreads)                                   // threads, >1 for multiple
+{
+  T_timer timer;
+  const size_t nreports = ctx.size();
+  if ((pass_id.size()!=nreports) || (report_file.size()!=nreports) ||
+      (layout.size()!=nreports) || ((size_t)gzip.size()!=nreports))
+    Rcpp::stop("Report specifications must be of the same length");
   
-  Rcpp::IntegerVector col_rname = res["rname"];                                 // making rname a factor
-  col_rname.attr("class") = "factor";
-  col_rname.attr("levels") = rname.attr("levels");
+  Rcpp::IntegerVector rname = df["rname"];
+  const std::vector<std::string> rnames = Rcpp::as<std::vector<std::string>>(rname.attr("levels"));
+  std::vector<T_pass_mask> passes;
+  for (R_xlen_t j=0; j<pass.size(); j++)
+    passes.emplace_back(Rcpp::RawVector(pass[j]));
+  std::vector<std::vector<std::string>> ctxs (passes.size());                   // reports by mask
+  std::vector<std::vector<T_cx_writer*>> writers (passes.size());
+  std::vector<std::unique_ptr<T_cx_writer>> files (nreports);                   // closed on error or interrupt
+  for (size_t r=0; r<nreports; r++) {
+    if ((pass_id[r]<0) || ((size_t)pass_id[r]>=passes.size()))
+      Rcpp::stop("Pass mask of the report is out of range");
+    if (!report_file[r].empty())
+      files[r].reset(new T_cx_writer(report_file[r], cx_layout(layout[r]),
+                                     gzip[r], nthreads, rnames));
+    ctxs[pass_id[r]].push_back(ctx[r]);
+    writers[pass_id[r]].push_back(files[r].get());
+  }
   
-  Rcpp::IntegerVector col_strand = res["strand"];;                              // making strand a factor
-  col_strand.attr("class") = "factor";
-  col_strand.attr("levels") = strand.attr("levels");
+  Rcpp::List reports = dispatch_view(df, cx_report, df, passes, ctxs, writers,  // merged refspaced template XMs, either layout
+                                     nthreads);
+  timer.lap("report");
+  for (size_t r=0; r<nreports; r++) if (files[r]) files[r]->close();
   
-  Rcpp::CharacterVector contexts = Rcpp::CharacterVector::create(               // base contexts
-    "NA1","CHH","NA3","NA4","NA5","CHG","CG"
-  );
-  Rcpp::IntegerVector col_context = res["context"];;                            // making context a factor
-  col_context.attr("class") = "factor";
-  col_context.attr("levels") = contexts;
+  Rcpp::List res (nreports);                                                    // in the order of specifications
+  std::vector<size_t> first (passes.size(), 0), seen (passes.size(), 0);        // first report of every mask in reports, reports seen so far
+  for (size_t j=1; j<passes.size(); j++) first[j] = first[j-1] + ctxs[j-1].size();
+  for (size_t r=0; r<nreports; r++)
+    res[r] = reports[first[pass_id[r]] + seen[pass_id[r]]++];
+  return with_timing<Rcpp::List>(res, timer, "output");
+}
+
+
+// Streaming CX report: windows of templates of coordinate-sorted BAM are
+// thresholded and counted as they are read, positions that can't be covered
+// by the following templates are saved, and templates are released. Memory
+// therefore depends on coverage and read length, not on the size of BAM file
+struct T_cx_stream : T_template_sink {
+  T_cx_accumulator acc;
+  const T_threshold *threshold;                                                 // thresholding criteria, NULL if all reads pass
+  const std::string report_file, layout;                                        // report file, if not empty, and its layout
+  const bool gzip;
+  const int nthreads;
+  std::unique_ptr<T_cx_writer> writer;                                          // opened once reference names are known
+  
+  T_cx_stream(const std::string &ctx, const T_threshold *threshold,
+              const std::string &report_file, const std::string &layout,
+              const bool gzip, const int nthreads) :
+    acc(ctx), threshold(threshold), report_file(report_file), layout(layout),
+    gzip(gzip), nthreads(nthreads) {}
   
+  void open() {
+    if (report_file.empty() || writer) return;
+    writer.reset(new T_cx_writer(report_file, cx_layout(layout), gzip,
+                                 nthreads, chromosomes));
+    acc.outs[0].writer = writer.get();
+  }
   
+  void consume(const std::vector<int> &rname, const std::vector<int> &strand,
+               const std::vector<int> &start, const T_templates &templs,
+               const int safe_pos) {
+    open();
+    const T_unpacked_view view {&templs};
+    for (size_t x=0; x<rname.size(); x++) {
+      const bool pass_x = threshold ? threshold->pass(templs.counts_p[x]) : true;
+      acc.add(view, x, rname[x], strand[x], start[x], pass_x);
+    }
+    if (!rname.empty()) acc.spit_before(rname.back(), safe_pos);                // the rest might get more reads
+  }
+};
+
+// [[Rcpp::export("rcpp_cx_report_stream")]]
+Rcpp::DataFrame rcpp_cx_report_stream(std::string fn,                           // file name
+                                      int min_mapq,                             // min read mapping quality
+                                      int min_baseq,                            // min base quality
+                                      bool skip_duplicates,                     // skip marked duplicates
+                                      int nthreads,                             // HTSlib threads, >0 for multiple
+                                      bool threshold_reads,                     // threshold reads or let all of them pass
+                                      std::string ctx_meth,                     // thresholding: context string for methylated
+                                      std::string ctx_unmeth,                   // thresholding: context string for unmethylated
+                                      std::string ooctx_meth,                   // thresholding: out-of-context string for methylated
+                                      std::string ooctx_unmeth,                 // thresholding: out-of-context string for unmethylated
+                                      unsigned int min_n_ctx,                   // thresholding: min number of context bases
+                                      double min_ctx_meth_frac,                 // thresholding: min context beta value
+                                      double max_ooctx_meth_frac,               // thresholding: max out-of-context beta value
+                                      std::string ctx,                          // context string for bases to report
+                                      std::string report_file,                  // write the report there if not empty
+                                      std::string layout,                       // layout of the report file
+                                      bool gzip)                                // compress the report file
+{
+  const T_threshold threshold (ctx_meth, ctx_unmeth, ooctx_meth, ooctx_unmeth,
+                               min_n_ctx, min_ctx_meth_frac,
+                               max_ooctx_meth_frac);
+  if (!report_file.empty()) cx_layout(layout);                                  // check before reading
+  T_cx_stream stream (ctx, threshold_reads ? &threshold : NULL, report_file,
+                      layout, gzip, nthreads);
+  Rcpp::NumericVector stats = stream_bam(fn, min_mapq, min_baseq,
+                                         skip_duplicates, nthreads,
+                                         std::vector<std::string>(), &stream);
+  stream.open();                                                                // no reads at all
+  stream.acc.spit_all();
+  if (stream.writer) stream.writer->close();
+  
+  Rcpp::DataFrame res = stream.acc.outs[0].wrap(
+    Rcpp::wrap(stream.chromosomes), Rcpp::CharacterVector::create("+", "-")     // reference names as in BAM header, strands
+  );
+  res.attr("timing") = stats.attr("timing");                                    // wall and CPU time of the stages
   return res;
 }
 
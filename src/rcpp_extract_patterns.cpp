@@ -1,12 +1,28 @@
 #include <Rcpp.h>
+#include <unordered_map>
 #include <boost/container/flat_map.hpp>
+#include "epialleleR.h"
 // using namespace Rcpp;
 
 // Scans trough reads and extracts methylation patterns from the reads that
 // overlap target area. Clips overhangs if necessary.
-// Return value: a data frame with the following columns:
+// Return value: a list with a data frame for every target, having the
+// following columns:
 // 1) pattern id (FNV hash)
 // 2) just read the epialleleR::extractPatterns() manual...
+//
+// Bases of patterns are kept as a column-major byte matrix. If summarizing,
+// patterns are counted by their FNV-1a hash, and only the first read (pair)
+// of every distinct pattern is kept, together with the number of reads, their
+// mean beta and, as start and end, the span covered by all of them. Output
+// then grows with the number of distinct patterns, not with the depth.
+//
+// Rows of BAM data are sorted by rname and start, therefore reads that can
+// overlap the target are found by binary search: they start not earlier than
+// the target start minus the longest template (and not later than the target
+// end). All the targets are processed in a single call, each one scanning
+// only its own range of reads. If rows were reordered, every target falls back
+// to the scan of all reads.
 
 // ctx_to_idx conversion is described in the rcpp_cx_report.cpp
 // Here's the nt_to_idx conversion for the SEQ string:
@@ -21,25 +37,56 @@
 // [[Rcpp::plugins(cpp17)]]
 // [[Rcpp::depends(BH)]]
 
-// fast, vectorised
-// [[Rcpp::export("rcpp_extract_patterns")]]
-Rcpp::DataFrame rcpp_extract_patterns(Rcpp::DataFrame &df,                      // data frame with BAM data
-                                      unsigned int target_rname,                // target chromosome
-                                      unsigned int target_start,                // target start
-                                      unsigned int target_end,                  // target end
-                                      signed int min_overlap,                   // min overlap of reads and capture targets
-                                      std::string &ctx,                         // context string for bases to include
-                                      double min_ctx_freq,                      // minimum frequency of observed context at position
-                                      bool clip,                                // clip the matched reads to target area
-                                      unsigned int reverse_offset,              // decrease reverse strand coordinates by this value: 0 for CHH, 1 for CpG, 2 for CHG
-                                      Rcpp::IntegerVector &hlght) {             // positions of bases to extract sequence info; NB: overlapping, unique and sorted!
+typedef boost::container::flat_map<int, int> T_pos_map;                         // all positions to figure out valid ones
+
+// column-major byte matrix of pattern bases, 0 is NA (it isn't a ctx_to_idx
+// code of any base). Rows are added at the bottom, capacity is doubled when
+// necessary
+struct T_base_matrix {
+  size_t nrow = 0, ncol = 0, capacity = 0;
+  std::vector<uint8_t> data;
+  
+  T_base_matrix(size_t ncol, size_t capacity) :
+    ncol(ncol), capacity(std::max(capacity, (size_t)1)),
+    data(ncol * this->capacity, 0) {}
+  
+  size_t add_row() {                                                            // index of the new empty row
+    if (nrow==capacity) {
+      std::vector<uint8_t> grown (ncol * capacity * 2, 0);
+      for (size_t c=0; c<ncol; c++)
+        std::copy(data.begin() + c*capacity, data.begin() + c*capacity + nrow,
+                  grown.begin() + c*capacity*2);
+      data.swap(grown);
+      capacity *= 2;
+    }
+    return nrow++;
+  }
+  
+  inline void set(size_t row, size_t col, uint8_t base) { data[col*capacity + row] = base; }
+  inline uint8_t get(size_t row, size_t col) const { return data[col*capacity + row]; }
+};
+
+// patterns of a single target, within [first, last) rows of BAM data
+template <class T_view>
+Rcpp::DataFrame extract_target(const T_view &templs,                            // templates, either layout
+                               Rcpp::DataFrame &df,
+                               size_t first,
+                               size_t last,
+                               unsigned int target_rname,
+                               unsigned int target_start,
+                               unsigned int target_end,
+                               signed int min_overlap,
+                               const unsigned int *ctx_map,
+                               double min_ctx_freq,
+                               bool clip,
+                               unsigned int reverse_offset,
+                               std::vector<int> &hlght,
+                               bool summarize,
+                               T_pos_map &pos_map) {
   Rcpp::IntegerVector rname   = df["rname"];                                    // template rname
   Rcpp::IntegerVector strand  = df["strand"];                                   // template strand
   Rcpp::IntegerVector start   = df["start"];                                    // template start
-  Rcpp::IntegerVector templid = df["templid"];                                  // template id, effectively holds indexes of corresponding std::string in std::vector
-  
-  Rcpp::XPtr<std::vector<std::string>> xm((SEXP)df.attr("xm_xptr"));            // merged refspaced template XMs, as a pointer to std::vector<std::string>
-  Rcpp::XPtr<std::vector<std::string>> seq((SEXP)df.attr("seq_xptr"));          // merged refspaced template SEQ, as a pointer to std::vector<std::string>
+  Rcpp::IntegerVector templid = df["templid"];                                  // template id, effectively holds indexes of corresponding templates
   
 // http://www.isthe.com/chongo/tech/comp/fnv/
 #define fnv_add(hash, pointer, size) {     /* hash starts with offset_basis */ \
@@ -48,166 +95,204 @@ Rcpp::DataFrame rcpp_extract_patterns(Rcpp::DataFrame &df,
     hash *= 1099511628211u;                             /* hash * FNV_prime */ \
   }                                                                            \
 }
-#define ctx_to_idx(c) ((c+2)>>2) & 15
 #define nt_to_idx(c) base_map[(c>>1) & 3]
   
   // consts, vars, typedefs
   const uint64_t offset_basis = 14695981039346656037u;                          // FNV-1a offset basis
   const unsigned int base_map[] = {3, 4, 11, 12};                               // see comments on base conversion at the top
   unsigned int npat = 0;                                                        // pattern counter
-  typedef int T_key;                                                            // map key
-  typedef std::vector<int> T_val;                                               // map value
-  boost::container::flat_map<T_key, T_key> pos_map;                             // all positions to figure out valid ones
-  boost::container::flat_map<T_key, T_key>::iterator pos_hint = pos_map.begin();// position map iterator
-  std::map<T_key, T_val> pat_map;                                               // per-pattern methylation counts
-  std::map<T_key, T_val> hlght_map;                                             // per-pattern sequence bases
-  std::vector<int> pat_strand, pat_start, pat_end, pat_nbase;                   // pattern strands, starts, ends, number of bases within context
-  std::vector<double> pat_beta;                                                 // pattern betas
-  std::vector<std::string> pat_fnv;                                             // FNV-1a hashes of patterns
-  
-  pos_map.reserve(std::max((int)(target_end-target_start), 0xFFFF));
-  
-  // filling the context map
-  unsigned int ctx_map [128] = {0};
-  std::for_each(ctx.begin(), ctx.end(), [&ctx_map] (unsigned int const &c) {
-    ctx_map[c] = 1;
-  });
-  ctx_map[(int)'A'] = 1; ctx_map[(int)'C'] = 1;                                 // make these bases valid for highlighting
-  ctx_map[(int)'G'] = 1; ctx_map[(int)'T'] = 1;
-  
-  // // rnames are sorted, should've been taking an advantage of it...
-  // Rcpp::IntegerVector::const_iterator lower = std::lower_bound(rname.begin(), rname.end(), target_rname);
-  // Rcpp::IntegerVector::const_iterator upper = std::upper_bound(lower, rname.end(), target_rname);
-  // for (unsigned int x=lower-rname.begin(); x<upper-rname.begin(); x++) {
+  pos_map.clear();                                                              // keeps capacity between targets
+  T_pos_map::iterator pos_hint = pos_map.begin();                               // position map iterator
+  std::vector<int> pat_strand, pat_start, pat_end, pat_nbase, pat_count;        // pattern strands, starts, ends, number of bases within context, number of reads
+  std::vector<double> pat_beta;                                                 // pattern betas (sums of, while summarizing)
+  std::vector<uint64_t> pat_fnv;                                                // FNV-1a hashes of patterns
+  std::unordered_map<uint64_t, size_t> pat_row;                                 // rows of distinct patterns, only while summarizing
   
   // first - find valid positions
-  for (unsigned int x=0; x<rname.size(); x++) {   
+  for (size_t x=first; x<last; x++) {
     // checking for the interrupt
     if ((x & 0xFFFF) == 0) Rcpp::checkUserInterrupt();                          // check for interrupt
     
     if (rname[x]==(int)target_rname) {
-      const unsigned int size_x = xm->at(templid[x]).size();                    // length of the current read
+      const unsigned int size_x = templs.size(templid[x]);                      // length of the current read
       const unsigned int start_x = start[x];                                    // start position of the current read
       const unsigned int end_x = start_x + size_x - 1;                          // end position of the current read
       const unsigned int over_start_x = std::max(start_x, target_start);        // start of overlapped area
       const unsigned int over_end_x = std::min(end_x, target_end);              // end of overlapped area
       const signed int overlap = over_end_x - over_start_x + 1;                 // overlap with target
       if (overlap>=min_overlap) {                                               // if overlaps the target
-        const char* xm_x = xm->at(templid[x]).c_str();                          // xm->at(templid[x]) is a reference to a corresponding XM string
         const unsigned int offset_x = strand[x]==2 ? reverse_offset : 0;        // offset coordinates of reverse strand for symmetric methylation
         const unsigned int begin_i = clip ? (over_start_x - start_x) : 0;       // clip the XM?
         const unsigned int end_i = clip ? overlap : size_x;                     // clip the XM?
-        for (unsigned int i=begin_i; i<end_i; i++) {                            // char by char - it's faster this way than using std::string in the cycle
-          if (ctx_map[(int)xm_x[i]]) {                                          // if base is within context
-            const unsigned int pos = start_x + i - offset_x;                    // position of the base
-            pos_hint = pos_map.try_emplace(pos_hint, pos, 0);                   // check if this position is already included, emplace if not
-            pos_hint->second++;                                                 // position++
+        templs.for_each_segment(templid[x], [&] (uint32_t seg_pos, uint32_t len, // XM of the covered segments, either layout
+                                                 const uint8_t *xm_x, const uint8_t*) {
+          const unsigned int seg_end = std::min(end_i, seg_pos + len);
+          for (unsigned int i=std::max(begin_i, seg_pos); i<seg_end; i++) {     // char by char - it's faster this way than using std::string in the cycle
+            if (ctx_map[(int)T_view::xm_char(xm_x, i - seg_pos)]) {             // if base is within context
+              const unsigned int pos = start_x + i - offset_x;                  // position of the base
+              pos_hint = pos_map.try_emplace(pos_hint, pos, 0);                 // check if this position is already included, emplace if not
+              pos_hint->second++;                                               // position++
+            }
           }
-        }
+        });
         npat++;                                                                 // patterns++, to know how many
       }
     }
   }
   
-  // fill pattern map
+  // columns: valid positions and positions to highlight, sorted
+  std::vector<int> ctx_pos;                                                     // valid within-context positions, sorted
   for (auto it=pos_map.begin(); it!=pos_map.end(); it++) {
     if (((double)it->second/npat >= min_ctx_freq) &&                            // if position frequency in patterns is higher than the min
         (std::find(hlght.begin(), hlght.end(), it->first) == hlght.end()))      // and it's not the highlighted position
-      pat_map.emplace(it->first, T_val (npat, NA_INTEGER));                     // add position to the pattern map
-  }
-  // fill highlight map
-  for (unsigned int i=0; i<hlght.size(); i++) {
-    hlght_map.emplace(hlght[i], T_val (npat, NA_INTEGER));                      // add position to the highlight map
+      ctx_pos.push_back(it->first);                                             // add position to the pattern columns
   }
+  std::vector<int> col_pos (ctx_pos);                                           // position of every column
+  col_pos.insert(col_pos.end(), hlght.begin(), hlght.end());                    // add positions to highlight
+  std::sort(col_pos.begin(), col_pos.end());
+  
+  // column by position, dense within the span of all columns
+  const int col_min = col_pos.empty() ? 0 : col_pos.front();
+  std::vector<int> col_of (col_pos.empty() ? 0 : col_pos.back() - col_min + 1, -1);
+  for (size_t c=0; c<col_pos.size(); c++) col_of[col_pos[c] - col_min] = c;
+  std::vector<uint8_t> col_ctx (col_pos.size(), 0);                             // within-context columns, not highlighted
+  for (size_t c=0; c<col_pos.size(); c++)
+    col_ctx[c] = std::binary_search(ctx_pos.begin(), ctx_pos.end(), col_pos[c]);
+  #define get_col(pos) (((int)(pos) >= col_min) &&                             \
+    ((int)(pos) - col_min < (int)col_of.size()) ? col_of[(int)(pos)-col_min] : -1)
+  
+  T_base_matrix bases (col_pos.size(), summarize ? std::min(npat, 0x400u) : npat);
+  std::vector<std::pair<int,uint8_t>> read_bases;                               // (column, base) of the current read
   
   npat = 0;
-  for (unsigned int x=0; x<rname.size(); x++) {   
+  for (size_t x=first; x<last; x++) {
     // checking for the interrupt
     if ((x & 0xFFFF) == 0) Rcpp::checkUserInterrupt();                          // check for interrupt
     
     if (rname[x]==(int)target_rname) {
-      const unsigned int size_x = xm->at(templid[x]).size();                    // length of the current read
+      const unsigned int size_x = templs.size(templid[x]);                      // length of the current read
       const unsigned int start_x = start[x];                                    // start position of the current read
       const unsigned int end_x = start_x + size_x - 1;                          // end position of the current read
       const unsigned int over_start_x = std::max(start_x, target_start);        // start of overlapped area
       const unsigned int over_end_x = std::min(end_x, target_end);              // end of overlapped area
       const signed int overlap = over_end_x - over_start_x + 1;                 // overlap with target
       if (overlap>=min_overlap) {                                               // if overlaps the target
-        const char* xm_x = xm->at(templid[x]).c_str();                          // xm->at(templid[x]) is a reference to a corresponding XM string
         const unsigned int offset_x = strand[x]==2 ? reverse_offset : 0;        // offset coordinates of reverse strand for symmetric methylation
         const unsigned int begin_i = clip ? (over_start_x - start_x) : 0;       // clip the XM?
         const unsigned int end_i = clip ? overlap : size_x;                     // clip the XM?
         unsigned int meth = 0, total = 0;                                       // counters for methylated and total within context
         uint64_t fnv = offset_basis;                                            // FNV-1a hash of current pattern
-        for (unsigned int i=begin_i; i<end_i; i++) {                            // char by char - it's faster this way than using std::string in the cycle
-          if (ctx_map[(int)xm_x[i]]) {                                          // if base is within context
-            const unsigned int pos = start_x + i - offset_x;                    // position of the base
-            auto hint = pat_map.find(pos);                                      // find and check if this position is already included
-            if (hint != pat_map.end()) {
-              const unsigned int base = ctx_to_idx(xm_x[i]);                    // rcpp_cx_report for details
-              hint->second[npat] = base;                                        // save base by position
-              meth += !(base & 8);                                              // methylated + (0 for lowercase, 1 for uppercase)
-              total++;                                                          // total++
-              fnv_add(fnv, reinterpret_cast<const char*>(&pos), sizeof(pos));   // FNV-1a: add int position
-              fnv_add(fnv, xm_x+i, sizeof(char));                               // FNV-1a: add char base
+        read_bases.clear();
+        templs.for_each_segment(templid[x], [&] (uint32_t seg_pos, uint32_t len, // XM of the covered segments, either layout
+                                                 const uint8_t *xm_x, const uint8_t*) {
+          const unsigned int seg_end = std::min(end_i, seg_pos + len);
+          for (unsigned int i=std::max(begin_i, seg_pos); i<seg_end; i++) {     // char by char - it's faster this way than using std::string in the cycle
+            const char xm_c = T_view::xm_char(xm_x, i - seg_pos);               // XM char, unpacked if necessary
+            if (ctx_map[(int)xm_c]) {                                           // if base is within context
+              const unsigned int pos = start_x + i - offset_x;                  // position of the base
+              const int col = get_col(pos);                                     // find and check if this position is already included
+              if ((col >= 0) && col_ctx[col]) {
+                const unsigned int base = T_view::xm_idx(xm_x, i - seg_pos);    // rcpp_cx_report for details
+                read_bases.emplace_back(col, base);                             // save base by position
+                meth += !(base & 8);                                            // methylated + (0 for lowercase, 1 for uppercase)
+                total++;                                                        // total++
+                fnv_add(fnv, reinterpret_cast<const char*>(&pos), sizeof(pos)); // FNV-1a: add int position
+                fnv_add(fnv, &xm_c, sizeof(char));                              // FNV-1a: add char base
+              }
             }
           }
-        }
+        });
         
         if (fnv != offset_basis) {                                              // only if nonempty, valid pattern
           // extract bases to highlight
-          const char* seq_x = seq->at(templid[x]).c_str();                      // seq->at(templid[x]) is a reference to a corresponding SEQ string
           for (unsigned int i=0; i<hlght.size(); i++) {                         // for every position to highlight
             const unsigned int hlght_pos = hlght[i] - start_x;
-            if (((hlght_pos >= begin_i) && (hlght_pos < end_i)) &&              // if position within pattern
-                (ctx_map[(int)seq_x[hlght_pos]])) {                             // and is a valid (ACGT) base 
-              const unsigned int base = nt_to_idx(seq_x[hlght_pos]);            // see comments on base conversion at the top
-              auto hint = hlght_map.find(hlght[i]);                             // find this position
-              hint->second[npat] = base;                                        // save base by position
+            if (!((hlght_pos >= begin_i) && (hlght_pos < end_i))) continue;     // skip if position is not within pattern
+            char seq_c = 'N';                                                   // SEQ char, unpacked if necessary; N if not covered
+            templs.for_each_segment(templid[x], [&] (uint32_t seg_pos, uint32_t len,
+                                                     const uint8_t*, const uint8_t *seq_x) {
+              if ((hlght_pos >= seg_pos) && (hlght_pos < seg_pos + len))
+                seq_c = T_view::seq_char(seq_x, hlght_pos - seg_pos);
+            });
+            if (ctx_map[(int)seq_c]) {                                          // if it is a valid (ACGT) base 
+              const unsigned int base = nt_to_idx(seq_c);                       // see comments on base conversion at the top
+              read_bases.emplace_back(get_col(hlght[i]), base);                 // save base by position
               fnv_add(fnv, reinterpret_cast<char*>(&hlght[i]), sizeof(hlght[i])); // FNV-1a: add int position
-              fnv_add(fnv, seq_x+hlght_pos, sizeof(char));                      // FNV-1a: add char base
+              fnv_add(fnv, &seq_c, sizeof(char));                               // FNV-1a: add char base
             }
           }
           
-          // save pattern info
+          // already seen pattern - only its stats are updated
           npat++;                                                               // patterns++
+          if (summarize) {
+            auto seen = pat_row.try_emplace(fnv, pat_fnv.size());
+            if (!seen.second) {
+              const size_t row = seen.first->second;
+              pat_start[row] = std::min(pat_start[row], (int)(start_x+begin_i));  // coverage of all reads with this pattern
+              pat_end[row] = std::max(pat_end[row], (int)(start_x+end_i-1));
+              pat_beta[row] += (double)meth/total;
+              pat_count[row]++;
+              continue;
+            }
+          }
+          
+          // save pattern info
+          const size_t row = bases.add_row();
+          for (size_t b=0; b<read_bases.size(); b++)
+            bases.set(row, read_bases[b].first, read_bases[b].second);
           pat_strand.push_back(strand[x]);                                      // push strand
           pat_start.push_back(start_x+begin_i);                                 // push start
           pat_end.push_back(start_x+end_i-1);                                   // push end
           pat_nbase.push_back(total);                                           // push total
           pat_beta.push_back((double)meth/total);                               // push beta
-          char fnv_str[17] = {'0'};
-          snprintf(fnv_str, 17, "%.16" PRIX64, fnv);
-          pat_fnv.emplace_back(fnv_str, 16);                                    // push FNV-1a hash
+          pat_count.push_back(1);                                               // push count
+          pat_fnv.push_back(fnv);                                               // push FNV-1a hash
         }
       }
     }
   }
   
-  if (!npat) return Rcpp::DataFrame::create();                                  // return empty DataFrame if no patterns were found
+  #undef get_col
   
-  pat_map.merge(hlght_map);                                                     // merge pattern map and highlight map
-  
-  for (auto it=pat_map.begin(); it!=pat_map.end(); it++) {                      // we reserved more, cutting off NA values now
-    it->second.resize(npat);
-  }
-  Rcpp::DataFrame res = Rcpp::wrap(pat_map);                                    // wrap pattern map into DataFrame
+  const size_t nrow = bases.nrow;
+  if (!nrow) return Rcpp::DataFrame::create();                                  // return empty DataFrame if no patterns were found
   
   Rcpp::CharacterVector contexts = Rcpp::CharacterVector::create(               // base contexts
     "NA1", "H", "A", "C", "NA5", "X", "Z", "NA8",
     "NA9", "h", "T", "G","NA13", "x", "z","NA16"
   );
-  for (int i=0; i<res.length(); i++) {                                          // context factor for every column
-    Rcpp::IntegerVector column = res[i];
+  Rcpp::List columns (col_pos.size());                                          // context factor for every column
+  std::vector<std::string> col_names (col_pos.size());
+  for (size_t c=0; c<col_pos.size(); c++) {
+    Rcpp::IntegerVector column (nrow);
+    for (size_t row=0; row<nrow; row++) {
+      const uint8_t base = bases.get(row, c);
+      column[row] = base ? base : NA_INTEGER;
+    }
     column.attr("class") = "factor";
     column.attr("levels") = contexts;
+    columns[c] = column;
+    col_names[c] = std::to_string(col_pos[c]);
   }
+  columns.attr("names") = col_names;
+  Rcpp::DataFrame res (columns);                                                // wrap columns into DataFrame
   
-  Rcpp::IntegerVector pat_rname(npat, (int)target_rname);                       // rname factor (size, value)
+  Rcpp::IntegerVector pat_rname(nrow, (int)target_rname);                       // rname factor (size, value)
   pat_rname.attr("class") = rname.attr("class");
   pat_rname.attr("levels") = rname.attr("levels");
   
-  res.push_front(pat_fnv, "pattern");
+  std::vector<std::string> pat_hex (nrow);                                      // one hex string per row, i.e. per distinct pattern if summarized
+  for (size_t row=0; row<nrow; row++) {
+    char fnv_str[17] = {'0'};
+    snprintf(fnv_str, 17, "%.16" PRIX64, pat_fnv[row]);
+    pat_hex[row].assign(fnv_str, 16);
+  }
+  
+  res.push_front(pat_hex, "pattern");
+  if (summarize) {
+    for (size_t row=0; row<nrow; row++) pat_beta[row] /= pat_count[row];        // mean beta
+    res.push_front(pat_count, "count");
+  }
   res.push_front(pat_beta, "beta");
   res.push_front(pat_nbase, "nbase");
   res.push_front(pat_end, "end");
@@ -222,6 +307,107 @@ Rcpp::DataFrame rcpp_extract_patterns(Rcpp::DataFrame &df,
   return(res) ;
 }
 
+// all targets, single sweep over sorted reads
+template <class T_view>
+Rcpp::List extract_patterns(const T_view &templs,                               // templates, either layout
+                            Rcpp::DataFrame &df,
+                            Rcpp::IntegerVector &target_rname,
+                            Rcpp::IntegerVector &target_start,
+                            Rcpp::IntegerVector &target_end,
+                            signed int min_overlap,
+                            std::string &ctx,
+                            double min_ctx_freq,
+                            bool clip,
+                            unsigned int reverse_offset,
+                            Rcpp::IntegerVector &hlght,
+                            bool summarize) {
+  Rcpp::IntegerVector rname   = df["rname"];                                    // template rname
+  Rcpp::IntegerVector start   = df["start"];                                    // template start
+  Rcpp::IntegerVector templid = df["templid"];                                  // template id, effectively holds indexes of corresponding templates
+  const size_t n = rname.size();
+  
+  // filling the context map
+  unsigned int ctx_map [128] = {0};
+  std::for_each(ctx.begin(), ctx.end(), [&ctx_map] (unsigned int const &c) {
+    ctx_map[c] = 1;
+  });
+  ctx_map[(int)'A'] = 1; ctx_map[(int)'C'] = 1;                                 // make these bases valid for highlighting
+  ctx_map[(int)'G'] = 1; ctx_map[(int)'T'] = 1;
+  
+  // the longest template and if rows are still sorted
+  int max_size = 0;
+  bool sorted = true;
+  for (size_t x=0; x<n; x++) {
+    max_size = std::max(max_size, (int)templs.size(templid[x]));
+    if (x>0) sorted = sorted && ((rname[x-1] < rname[x]) ||
+      ((rname[x-1] == rname[x]) && (start[x-1] <= start[x])));
+  }
+  
+  // first row with (rname, start) not less than (r, s)
+  auto lower = [&] (int r, int s) {
+    size_t lo = 0, hi = n;
+    while (lo < hi) {
+      const size_t mid = lo + (hi-lo)/2;
+      if ((rname[mid] < r) || ((rname[mid] == r) && (start[mid] < s))) lo = mid + 1;
+      else hi = mid;
+    }
+    return lo;
+  };
+  
+  T_pos_map pos_map;
+  pos_map.reserve(0xFFFF);
+  std::vector<int> target_hlght;                                                // highlighted positions within the target
+  Rcpp::List res (target_rname.size());
+  for (int t=0; t<target_rname.size(); t++) {
+    Rcpp::checkUserInterrupt();
+    if ((target_rname[t]==NA_INTEGER) || (target_start[t]==NA_INTEGER) ||
+        (target_end[t]==NA_INTEGER)) {
+      res[t] = Rcpp::DataFrame::create();
+      continue;
+    }
+    
+    // overlap of at least min_overlap: start >= target_start + min_overlap -
+    // size, start <= target_end - min_overlap + 1
+    size_t first = 0, last = n;
+    if (sorted) {
+      first = lower(target_rname[t], target_start[t] + min_overlap - max_size);
+      last = lower(target_rname[t], target_end[t] - min_overlap + 2);
+    }
+    
+    target_hlght.clear();
+    for (int i=0; i<hlght.size(); i++)
+      if ((hlght[i]>=target_start[t]) && (hlght[i]<=target_end[t])) target_hlght.push_back(hlght[i]);
+    
+    res[t] = extract_target(templs, df, first, std::max(first, last),
+                            target_rname[t], target_start[t], target_end[t],
+                            min_overlap, ctx_map, min_ctx_freq, clip,
+                            reverse_offset, target_hlght, summarize, pos_map);
+  }
+  
+  return res;
+}
+
+// [[Rcpp::export("rcpp_extract_patterns")]]
+Rcpp::List rcpp_extract_patterns(Rcpp::DataFrame &df,                           // data frame with BAM data
+                                 Rcpp::IntegerVector &target_rname,             // target chromosomes
+                                 Rcpp::IntegerVector &target_start,             // target starts
+                                 Rcpp::IntegerVector &target_end,               // target ends
+                                 signed int min_overlap,                        // min overlap of reads and capture targets
+                                 std::string &ctx,                              // context string for bases to include
+                                 double min_ctx_freq,                           // minimum frequency of observed context at position
+                                 bool clip,                                     // clip the matched reads to target area
+                                 unsigned int reverse_offset,                   // decrease reverse strand coordinates by this value: 0 for CHH, 1 for CpG, 2 for CHG
+                                 Rcpp::IntegerVector &hlght,                    // positions of bases to extract sequence info; NB: unique and sorted!
+                                 bool summarize) {                              // one row per distinct pattern, with the number of reads
+  T_timer timer;
+  return with_timing<Rcpp::List>(
+    dispatch_view(df, extract_patterns, df, target_rname, target_start,         // merged refspaced templates, either layout
+                  target_end, min_overlap, ctx, min_ctx_freq, clip,
+                  reverse_offset, hlght, summarize),
+    timer, "patterns"
+  );
+}
+
 
 
 // test code in R
@@ -229,7 +415,7 @@ Rcpp::DataFrame rcpp_extract_patterns(Rcpp::DataFrame &df,
 
 /*** R
 bam <- preprocessBam(bam.file=system.file("extdata", "amplicon010meth.bam", package="epialleleR"))
-z <- data.table::data.table(rcpp_extract_patterns(bam, 47, 43124861, 43125249, 1, "zZ", 0.1, TRUE, 0, as.integer(c())))
+z <- data.table::data.table(rcpp_extract_patterns(bam, 47, 43124861, 43125249, 1, "zZ", 0.1, TRUE, 0, as.integer(c()), FALSE)[[1]])
 z[, c(lapply(.SD, unique), .N), by=pattern, .SDcols=grep("^X", colnames(z), value=TRUE)][order(-N)]
 */
 
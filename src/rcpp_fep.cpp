@@ -1,37 +1,149 @@
 #include <Rcpp.h>
-#include <htslib/kfunc.h>
+#include <cmath>
+#include <unordered_map>
+#include "epialleleR.h"
 
-// [[Rcpp::depends(Rhtslib)]]
+// Computes Fisher Exact P the same way as HTSlib's kt_fisher_exact does, but
+// with log-factorials taken from the table that is precomputed once up to the
+// largest table total. Takes any number of 2x2 tables per row (e.g., for both
+// strands) as quadruples of column names, and returns p-values for every one
+// of them. Rows are processed in parallel blocks, p-values of the repeated
+// tables are memoized within a block.
+
+// log-factorials and the test itself
+struct T_fisher {
+  std::vector<double> lf;                                                       // lf[n] = lgamma(n+1)
+  
+  struct T_acc {                                                                // state of incremental hypergeometric probability
+    int n11, n1_, n_1, n;
+    double p;
+  };
+  
+  T_fisher(const int max_n) : lf(max_n + 1) {
+    for (int k=0; k<=max_n; k++) lf[k] = std::lgamma((double)k + 1);
+  }
+  
+  // log\binom{n}{k}
+  inline double lbinom(const int n, const int k) const {
+    if ((k == 0) || (n == k)) return 0;
+    return lf[n] - lf[k] - lf[n-k];
+  }
+  
+  // hypergeometric distribution
+  inline double hypergeo(const int n11, const int n1_, const int n_1, const int n) const {
+    return std::exp(lbinom(n1_, n11) + lbinom(n-n1_, n_1-n11) - lbinom(n, n_1));
+  }
+  
+  // incremental version of hypergeometric distribution, only n11 changes if
+  // the rest is 0
+  inline double hypergeo_acc(const int n11, const int n1_, const int n_1, const int n, T_acc &aux) const {
+    if (n1_ || n_1 || n) {
+      aux.n11 = n11; aux.n1_ = n1_; aux.n_1 = n_1; aux.n = n;
+    } else {
+      if ((n11 % 11) && (n11 + aux.n - aux.n1_ - aux.n_1)) {
+        if (n11 == aux.n11 + 1) {
+          aux.p *= (double)(aux.n1_ - aux.n11) / n11 *
+            (aux.n_1 - aux.n11) / (n11 + aux.n - aux.n1_ - aux.n_1);
+          aux.n11 = n11;
+          return aux.p;
+        }
+        if (n11 == aux.n11 - 1) {
+          aux.p *= (double)aux.n11 / (aux.n1_ - n11) *
+            (aux.n11 + aux.n - aux.n1_ - aux.n_1) / (aux.n_1 - n11);
+          aux.n11 = n11;
+          return aux.p;
+        }
+      }
+      aux.n11 = n11;
+    }
+    aux.p = hypergeo(aux.n11, aux.n1_, aux.n_1, aux.n);
+    return aux.p;
+  }
+  
+  // two-tailed p-value
+  double two_tailed(const int n11, const int n12, const int n21, const int n22) const {
+    T_acc aux;
+    const int n1_ = n11 + n12, n_1 = n11 + n21, n = n11 + n12 + n21 + n22;
+    const int max = (n_1 < n1_) ? n_1 : n1_;                                    // max n11, for right tail
+    const int min = std::max(n1_ + n_1 - n, 0);                                 // min n11, for left tail
+    if (min == max) return 1.;                                                  // no need to do test
+    const double q = hypergeo_acc(n11, n1_, n_1, n, aux);                       // the probability of the current table
+    if (q == 0.0) return 0.;                                                    // too small to be stored in a double
+    
+    // left tail
+    double p = hypergeo_acc(min, 0, 0, 0, aux), left = 0., right = 0.;
+    for (int i=min+1; (p < 0.99999999 * q) && (i<=max); ++i) {                  // loop until underflow
+      left += p;
+      p = hypergeo_acc(i, 0, 0, 0, aux);
+    }
+    if (p < 1.00000001 * q) left += p;
+    // right tail
+    p = hypergeo_acc(max, 0, 0, 0, aux);
+    for (int j=max-1; (p < 0.99999999 * q) && (j>=0); --j) {                    // loop until underflow
+      right += p;
+      p = hypergeo_acc(j, 0, 0, 0, aux);
+    }
+    if (p < 1.00000001 * q) right += p;
+    // two-tail
+    return std::min(left + right, 1.);
+  }
+};
 
-// Computes Fisher Exact P using HTSlib's implementation
 
 // [[Rcpp::export]]
-std::vector<double> rcpp_fep (Rcpp::DataFrame &df,                              // data.table by reference with the following columns:
-                              std::vector<std::string> colnames)                // four strings with column names
-                              
+Rcpp::List rcpp_fep (Rcpp::DataFrame &df,                                       // data.table by reference with the following columns:
+                     std::vector<std::string> colnames,                         // four strings with column names per table, A, B, C, D
+                     int nthreads)                                              // threads, >1 for multiple
 {
-  Rcpp::IntegerVector A = df[colnames[0]];                                      // A
-  Rcpp::IntegerVector B = df[colnames[1]];                                      // B
-  Rcpp::IntegerVector C = df[colnames[2]];                                      // C
-  Rcpp::IntegerVector D = df[colnames[3]];                                      // D
-  
-  std::vector<double> p(A.size(), NA_REAL);
-  double left, right, two;
+  T_timer timer;
+  const size_t ntables = colnames.size() / 4;
+  std::vector<Rcpp::IntegerVector> cols;
+  for (size_t c=0; c<ntables*4; c++) cols.push_back(df[colnames[c]]);
+  std::vector<const int*> cols_p;                                               // raw pointers for worker threads
+  for (size_t c=0; c<cols.size(); c++) cols_p.push_back(cols[c].begin());
+  const size_t nrow = df.nrows();
   
-  for (unsigned int x=0; x<A.size(); x++) {
-    // checking for the interrupt
-    if ((x & 0xFFFFF) == 0) Rcpp::checkUserInterrupt();
-    
-    if (!Rcpp::IntegerVector::is_na(A[x]) &&
-        !Rcpp::IntegerVector::is_na(B[x]) &&
-        !Rcpp::IntegerVector::is_na(C[x]) &&
-        !Rcpp::IntegerVector::is_na(D[x])) {
-      kt_fisher_exact(A[x], B[x], C[x], D[x], &left, &right, &two);
-      p[x] = two;
+  // the largest table total
+  int max_n = 0;
+  for (size_t t=0; t<ntables; t++) {
+    for (size_t x=0; x<nrow; x++) {
+      int n = 0;
+      bool valid = true;
+      for (size_t k=0; k<4; k++) {
+        const int v = cols_p[t*4+k][x];
+        valid = valid && (v != NA_INTEGER) && (v >= 0);
+        n += valid ? v : 0;
+      }
+      if (valid) max_n = std::max(max_n, n);
     }
   }
+  const T_fisher fisher (max_n);
+  
+  std::vector<std::vector<double>> p (ntables, std::vector<double>(nrow, NA_REAL));
+  parallel_blocks(nrow, nthreads, [&] (size_t from, size_t to) {
+    std::unordered_map<uint64_t, double> memo;                                  // tables with all counts below 2^16
+    for (size_t t=0; t<ntables; t++) {
+      const int *A = cols_p[t*4], *B = cols_p[t*4+1], *C = cols_p[t*4+2], *D = cols_p[t*4+3];
+      for (size_t x=from; x<to; x++) {
+        if ((A[x]==NA_INTEGER) || (B[x]==NA_INTEGER) ||
+            (C[x]==NA_INTEGER) || (D[x]==NA_INTEGER) ||
+            (A[x]<0) || (B[x]<0) || (C[x]<0) || (D[x]<0)) continue;
+        if ((A[x] | B[x] | C[x] | D[x]) < 0x10000) {
+          const uint64_t key = (uint64_t)A[x] | (uint64_t)B[x] << 16 |
+            (uint64_t)C[x] << 32 | (uint64_t)D[x] << 48;
+          auto hit = memo.try_emplace(key, 0.);
+          if (hit.second) hit.first->second = fisher.two_tailed(A[x], B[x], C[x], D[x]);
+          p[t][x] = hit.first->second;
+        } else {
+          p[t][x] = fisher.two_tailed(A[x], B[x], C[x], D[x]);
+        }
+      }
+    }
+  });
   
-  return p;
+  Rcpp::List res (ntables);
+  for (size_t t=0; t<ntables; t++) res[t] = Rcpp::wrap(p[t]);
+  return with_timing<Rcpp::List>(res, timer, "fep");
 }
 
 
@@ -41,13 +153,13 @@ std::vector<double> rcpp_fep (Rcpp::DataFrame &df,
 /*** R
 d <- data.table::data.table(matrix(c(NA, 1:8095), ncol=4))
 n <- c("V1", "V2", "V3", "V4");
-system.time( p <- rcpp_fep(d, n) )
+system.time( p <- rcpp_fep(d, n, 1)[[1]] )
 system.time( f <- apply(d, 1, function (x) {if (any(is.na(x))) NA else stats::fisher.test(matrix(x, nrow=2))$p.value}) )
 max(abs(p-f), na.rm=TRUE)
-# microbenchmark::microbenchmark(rcpp_fep(d, n), times=10)
+# microbenchmark::microbenchmark(rcpp_fep(d, n, 1), times=10)
 */
 
 // Sourcing:
 // Rcpp::sourceCpp("rcpp_fep.cpp")
 
-// #############################################################################
\ No newline at end of file
+// #############################################################################
@@ -1,8 +1,10 @@
 #include <Rcpp.h>
+#include "epialleleR.h"
 // using namespace Rcpp;
 
 // Matches reads with given 1-base positions (VCF) and returns base frequencies.
-// FUNCTION ASSUMES THAT BOTH READS AND VCF ENTRIES ARE SORTED!
+// FUNCTION ASSUMES THAT READS ARE SORTED (as they are after preprocessBam),
+// VCF entries can be in any order.
 // Return value: std::array<int,32> for each position in VCF
 // Array indices are calculated as (char&7 | pass?15:0 | strand?31:0),
 // thus they appear as following: U+*8, U-*8, M+*8, M-*8
@@ -13,61 +15,118 @@
 // Gg    111  7
 // Nn    110  6
 // Tt    100  4
+//
+// VCF entries are sorted by position within every reference, and every
+// reference is swept once: the first VCF entry not before the start of the
+// current read only moves forward, as reads are sorted by start. Thus the
+// matching takes O(reads + VCF entries + matches). References are independent
+// and are processed in parallel. Counts are accumulated as 32 x uint32 per
+// VCF entry and are converted to the matrix at the end.
 
 // MATCH VCF ENTRIES, RETURN BASE FREQS
 // fast, vectorised
-// [[Rcpp::export("rcpp_get_base_freqs")]]
-Rcpp::NumericMatrix rcpp_get_base_freqs(Rcpp::DataFrame &df,                    // BAM data
-                                        std::vector<bool> pass,                 // read passes the threshold?
-                                        Rcpp::DataFrame &vcf)                   // VCF data
+template <class T_view>
+Rcpp::NumericMatrix get_base_freqs(const T_view &templs,                        // templates, either layout
+                                   Rcpp::DataFrame &df,
+                                   Rcpp::RawVector &pass,
+                                   Rcpp::DataFrame &vcf,
+                                   int nthreads)
 {
   Rcpp::IntegerVector read_rname = df["rname"];                                 // template rname
   Rcpp::IntegerVector read_strand = df["strand"];                               // template strand
   Rcpp::IntegerVector read_start = df["start"];                                 // template start
-  // Rcpp::CharacterVector read_seq = bam["seq"];                                  // template SEQ
-  Rcpp::XPtr<std::vector<std::string>> read_seq((SEXP)df.attr("seq_xptr"));     // merged refspaced template SEQ, as a pointer to std::vector<std::string>
-  Rcpp::IntegerVector templid = df["templid"];                                  // template id, effectively holds indexes of corresponding std::string in std::vector
+  Rcpp::IntegerVector templid = df["templid"];                                  // template id, effectively holds indexes of corresponding templates
+  const int *read_rname_p = read_rname.begin();                                 // raw pointers for worker threads
+  const int *read_strand_p = read_strand.begin();
+  const int *read_start_p = read_start.begin();
+  const int *templid_p = templid.begin();
   
   Rcpp::IntegerVector vcf_chr = vcf["seqnames"];                                // VCF rname
   Rcpp::IntegerVector vcf_pos = vcf["start"];                                   // VCF start
   
-  Rcpp::NumericMatrix res(vcf_pos.size(),32);
+  const T_pass_mask pass_mask (pass);                                           // does it pass the threshold, bit-packed
+  const size_t nreads = read_start.size(), nvcf = vcf_pos.size();
   
-  int cur_vcf=0;
-  for (unsigned int x=0; x<read_start.size(); x++) {
-    // checking for the interrupt
-    if ((x & 0xFFFFF) == 0) Rcpp::checkUserInterrupt();
-    
-    int read_end = read_start[x] + read_seq->at(templid[x]).size() - 1;
-    for (unsigned int i=cur_vcf; i<vcf_pos.size(); i++) {
-      if (vcf_chr[i]<read_rname[x] || 
-          (vcf_chr[i]==read_rname[x] && vcf_pos[i]<read_start[x])) {            // skip VCF if before read
-        cur_vcf=i;
-        continue;
-      }
-      if (vcf_chr[i]>read_rname[x] ||
-          (vcf_chr[i]==read_rname[x] && vcf_pos[i]>read_end)) {                 // start over from cur_vcf for new read
-        break;
-      }
-      if (vcf_chr[i]==read_rname[x] &&
-          vcf_pos[i]>=read_start[x] && vcf_pos[i]<=read_end) {                  // match found
-        int idx = read_seq->at(templid[x])[vcf_pos[i]-read_start[x]] & 7;
-        if (read_strand[x]==2) idx |= 8;
-        if (pass[x]) idx |= 16;
-        res(i,idx)++;
+  // VCF entries of known references, sorted by (rname, position)
+  std::vector<size_t> vcf_order;
+  vcf_order.reserve(nvcf);
+  for (size_t i=0; i<nvcf; i++)
+    if ((vcf_chr[i]!=NA_INTEGER) && (vcf_pos[i]!=NA_INTEGER)) vcf_order.push_back(i);
+  std::stable_sort(vcf_order.begin(), vcf_order.end(), [&] (size_t a, size_t b) {
+    return (vcf_chr[a] < vcf_chr[b]) ||
+      ((vcf_chr[a] == vcf_chr[b]) && (vcf_pos[a] < vcf_pos[b]));
+  });
+  std::vector<int> sorted_pos (vcf_order.size());                               // positions in this order, for the sweep
+  for (size_t v=0; v<vcf_order.size(); v++) sorted_pos[v] = vcf_pos[vcf_order[v]];
+  
+  // partitions: ranges of VCF entries and reads of every reference
+  struct T_partition { size_t vcf_first, vcf_last, read_first, read_last; };
+  std::vector<T_partition> parts;
+  for (size_t v=0, r=0; v<vcf_order.size(); ) {
+    const int chr = vcf_chr[vcf_order[v]];
+    size_t v_last = v;
+    while ((v_last<vcf_order.size()) && (vcf_chr[vcf_order[v_last]]==chr)) v_last++;
+    while ((r<nreads) && (read_rname_p[r]<chr)) r++;
+    size_t r_last = r;
+    while ((r_last<nreads) && (read_rname_p[r_last]==chr)) r_last++;
+    parts.push_back({v, v_last, r, r_last});
+    v = v_last; r = r_last;
+  }
+  
+  std::vector<uint32_t> counts (nvcf * 32, 0);
+  parallel_blocks(parts.size(), nthreads, [&] (size_t from, size_t to) {       // reference by reference
+    for (size_t p=from; p<to; p++) {
+      const T_partition &part = parts[p];
+      size_t lo = part.vcf_first;                                               // first VCF entry not before the read
+      for (size_t x=part.read_first; x<part.read_last; x++) {
+        const int start_x = read_start_p[x];
+        const int end_x = start_x + templs.size(templid_p[x]) - 1;
+        while ((lo<part.vcf_last) && (sorted_pos[lo]<start_x)) lo++;           // skip VCF if before read
+        const unsigned int flags = (read_strand_p[x]==2 ? 8 : 0) | (pass_mask[x] ? 16 : 0);
+        const unsigned int gap_idx = ('N' & 7) | flags;                         // positions between the covered segments
+        size_t v = lo;
+        templs.for_each_segment(templid_p[x], [&] (uint32_t pos, uint32_t len,  // SEQ of the covered segments
+                                                   const uint8_t*, const uint8_t *seq_x) {
+          const int seg_start = start_x + pos, seg_end = seg_start + len - 1;
+          for (; (v<part.vcf_last) && (sorted_pos[v]<seg_start); v++)
+            counts[vcf_order[v]*32 + gap_idx]++;
+          for (; (v<part.vcf_last) && (sorted_pos[v]<=seg_end); v++) {          // match found
+            const unsigned int idx = (T_view::seq_char(seq_x, sorted_pos[v]-seg_start) & 7) | flags;
+            counts[vcf_order[v]*32 + idx]++;
+          }
+        });
+        for (; (v<part.vcf_last) && (sorted_pos[v]<=end_x); v++)
+          counts[vcf_order[v]*32 + gap_idx]++;
       }
     }
-  }
+  }, 1);
+  
+  Rcpp::NumericMatrix res(nvcf, 32);
+  for (size_t j=0; j<32; j++)
+    for (size_t i=0; i<nvcf; i++) res[j*nvcf + i] = counts[i*32 + j];
 
   return res;
 }
 
+// [[Rcpp::export("rcpp_get_base_freqs")]]
+Rcpp::NumericMatrix rcpp_get_base_freqs(Rcpp::DataFrame &df,                    // BAM data
+                                        Rcpp::RawVector pass,                   // read passes the threshold? Bit-packed
+                                        Rcpp::DataFrame &vcf,                   // VCF data
+                                        int nthreads)                           // threads, >1 for multiple
+{
+  T_timer timer;
+  return with_timing<Rcpp::NumericMatrix>(
+    dispatch_view(df, get_base_freqs, df, pass, vcf, nthreads),                 // merged refspaced template SEQs, either layout
+    timer, "frequencies"
+  );
+}
+
 
 // test code in R
 //
 
 /*** R
-# microbenchmark::microbenchmark(rcpp_get_base_freqs(bam, pass, vcf.dt), times=10)
+# microbenchmark::microbenchmark(rcpp_get_base_freqs(bam, pass, vcf.dt, 1), times=10)
 */
 
 // Sourcing:
@@ -0,0 +1,104 @@
+#include <Rcpp.h>
+#include "epialleleR.h"
+// using namespace Rcpp;
+
+// Counts reads per BED target, strand and thresholding outcome.
+// Output: integer matrix with a row for every BED target and the last row for
+// reads not matching any target, columns TRUE+, TRUE-, FALSE+, FALSE- (reads
+// passing/failing the threshold, by strand)
+//
+// Every template is thresholded (T_threshold), matched to the target
+// (T_target_matcher) and counted in a single pass, without intermediate
+// vectors. Blocks of reads are processed by nthreads threads, every thread
+// has its own counters, which are summed up at the end.
+
+template <class T_view>
+std::vector<uint32_t> count_bed_reads(const T_view &templs,                     // templates, either layout
+                                      Rcpp::DataFrame &df,
+                                      const T_target_matcher &matcher,
+                                      const T_threshold *threshold,             // NULL if all reads pass
+                                      const size_t ntargets,
+                                      int nthreads)
+{
+  Rcpp::IntegerVector read_chr = df["rname"];                                   // template rname
+  Rcpp::IntegerVector read_strand = df["strand"];                               // template strand, 1 for '+', 2 for '-'
+  Rcpp::IntegerVector read_start = df["start"];                                 // template start
+  Rcpp::IntegerVector templid = df["templid"];                                  // template id, effectively holds indexes of corresponding templates
+  const int *read_chr_p = read_chr.begin();                                     // raw pointers for worker threads
+  const int *read_strand_p = read_strand.begin();
+  const int *read_start_p = read_start.begin();
+  const int *templid_p = templid.begin();
+  const T_counts *counts = templs.templs->counts_p;                             // XM char counts of merged refspaced templates
+  
+  const size_t nslots = (ntargets + 1) * 4;                                     // TRUE+, TRUE-, FALSE+, FALSE- per target and for unmatched
+  std::vector<std::vector<uint32_t>> thread_counts (std::max(nthreads, 1));
+  parallel_blocks(read_start.size(), nthreads, [&] (size_t from, size_t to, size_t thread) {
+    std::vector<uint32_t> &local = thread_counts[thread];
+    if (local.empty()) local.resize(nslots, 0);
+    for (size_t x=from; x<to; x++) {
+      const int t = templid_p[x];
+      const int read_end = read_start_p[x] + templs.size(t) - 1;
+      int target = matcher.match(read_chr_p[x], read_start_p[x], read_end);
+      if (target<0) target = ntargets;                                          // not matched
+      const bool pass = (threshold==NULL) || threshold->pass(counts[t]);
+      local[target*4 + (!pass)*2 + (read_strand_p[x]==2)]++;
+    }
+  });
+  
+  std::vector<uint32_t> res (nslots, 0);
+  for (size_t thread=0; thread<thread_counts.size(); thread++)                  // reduce
+    for (size_t i=0; i<thread_counts[thread].size(); i++)
+      res[i] += thread_counts[thread][i];
+  return res;
+}
+
+// [[Rcpp::export("rcpp_get_bed_report")]]
+Rcpp::IntegerMatrix rcpp_get_bed_report(Rcpp::DataFrame &df,                    // BAM data
+                                        Rcpp::DataFrame &bed,                   // BED data
+                                        bool amplicon,                          // match by position (amplicon) or by overlap (capture)
+                                        int tolerance,                          // coordinate tolerance for amplicons
+                                        signed int min_overlap,                 // min overlap of reads and capture targets
+                                        bool threshold_reads,                   // FALSE if all reads pass
+                                        std::string ctx_meth,                   // methylated context string, e.g. "XZ". NON-EMPTY
+                                        std::string ctx_unmeth,                 // unmethylated context string, e.g. "xz". NON-EMPTY
+                                        std::string ooctx_meth,                 // methylated out-of-context string, e.g. "HU". Can be empty
+                                        std::string ooctx_unmeth,               // unmethylated out-of-context string, e.g. "hu". Can be empty
+                                        unsigned int min_n_ctx,                 // minimum number of context bases in xm field
+                                        double min_ctx_meth_frac,               // minimum fraction of methylated to total context bases (min context beta value)
+                                        double max_ooctx_meth_frac,             // maximum fraction of methylated to total out-of-context bases (max out-of-context beta value)
+                                        int nthreads)                           // threads, >1 for multiple
+{
+  T_timer timer;
+  const T_target_matcher matcher (bed, amplicon, tolerance, min_overlap);
+  const T_threshold threshold (ctx_meth, ctx_unmeth, ooctx_meth, ooctx_unmeth,
+                               min_n_ctx, min_ctx_meth_frac,
+                               max_ooctx_meth_frac);
+  const size_t ntargets = bed.nrows();
+  
+  std::vector<uint32_t> counts = dispatch_view(
+    df, count_bed_reads, df, matcher, threshold_reads ? &threshold : NULL,
+    ntargets, nthreads
+  );
+  timer.lap("count");
+  
+  Rcpp::IntegerMatrix res (ntargets + 1, 4);
+  for (size_t i=0; i<=ntargets; i++)
+    for (size_t j=0; j<4; j++) res(i, j) = counts[i*4 + j];
+  res.attr("dimnames") = Rcpp::List::create(                                    // column names only
+    R_NilValue, Rcpp::CharacterVector::create("TRUE+", "TRUE-", "FALSE+", "FALSE-")
+  );
+  
+  return with_timing<Rcpp::IntegerMatrix>(res, timer, "output");
+}
+
+
+// test code in R
+//
+
+/*** R
+*/
+
+// Sourcing:
+// Rcpp::sourceCpp("rcpp_get_bed_report.cpp")
+
+// #############################################################################
@@ -1,42 +1,150 @@
 #include <Rcpp.h>
+#include <algorithm>
+#include "epialleleR.h"
 // using namespace Rcpp;
 
 // Parses XM tags and outputs average beta value according to context.
 //
 
-// fast, vectorised
+// fast, vectorised, using XM char counts precomputed at load time
 // [[Rcpp::export("rcpp_get_xm_beta")]]
-std::vector<double> rcpp_get_xm_beta(Rcpp::DataFrame &df,                       // BAM data
+Rcpp::NumericVector rcpp_get_xm_beta(Rcpp::DataFrame &df,                       // BAM data
                                      std::string ctx_meth,                      // methylated context string, e.g. "XZ". NON-EMPTY
-                                     std::string ctx_unmeth)                    // unmethylated context string, e.g. "xz". NON-EMPTY
+                                     std::string ctx_unmeth,                    // unmethylated context string, e.g. "xz". NON-EMPTY
+                                     int nthreads)                              // threads, >1 for multiple
 {
-  // Rcpp::CharacterVector xm = bam["XM"];                                         // template XM
-  Rcpp::XPtr<std::vector<std::string>> xm((SEXP)df.attr("xm_xptr"));            // merged refspaced template XMs, as a pointer to std::vector<std::string>
-  Rcpp::IntegerVector templid = df["templid"];                                  // template id, effectively holds indexes of corresponding std::string in std::vector
+  T_timer timer;
+  Rcpp::IntegerVector templid = df["templid"];                                  // template id, effectively holds indexes of corresponding templates
+  const int *templid_p = templid.begin();
+  const T_counts *counts = get_templates(df)->counts_p;                         // XM char counts of merged refspaced templates
   
-  std::vector<double> res (xm->size(), 0);
-  for (unsigned int x=0; x<xm->size(); x++) {
+  const std::vector<uint8_t> ctx_meth_slots = ctx_to_slots(ctx_meth);
+  const std::vector<uint8_t> ctx_unmeth_slots = ctx_to_slots(ctx_unmeth);
+  
+  Rcpp::NumericVector res (Rcpp::no_init(templid.size()));                      // filled in place by worker threads
+  double *res_p = res.begin();
+  parallel_blocks(templid.size(), nthreads, [&] (size_t from, size_t to) {
+    for (size_t x=from; x<to; x++) {
+      const T_counts &counts_x = counts[templid_p[x]];                          // counts of the current template
+      unsigned int n_ctx_meth = sum_counts(counts_x, ctx_meth_slots);
+      unsigned int n_ctx_unmeth = sum_counts(counts_x, ctx_unmeth_slots);
+      unsigned int n_ctx_all = n_ctx_meth + n_ctx_unmeth;
+      if (n_ctx_all==0) n_ctx_all=1;
+      res_p[x] = (double)n_ctx_meth / n_ctx_all;
+    }
+  });
+  
+  return with_timing<Rcpp::NumericVector>(res, timer, "beta");
+}
+
+
+// Per-target empirical cumulative distribution functions of context and
+// out-of-context beta values, for reads already matched to targets (1-based
+// or NA, see rcpp_match_target.cpp). Reads are grouped by target in a single
+// pass (counting sort, unmatched reads are the last group), then betas of
+// every group are sorted and collapsed to their distinct values (knots) with
+// cumulative counts. Betas are exact k/n fractions, the same as returned by
+// rcpp_get_xm_beta, therefore knots are identical to those of stats::ecdf.
+// Groups are processed in parallel.
+// Return value: list with the number of reads per group and, for context and
+// out-of-context betas, concatenated knots, cumulative counts and offsets of
+// groups within them.
+
+// [[Rcpp::export("rcpp_get_bed_ecdf")]]
+Rcpp::List rcpp_get_bed_ecdf(Rcpp::DataFrame &df,                              // BAM data
+                             Rcpp::IntegerVector &bed_match,                    // matched targets, 1-based or NA
+                             int ntargets,                                      // number of targets
+                             std::string ctx_meth,                              // methylated context string, e.g. "XZ". NON-EMPTY
+                             std::string ctx_unmeth,                            // unmethylated context string, e.g. "xz". NON-EMPTY
+                             std::string ooctx_meth,                            // methylated out-of-context string, e.g. "HU"
+                             std::string ooctx_unmeth,                          // unmethylated out-of-context string, e.g. "hu"
+                             int nthreads)                                      // threads, >1 for multiple
+{
+  T_timer timer;
+  Rcpp::IntegerVector templid = df["templid"];                                  // template id, effectively holds indexes of corresponding templates
+  const T_counts *counts = get_templates(df)->counts_p;                         // XM char counts of merged refspaced templates
+  const size_t n = templid.size(), ngroups = ntargets + 1;
+  if ((size_t)bed_match.size() != n) Rcpp::stop("Matched targets do not match the data");
+  
+  const std::vector<uint8_t> slots[4] = {
+    ctx_to_slots(ctx_meth), ctx_to_slots(ctx_unmeth),
+    ctx_to_slots(ooctx_meth), ctx_to_slots(ooctx_unmeth)
+  };
+  auto beta = [&slots] (const T_counts &counts_x, const int k) {                // beta value, 0 if there are no such bases
+    unsigned int n_meth = sum_counts(counts_x, slots[k]);
+    unsigned int n_all = n_meth + sum_counts(counts_x, slots[k+1]);
+    if (n_all==0) n_all=1;
+    return (double)n_meth / n_all;
+  };
+  auto group_of = [&] (const size_t x) {
+    const int m = bed_match[x];
+    return ((m==NA_INTEGER) || (m<1) || (m>ntargets)) ? (size_t)ntargets : (size_t)(m-1);
+  };
+  
+  // reads by group, betas in group order
+  std::vector<size_t> offset (ngroups+1, 0);
+  for (size_t x=0; x<n; x++) offset[group_of(x)+1]++;
+  for (size_t g=0; g<ngroups; g++) offset[g+1] += offset[g];
+  std::vector<double> values[2] = {std::vector<double>(n), std::vector<double>(n)};
+  std::vector<size_t> fill (offset.begin(), offset.end()-1);
+  for (size_t x=0; x<n; x++) {
     // checking for the interrupt
     if ((x & 0xFFFFF) == 0) Rcpp::checkUserInterrupt();
     
-    unsigned int ascii_map [128] = {0};
-    std::for_each(xm->at(templid[x]).begin(), xm->at(templid[x]).end(), [&ascii_map] (unsigned int const &c) {
-      ascii_map[c]++;
-    });
-    unsigned int n_ctx_meth = 0;
-    std::for_each(ctx_meth.begin(), ctx_meth.end(), [&n_ctx_meth, &ascii_map] (unsigned int const &c) {
-      n_ctx_meth += ascii_map[c];
-    });
-    unsigned int n_ctx_unmeth = 0;
-    std::for_each(ctx_unmeth.begin(), ctx_unmeth.end(), [&n_ctx_unmeth, &ascii_map] (unsigned int const &c) {
-      n_ctx_unmeth += ascii_map[c];
-    });
-    unsigned int n_ctx_all = n_ctx_meth + n_ctx_unmeth;
-    if (n_ctx_all==0) n_ctx_all=1;
-    res[x] = (double)n_ctx_meth / n_ctx_all;
+    const size_t i = fill[group_of(x)]++;
+    const T_counts &counts_x = counts[templid[x]];                              // counts of the current template
+    values[0][i] = beta(counts_x, 0);
+    values[1][i] = beta(counts_x, 2);
+  }
+  
+  // sort, collapse every group in place to knots and cumulative counts
+  std::vector<int> cumcount[2] = {std::vector<int>(n), std::vector<int>(n)};
+  std::vector<size_t> nknots[2] = {std::vector<size_t>(ngroups), std::vector<size_t>(ngroups)};
+  parallel_blocks(ngroups, nthreads, [&] (size_t from, size_t to) {
+    for (size_t g=from; g<to; g++) {
+      for (int v=0; v<2; v++) {
+        double *b = values[v].data() + offset[g], *e = values[v].data() + offset[g+1];
+        int *c = cumcount[v].data() + offset[g];
+        std::sort(b, e);
+        size_t k = 0;
+        for (double *i=b; i<e; i++) {
+          if ((k==0) || (*i != b[k-1])) b[k++] = *i;
+          c[k-1] = i - b + 1;
+        }
+        nknots[v][g] = k;
+      }
+    }
+  }, 0x100);
+  
+  // concatenated, compact
+  Rcpp::List steps[2];
+  for (int v=0; v<2; v++) {
+    Rcpp::IntegerVector steps_offset (ngroups+1);
+    for (size_t g=0; g<ngroups; g++) steps_offset[g+1] = steps_offset[g] + nknots[v][g];
+    Rcpp::NumericVector knots (steps_offset[ngroups]);
+    Rcpp::IntegerVector cum (steps_offset[ngroups]);
+    for (size_t g=0; g<ngroups; g++) {
+      std::copy(values[v].begin() + offset[g], values[v].begin() + offset[g] + nknots[v][g],
+                knots.begin() + steps_offset[g]);
+      std::copy(cumcount[v].begin() + offset[g], cumcount[v].begin() + offset[g] + nknots[v][g],
+                cum.begin() + steps_offset[g]);
+    }
+    steps[v] = Rcpp::List::create(
+      Rcpp::Named("knots") = knots,
+      Rcpp::Named("counts") = cum,
+      Rcpp::Named("offsets") = steps_offset
+    );
   }
   
-  return res;
+  Rcpp::IntegerVector nreads (ngroups);
+  for (size_t g=0; g<ngroups; g++) nreads[g] = offset[g+1] - offset[g];
+  
+  Rcpp::List res = Rcpp::List::create(
+    Rcpp::Named("nreads") = nreads,
+    Rcpp::Named("context") = steps[0],
+    Rcpp::Named("out.of.context") = steps[1]
+  );
+  return with_timing<Rcpp::List>(res, timer, "ecdf");
 }
 
 
@@ -46,7 +154,7 @@ std::vector<double> rcpp_get_xm_beta(Rcpp::DataFrame &df,
 /*** R
 # ctx.meth   <- "ZX"
 # ctx.unmeth <- "zx"
-# microbenchmark::microbenchmark(rcpp_get_xm_beta(bam, ctx.meth, ctx.unmeth), times=10)
+# microbenchmark::microbenchmark(rcpp_get_xm_beta(bam, ctx.meth, ctx.unmeth, 1), times=10)
 */
 
 // Sourcing:
@@ -1,85 +1,73 @@
 #include <Rcpp.h>
+#include "epialleleR.h"
 // using namespace Rcpp;
 
 // Matches reads to targets by start *or* end plus/minus tolerance (amplicons)
 // OR overlap (capture).
 // Return value: 1-based target index or NA for non-matched.
-// Only first match is taken.
+// Only first match (in the order of BED) is taken.
 //
-// Currently this code doesn't take advantage from the fact that both reads and
-// targets can be sorted. Thus it is possible to speed it up quite a bit, using
-// the VCF code as an example. HOWEVER: bed is not sorted intentionally.
+// Targets are indexed once (implicit interval trees, per reference, same as
+// in cgranges by Heng Li, see T_interval_index in epialleleR.h), thus
+// matching is O(reads * log(targets)). BED is not sorted intentionally, so
+// all targets overlapping the read are visited to find the first one. Reads
+// are independent and are matched in blocks by nthreads threads. The same
+// T_target_matcher is used by the fused BED report kernel.
 
-// MATCH AMPLICON BY POSITION
+// MATCH AMPLICON BY POSITION OR CAPTURE BY OVERLAP
 // fast, vectorised
-// [[Rcpp::export("rcpp_match_amplicon")]]
-std::vector<int> rcpp_match_amplicon(Rcpp::DataFrame &df,                       // BAM data
-                                     Rcpp::DataFrame &bed,                      // BED data
-                                     int tolerance)                             // coordinate tolerance
+template <class T_view>
+Rcpp::IntegerVector match_target(const T_view &templs,                          // templates, either layout
+                                 Rcpp::DataFrame &df,
+                                 const T_target_matcher &matcher,
+                                 int nthreads)
 {
   Rcpp::IntegerVector read_chr = df["rname"];                                   // template rname
   Rcpp::IntegerVector read_start = df["start"];                                 // template start
-  // Rcpp::CharacterVector xm = bam["XM"];                                         // template XM
-  Rcpp::XPtr<std::vector<std::string>> xm((SEXP)df.attr("xm_xptr"));            // merged refspaced template XMs, as a pointer to std::vector<std::string>
-  Rcpp::IntegerVector templid = df["templid"];                                  // template id, effectively holds indexes of corresponding std::string in std::vector
-  
-  Rcpp::IntegerVector ampl_chr = bed["seqnames"];                               // BED rname
-  Rcpp::IntegerVector ampl_start = bed["start"];                                // BED start
-  Rcpp::IntegerVector ampl_end = bed["end"];                                    // BED start
+  Rcpp::IntegerVector templid = df["templid"];                                  // template id, effectively holds indexes of corresponding templates
+  const int *read_chr_p = read_chr.begin();                                     // raw pointers for worker threads
+  const int *read_start_p = read_start.begin();
+  const int *templid_p = templid.begin();
   
-  std::vector<int> res (read_start.size(), NA_INTEGER);
-  for (unsigned int x=0; x<read_start.size(); x++) {
-    // checking for the interrupt
-    if ((x & 0xFFFFF) == 0) Rcpp::checkUserInterrupt();
-    
-    int read_end = read_start[x] + xm->at(templid[x]).size() - 1;
-    for (unsigned int i=0; i<ampl_start.size(); i++) {
-      if ((read_chr[x] == ampl_chr[i]) &&
-          ((std::abs(read_start[x] - ampl_start[i]) <= tolerance) ||
-           (std::abs(read_end - ampl_end[i]) <= tolerance))) {
-        res[x] = i+1;
-        break;
-      }
+  Rcpp::IntegerVector res (Rcpp::no_init(read_start.size()));                   // filled in place by worker threads
+  int *res_p = res.begin();
+  parallel_blocks(read_start.size(), nthreads, [&] (size_t from, size_t to) {
+    for (size_t x=from; x<to; x++) {
+      int read_end = read_start_p[x] + templs.size(templid_p[x]) - 1;
+      const int first = matcher.match(read_chr_p[x], read_start_p[x], read_end);
+      res_p[x] = first>=0 ? first+1 : NA_INTEGER;
     }
-  }
+  });
   
   return res;
 }
 
+// [[Rcpp::export("rcpp_match_amplicon")]]
+Rcpp::IntegerVector rcpp_match_amplicon(Rcpp::DataFrame &df,                    // BAM data
+                                        Rcpp::DataFrame &bed,                   // BED data
+                                        int tolerance,                          // coordinate tolerance
+                                        int nthreads)                           // threads, >1 for multiple
+{
+  T_timer timer;
+  const T_target_matcher matcher (bed, true, tolerance, 0);
+  return with_timing<Rcpp::IntegerVector>(
+    dispatch_view(df, match_target, df, matcher, nthreads),                     // merged refspaced templates, either layout
+    timer, "match"
+  );
+}
 
-// MATCH CAPTURE BY OVERLAP
-// fast, vectorised
 // [[Rcpp::export("rcpp_match_capture")]]
-std::vector<int> rcpp_match_capture(Rcpp::DataFrame &df,                        // BAM data
-                                    Rcpp::DataFrame &bed,                       // BED data
-                                    signed int min_overlap)                     // min overlap of reads and capture targets
+Rcpp::IntegerVector rcpp_match_capture(Rcpp::DataFrame &df,                     // BAM data
+                                       Rcpp::DataFrame &bed,                    // BED data
+                                       signed int min_overlap,                  // min overlap of reads and capture targets
+                                       int nthreads)                            // threads, >1 for multiple
 {
-  Rcpp::IntegerVector read_chr = df["rname"];                                   // template rname
-  Rcpp::IntegerVector read_start = df["start"];                                 // template start
-  // Rcpp::CharacterVector xm = bam["XM"];                                         // template XM
-  Rcpp::XPtr<std::vector<std::string>> xm((SEXP)df.attr("xm_xptr"));            // merged refspaced template XMs, as a pointer to std::vector<std::string>
-  Rcpp::IntegerVector templid = df["templid"];                                  // template id, effectively holds indexes of corresponding std::string in std::vector
-  
-  Rcpp::IntegerVector capt_chr = bed["seqnames"];                               // BED rname
-  Rcpp::IntegerVector capt_start = bed["start"];                                // BED start
-  Rcpp::IntegerVector capt_end = bed["end"];                                    // BED start
-  
-  std::vector<int> res (read_start.size(), NA_INTEGER);
-  for (unsigned int x=0; x<read_start.size(); x++) {
-    // checking for the interrupt
-    if ((x & 0xFFFFF) == 0) Rcpp::checkUserInterrupt();
-    
-    int read_end = read_start[x] + xm->at(templid[x]).size() - 1;
-    for (unsigned int i=0; i<capt_start.size(); i++) {
-      signed int overlap = std::min(read_end, capt_end[i]) - std::max(read_start[x], capt_start[i]) + 1;
-      if ((read_chr[x] == capt_chr[i]) && (overlap >= min_overlap)) {
-        res[x] = i+1;
-        break;
-      }
-    }
-  }
-  
-  return res;
+  T_timer timer;
+  const T_target_matcher matcher (bed, false, 0, min_overlap);
+  return with_timing<Rcpp::IntegerVector>(
+    dispatch_view(df, match_target, df, matcher, nthreads),                     // merged refspaced templates, either layout
+    timer, "match"
+  );
 }
 
 
@@ -2,6 +2,12 @@
 #include <htslib/hts.h>
 #include <htslib/sam.h>
 #include <htslib/thread_pool.h>
+#include <unordered_map>
+#include <queue>
+#include <thread>
+#include <memory>
+#include <exception>
+#include "epialleleR.h"
 
 // [[Rcpp::depends(Rhtslib)]]
 
@@ -10,201 +16,1106 @@
 // [+] HTSlib threads
 // [+] rec_seq_rs and rec_xm_rs as char*
 // [?] reverse QNAME
-// [ ] free resources on interrupt
+// [+] free resources on interrupt
+// [+] coordinate-sorted BAM with in-memory mate pairing
+// [+] multithreaded assembly of templates (QNAME-sorted BAM)
+// [+] stats of skipped records and timing of the stages
+// [+] prefetching of the next BAM file in a background thread
+// [+] spilling of sorted runs to disk when memory is limited
+// [+] sparse templates: no memory for the gaps between the mates
+// [+] depth capping by seeded sampling of templates
+// [+] radix sort of templates by coordinate, in place of setorder in R
 
-// [[Rcpp::export]]
-Rcpp::DataFrame rcpp_read_bam_paired (std::string fn,                           // file name
-                                      int min_mapq,                             // min read mapping quality
-                                      int min_baseq,                            // min base quality
-                                      bool skip_duplicates,                     // skip marked duplicates
-                                      int nthreads)                             // HTSlib threads, >0 for multiple
+
+// lays BAM record in reference space, keeping the bases of highest quality
+// seen so far. Bases outside of [0, templ_width) are skipped (e.g., of mates
+// overhanging the ISIZE). Returns FALSE if CIGAR contains unknown operation
+static inline bool apply_cigar (const bam1_t *bam_rec,                          // BAM record
+                                const char *rec_xm,                             // its XM string, without leading 'Z'
+                                const int templ_start,                          // template POS
+                                const int templ_width,                          // size of template arrays
+                                uint8_t *templ_qual_rs,                         // template QUAL array
+                                uint8_t *templ_seq_rs,                          // template SEQ array
+                                uint8_t *templ_xm_rs,                           // template XM array
+                                const char *seq_lut)                            // nt16 code -> stored SEQ code
 {
-  // constants
-  int max_qname_width = 1024;                                                   // max QNAME length, not expanded yet, ever error-prone?
-  int max_templ_width = 8192;                                                   // max insert size, expanded if necessary
+  const uint8_t *rec_qual = bam_get_qual(bam_rec);                              // quality string (Phred scale with no +33 offset)
+  const uint8_t *rec_pseq = bam_get_seq(bam_rec);                               // packed sequence string (4 bit per base)
+  const uint32_t n_cigar = bam_rec->core.n_cigar;                               // number of CIGAR operations
+  const uint32_t *rec_cigar = bam_get_cigar(bam_rec);                           // CIGAR array
+  uint32_t query_pos = 0;                                                       // starting position in query array
+  int dest_pos = bam_rec->core.pos - templ_start;                               // starting position in destination array
+  for (size_t i=0; i<n_cigar; i++) {                                            // op by op
+    uint32_t cigar_op = bam_cigar_op(rec_cigar[i]);                             // CIGAR operation
+    uint32_t cigar_oplen = bam_cigar_oplen(rec_cigar[i]);                       // CIGAR operation length
+    switch(cigar_op) {
+      case BAM_CMATCH :                                                         // 'M', 0
+      case BAM_CEQUAL :                                                         // '=', 7
+      case BAM_CDIFF :                                                          // 'X', 8
+        for (int j=std::max(0, -dest_pos),
+             last=std::min((int)cigar_oplen, templ_width - dest_pos); j<last; j++) {
+          if (rec_qual[query_pos+j] > templ_qual_rs[dest_pos+j]) {
+            templ_qual_rs[dest_pos+j] = rec_qual[query_pos+j];
+            templ_seq_rs[dest_pos+j] = seq_lut[bam_seqi(rec_pseq,query_pos+j)];
+            templ_xm_rs[dest_pos+j] = rec_xm[query_pos+j];
+          }
+        }
+        query_pos += cigar_oplen;
+        dest_pos += (int)cigar_oplen;
+        break;
+      case BAM_CINS :                                                           // 'I', 1
+      case BAM_CSOFT_CLIP :                                                     // 'S', 4
+        query_pos += cigar_oplen;
+        break;
+      case BAM_CDEL :                                                           // 'D', 2
+      case BAM_CREF_SKIP :                                                      // 'N', 3
+        dest_pos += (int)cigar_oplen;
+        break;
+      case BAM_CHARD_CLIP :                                                     // 'H', 5
+      case BAM_CPAD :                                                           // 'P', 6
+      case BAM_CBACK :
+        break;
+      default :
+        return false;
+    }
+  }
+  return true;
+}
+
+
+// stable order of rows by (RNAME, POS): LSD radix sort of 64-bit keys by
+// 16-bit digits, skipping the digits that are the same for all rows (e.g.,
+// the upper half of RNAME). Keys are permuted together with row numbers, so
+// that every pass reads and writes sequentially
+static std::vector<int> coordinate_order (const std::vector<int> &rname,
+                                          const std::vector<int> &start)
+{
+  const size_t n = rname.size();
+  std::vector<uint64_t> key (n), key_buf (n);
+  std::vector<int> order (n), order_buf (n);
+  for (size_t x=0; x<n; x++) {
+    key[x] = ((uint64_t)(uint32_t)rname[x] << 32) | (uint32_t)start[x];         // both are positive
+    order[x] = x;
+  }
+  std::vector<size_t> count (0x10000);
+  for (int shift=0; (shift<64) && (n>1); shift+=16) {
+    std::fill(count.begin(), count.end(), 0);
+    for (size_t i=0; i<n; i++) count[(key[i] >> shift) & 0xFFFF]++;
+    if (count[(key[0] >> shift) & 0xFFFF] == n) continue;                       // the same digit everywhere
+    for (size_t d=0, sum=0; d<count.size(); d++) {                              // counts -> first positions
+      const size_t c = count[d];
+      count[d] = sum;
+      sum += c;
+    }
+    for (size_t i=0; i<n; i++) {
+      const size_t dest = count[(key[i] >> shift) & 0xFFFF]++;
+      key_buf[dest] = key[i];
+      order_buf[dest] = order[i];
+    }
+    key.swap(key_buf);
+    order.swap(order_buf);
+  }
+  return order;
+}
+
+
+// reasons to skip BAM record, counted in reader stats
+enum {
+  SKIP_NONE = -1,                                                               // record passes the filters
+  SKIP_MAPQ,                                                                    // mapping quality < min.mapq
+  SKIP_NOT_PROPER_PAIR,                                                         // not a proper pair
+  SKIP_DUPLICATE,                                                               // optical/PCR duplicate
+  SKIP_NO_TAGS,                                                                 // no XM/XG tags
+  SKIP_REASONS                                                                  // number of reasons
+};
+
+// counters of the reader, summed up over worker threads
+struct T_read_stats {
+  uint64_t skipped[SKIP_REASONS] = {0};                                         // records skipped, by reason
+  uint64_t bytes = 0;                                                           // bytes of decompressed alignment records
+  uint64_t capped = 0;                                                          // templates dropped by depth capping
+  int max_width = 0;                                                            // max template width
   
-  // file IO
-  htsFile *bam_fp = hts_open(fn.c_str(), "r");                                  // try open file
-  if (bam_fp==NULL) Rcpp::stop("Unable to open BAM file for reading");          // fall back if error
-  htsThreadPool thread_pool = {NULL, 0};                                        // thread pool cuts time by 30%
-  if (nthreads>0) {
-    thread_pool.pool = hts_tpool_init(nthreads);                                // when initiated for >0 threads
-    hts_set_opt(bam_fp, HTS_OPT_THREAD_POOL, &thread_pool);                     // and bound to the file pointer
+  void add(const T_read_stats &other) {
+    for (int i=0; i<SKIP_REASONS; i++) skipped[i] += other.skipped[i];
+    bytes += other.bytes;
+    if (other.max_width > max_width) max_width = other.max_width;
   }
-  bam_hdr_t *bam_hdr = sam_hdr_read(bam_fp);                                    // try read file header
-  if (bam_hdr==NULL) Rcpp::stop("Unable to read BAM header");                   // fall back if error  
-  bam1_t *bam_rec = bam_init1();                                                // create BAM alignment structure
+};
+
+// checks if BAM record passes the filters and has XG/XM tags, which are
+// returned (XM without leading 'Z'). Returns SKIP_NONE or reason to skip
+static inline int filter_record (const bam1_t *bam_rec,                         // BAM record
+                                 const int min_mapq,                            // min read mapping quality
+                                 const bool skip_duplicates,                    // skip marked duplicates
+                                 const bool keep_unpaired,                      // mapped records that are not a proper pair are templates of their own
+                                 const char **rec_strand,                       // genome strand
+                                 const char **rec_xm)                           // methylation string
+{
+  if (bam_rec->core.qual < min_mapq) return SKIP_MAPQ;                          // skip if mapping quality < min.mapq
+  if (!(bam_rec->core.flag & BAM_FPROPER_PAIR) &&                               // or if not a proper pair, unless kept (primary alignments only)
+      (!keep_unpaired || (bam_rec->core.flag & (BAM_FUNMAP | BAM_FSECONDARY | BAM_FSUPPLEMENTARY))))
+    return SKIP_NOT_PROPER_PAIR;
+  if (skip_duplicates && (bam_rec->core.flag & BAM_FDUP)) return SKIP_DUPLICATE;// or if record is an optical/PCR duplicate
+  *rec_strand = (const char*) bam_aux_get(bam_rec, "XG");                       // genome strand
+  *rec_xm = (const char*) bam_aux_get(bam_rec, "XM");                           // methylation string
+  if ((*rec_strand==NULL) || (*rec_xm==NULL)) return SKIP_NO_TAGS;              // skip if no XM/XG tags (no methylation info available)
+  (*rec_xm)++;                                                                  // remove leading 'Z' from XM string
+  return SKIP_NONE;
+}
+
+// width of the template made of a single unpaired record, which has no ISIZE:
+// reference span of its alignment
+static inline int unpaired_width (const bam1_t *bam_rec)
+{
+  return bam_cigar2rlen(bam_rec->core.n_cigar, bam_get_cigar(bam_rec));
+}
+
+
+// QUAL, SEQ and XM arrays of the template being assembled, in pieces of
+// reference space covered by its reads. Dense template has a single piece
+// spanning the whole template, while sparse one gets a piece per group of
+// overlapping reads, so that the gaps between the mates are neither allocated
+// nor cleaned. Capacity of the arrays is reused
+struct T_holder {
+  struct T_piece {
+    int start, end;                                                             // [start, end) relative to template POS
+    std::vector<uint8_t> qual, seq, xm;
+  };
+  std::vector<T_piece> pieces;                                                  // ordered by start, spare ones after npieces
+  size_t npieces = 0;
+  bool sparse = false;
+  uint8_t qual_blank = 0, seq_blank = 0;                                        // min base quality, nt16 code or char for unknown base
   
-  // main containers
-  std::vector<std::string>* seq = new std::vector<std::string>;                 // SEQ
-  std::vector<std::string>* xm = new std::vector<std::string>;                  // XM
-  std::vector<int> rname, strand, start;                                        // id for RNAME, id for CT==1/GA==2, POS
-  int nrecs = 0, ntempls = 0;                                                   // counters: BAM records, templates (read pairs)
+  inline void reset(const int width) {                                          // new template
+    npieces = 0;
+    if (!sparse) cover(0, width);
+  }
   
-  // reserve some memory
-  rname.reserve(0xFFFFF); strand.reserve(0xFFFFF); start.reserve(0xFFFFF); 
-  seq->reserve(0xFFFFF); xm->reserve(0xFFFFF);
+  // piece covering [start, end), merged with the pieces it overlaps or touches
+  T_piece& cover(const int start, const int end) {
+    size_t first = 0, last;
+    while ((first < npieces) && (pieces[first].end < start)) first++;
+    for (last=first; (last < npieces) && (pieces[last].start <= end); last++);  // pieces [first, last) are merged
+    if ((last == first+1) && (pieces[first].start <= start) && (pieces[first].end >= end))
+      return pieces[first];
+    if (pieces.size() == npieces) pieces.resize(npieces + 1);
+    T_piece &merged = pieces[npieces];                                          // spare one
+    merged.start = first < last ? std::min(start, pieces[first].start) : start;
+    merged.end = first < last ? std::max(end, pieces[last-1].end) : end;
+    const size_t w = merged.end - merged.start;
+    merged.qual.assign(w, qual_blank);
+    merged.seq.assign(w, seq_blank);
+    merged.xm.assign(w, '-');
+    for (size_t i=first; i<last; i++) {
+      const T_piece &p = pieces[i];
+      const size_t offset = p.start - merged.start;
+      std::copy(p.qual.begin(), p.qual.end(), merged.qual.begin() + offset);
+      std::copy(p.seq.begin(), p.seq.end(), merged.seq.begin() + offset);
+      std::copy(p.xm.begin(), p.xm.end(), merged.xm.begin() + offset);
+    }
+    if (first == last) {                                                        // new piece, inserted
+      std::rotate(pieces.begin() + first, pieces.begin() + npieces,
+                  pieces.begin() + npieces + 1);
+      npieces++;
+    } else {                                                                    // replaces merged ones, which become spare
+      std::swap(pieces[first], pieces[npieces]);
+      std::rotate(pieces.begin() + first + 1, pieces.begin() + last,
+                  pieces.begin() + npieces);
+      npieces -= last - first - 1;
+    }
+    return pieces[first];
+  }
   
-  // template holders
-  char *templ_qname = (char*) malloc(max_qname_width * sizeof(char));           // template QNAME
-  uint8_t *templ_qual_rs = (uint8_t*) malloc(max_templ_width * sizeof(uint8_t));// template QUAL array
-  uint8_t *templ_seq_rs  = (uint8_t*) malloc(max_templ_width * sizeof(uint8_t));// template SEQ array
-  uint8_t *templ_xm_rs   = (uint8_t*) malloc(max_templ_width * sizeof(uint8_t));// template XM array
+  inline T_piece& place(const bam1_t *bam_rec, const int templ_start) {         // piece for the record
+    if (!sparse) return pieces[0];
+    const int rec_start = bam_rec->core.pos - templ_start;
+    return cover(rec_start, rec_start +
+                 bam_cigar2rlen(bam_rec->core.n_cigar, bam_get_cigar(bam_rec)));
+  }
+  
+  // covered segments within [0, width): fn(piece, from, to). Segments end at
+  // runs of at least min_gap uncovered bases, which are cheaper to skip
+  template <class F>
+  void segments(const int width, F fn) const {
+    const int min_gap = 8;
+    for (size_t k=0; k<npieces; k++) {
+      const T_piece &p = pieces[k];
+      const int lo = std::max(p.start, 0) - p.start, hi = std::min(p.end, width) - p.start;
+      int from = -1, last = -1;                                                 // start of the segment and its last covered base
+      for (int i=lo; i<hi; i++) {
+        if (p.xm[i] == '-') continue;
+        if ((from >= 0) && (i - last > min_gap)) { fn(p, from, last + 1); from = -1; }
+        if (from < 0) from = i;
+        last = i;
+      }
+      if (from >= 0) fn(p, from, last + 1);
+    }
+  }
+  
+  void push(T_templates *templs, const int width) const {                       // SEQ+XM
+    if (!sparse) {
+      templs->push(pieces[0].seq.data(), pieces[0].xm.data(), width);
+      return;
+    }
+    uint32_t nseg = 0;
+    segments(width, [&] (const T_piece&, int, int) { nseg++; });
+    templs->begin_segments(width, nseg);
+    segments(width, [&] (const T_piece &p, int from, int to) {
+      templs->push_segment(p.start + from, p.seq.data() + from, p.xm.data() + from, to - from);
+    });
+    templs->end_segments();
+  }
+};
+
+// depth capping: bottom-k sample of templates within every bin of template
+// starts. Every template gets a pseudo-random key from its QNAME and the seed,
+// and max_depth templates with the smallest keys are kept. The sample is
+// therefore the same for the same seed regardless of the sort order and the
+// number of threads. Evicted templates stay in the store until compacted,
+// which is cheap as there are only ~k*ln(n/k) of them
+struct T_depth_cap {
+  typedef std::pair<uint64_t, size_t> T_entry;                                  // key, row in the store
+  const size_t max_depth;                                                       // templates per bin
+  const int bin_size;                                                           // bases
+  const uint64_t seed;
+  std::unordered_map<uint64_t, std::priority_queue<T_entry>> bins;              // (RNAME, bin) -> sampled templates, largest key on top
+  std::vector<size_t> evicted;                                                  // rows to remove
+  uint64_t dropped = 0;                                                         // templates that were not sampled or were evicted
+  
+  T_depth_cap(size_t max_depth, int bin_size, uint64_t seed) :
+    max_depth(max_depth), bin_size(bin_size), seed(seed) {}
+  
+  inline uint64_t key(const char *qname) const {                                // FNV-1a of QNAME, finalized by splitmix64
+    uint64_t h = 14695981039346656037u ^ seed;
+    for (; *qname; qname++) { h ^= (uint8_t)*qname; h *= 1099511628211u; }
+    h = (h ^ (h >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    h = (h ^ (h >> 27)) * 0x94D049BB133111EBULL;
+    return h ^ (h >> 31);
+  }
+  
+  inline std::priority_queue<T_entry>& bin(int rname, int start) {
+    return bins[((uint64_t)rname << 32) | (uint32_t)(start / bin_size)];
+  }
+  
+  inline bool admits(int rname, int start, uint64_t k) {                        // FALSE if template would not be sampled anyway
+    const std::priority_queue<T_entry> &h = bin(rname, start);
+    return (h.size() < max_depth) || (k < h.top().first);
+  }
+  
+  inline bool add(int rname, int start, uint64_t k, size_t row) {               // TRUE if template is sampled and goes to the row
+    std::priority_queue<T_entry> &h = bin(rname, start);
+    if (h.size() >= max_depth) {
+      dropped++;
+      if (k >= h.top().first) return false;
+      evicted.push_back(h.top().second);
+      h.pop();
+    }
+    h.emplace(k, row);
+    return true;
+  }
+};
+
+// templates assembled by one worker thread from a batch of records
+struct T_chunk {
+  std::vector<int> rname, strand, start;                                        // id for RNAME, id for CT==1/GA==2, POS
+  T_templates templs;                                                           // SEQ+XM
+  T_holder holder;                                                              // template being assembled
+  const T_depth_cap *cap = NULL;                                                // keys of templates are computed if set
+  std::vector<uint64_t> key;                                                    // their keys
+  T_read_stats stats;                                                           // skipped records, max width
+  uint64_t nunpaired = 0;                                                       // templates of unpaired records
+  std::string error;                                                            // QNAME of the record with unknown CIGAR operation
+  std::exception_ptr exception;                                                 // thrown by assembly (e.g., lack of memory), rethrown by the reading thread
+};
+
+// merges reads of QNAME-sorted BAM records into templates. Unpaired records,
+// if kept, are templates of their own and are not compared by QNAME. Doesn't
+// use R API and is therefore safe to run in a separate thread
+static void assemble_templates (bam1_t **recs,                                  // BAM records, templates are not split between batches
+                                const size_t nrecs,                             // number of records
+                                const int min_mapq,                             // min read mapping quality
+                                const bool skip_duplicates,                     // skip marked duplicates
+                                const bool keep_unpaired,                       // keep records that are not a proper pair
+                                const char *seq_lut,                            // nt16 code -> stored SEQ code
+                                T_chunk *chunk)                                 // results, with template holder set up
+{
+  const char *templ_qname = NULL;                                               // template QNAME, points to the record within the batch
   int templ_rname = 0, templ_start = 0, templ_strand = 0, templ_width = 0;      // template RNAME, POS, STRAND, ISIZE
+  uint64_t templ_key = 0;                                                       // template key for depth capping
   
-  #define unsorted (ntempls==0) || (nrecs/(ntempls>>1) < 3)                     /* TRUE if no templates OR fraction of two-read templates is <67% */
-  #define push_template {               /* pushing template data to vectors */ \
-    rname.push_back(templ_rname + 1);                            /* RNAME+1 */ \
-    strand.push_back(templ_strand);                               /* STRAND */ \
-    start.push_back(templ_start + 1);                              /* POS+1 */ \
-    seq->emplace_back((const char*) templ_seq_rs, templ_width);      /* SEQ */ \
-    xm->emplace_back( (const char*) templ_xm_rs,  templ_width);       /* XM */ \
-    ntempls++;                                                        /* +1 */ \
+  #define push_chunk_template {     /* pushing template data to chunk */       \
+    chunk->rname.push_back(templ_rname + 1);                     /* RNAME+1 */ \
+    chunk->strand.push_back(templ_strand);                        /* STRAND */ \
+    chunk->start.push_back(templ_start + 1);                       /* POS+1 */ \
+    chunk->holder.push(&chunk->templs, templ_width);              /* SEQ+XM */ \
+    if (chunk->cap) chunk->key.push_back(templ_key);                           \
   }
   
-  // process alignments
-  while( sam_read1(bam_fp, bam_hdr, bam_rec) > 0 ) {                            // rec by rec
-    nrecs++;                                                                    // BAM alignment records ++
-    if ((nrecs & 0xFFFFF) == 0) {                                               // every ~1M reads
-      Rcpp::checkUserInterrupt();                                               // checking for the interrupt
-      if (unsorted) break;                                                      // break out if seemingly unsorted
-    }
-    if ((bam_rec->core.qual < min_mapq) ||                                      // skip if mapping quality < min.mapq
-        (!(bam_rec->core.flag & BAM_FPROPER_PAIR)) ||                           // or if not a proper pair
-        (skip_duplicates && (bam_rec->core.flag & BAM_FDUP))) continue;         // or if record is an optical/PCR duplicate
-    
-    char *rec_strand = (char*) bam_aux_get(bam_rec, "XG");                      // genome strand
-    char *rec_xm = (char*) bam_aux_get(bam_rec, "XM");                          // methylation string
-    if ((rec_strand==NULL) || (rec_xm==NULL)) continue;                         // skip if no XM/XG tags (no methylation info available)
+  for (size_t r=0; r<nrecs; r++) {                                              // rec by rec
+    const bam1_t *bam_rec = recs[r];
+    const char *rec_strand, *rec_xm;
+    const int skip = filter_record(bam_rec, min_mapq, skip_duplicates, keep_unpaired, &rec_strand, &rec_xm);
+    if (skip != SKIP_NONE) {
+      chunk->stats.skipped[skip]++;
+      continue;
+    }
     
     // check if not the same template (QNAME)
-    if ((strcmp(templ_qname, bam_get_qname(bam_rec)) != 0)) {                
+    const bool single = !(bam_rec->core.flag & BAM_FPROPER_PAIR);               // unpaired record, kept
+    if (single || (templ_qname==NULL) || (strcmp(templ_qname, bam_get_qname(bam_rec)) != 0)) {
       // store previous template if it's a valid record
-      if (templ_strand!=0) push_template;                                       // templ_strand is 0 for empty records (very start of BAM and/or when invalid records are in front of BAM)
+      if (templ_strand!=0) push_chunk_template;                                 // templ_strand is 0 for empty records (very start of the batch)
       
       // initialize new template
-      strcpy(templ_qname, bam_get_qname(bam_rec));                              // store template QNAME
+      templ_qname = single ? NULL : bam_get_qname(bam_rec);                     // store template QNAME, none to match for unpaired record
       templ_rname = bam_rec->core.tid;                                          // store template RNAME
-      templ_start = bam_rec->core.pos < bam_rec->core.mpos ?                    // smallest of POS,MPOS is a start
+      templ_start = single || (bam_rec->core.pos < bam_rec->core.mpos) ?        // smallest of POS,MPOS is a start
         bam_rec->core.pos : bam_rec->core.mpos;
-      templ_width = abs(bam_rec->core.isize);                                   // template ISIZE
-      // char *rec_strand = (char*) bam_aux_get(bam_rec, "XG");                    // genome strand
-      // if (rec_strand==NULL)                                                     // fall back if absent
-      //   Rcpp::stop("Genome strand is missing for BAM record #%i", nrecs);
+      templ_width = single ? unpaired_width(bam_rec) : abs(bam_rec->core.isize);// template ISIZE
+      if (templ_width > chunk->stats.max_width) chunk->stats.max_width = templ_width;
       templ_strand = ( rec_strand[1] == 'C' ) ? 1 : 2 ;                         // STRAND is 1 if "ZCT"/"+", 2 if "ZGA"/"-"
+      if (chunk->cap) templ_key = chunk->cap->key(bam_get_qname(bam_rec));
+      if (single) chunk->nunpaired++;
+      chunk->holder.reset(templ_width);                                         // clean template holder
+    }
+    
+    // add another read to the template
+    T_holder::T_piece &piece = chunk->holder.place(bam_rec, templ_start);
+    if (!apply_cigar(bam_rec, rec_xm, templ_start + piece.start, piece.qual.size(),
+                     piece.qual.data(), piece.seq.data(), piece.xm.data(), seq_lut)) {
+      chunk->error = bam_get_qname(bam_rec);                                    // unknown CIGAR operation, reported later
+      return;
+    }
+  }
+  
+  // push last template
+  if (templ_strand!=0) push_chunk_template;
+}
+
+
+// template waiting for its mate when reading coordinate-sorted BAM
+struct T_pending {
+  std::string qname;                                                            // template QNAME
+  int rname, start, strand, width;                                              // template RNAME, POS, STRAND, ISIZE
+  int first_pos;                                                                // POS of its first record
+  uint16_t mates;                                                               // BAM_FREAD1|BAM_FREAD2 of records seen so far
+  bool done;                                                                    // TRUE if both mates were merged
+  bool sampled;                                                                 // FALSE if dropped by depth capping, not assembled then
+  uint64_t key;                                                                 // key for depth capping
+  T_holder holder;                                                              // template QUAL, SEQ, XM arrays
+};
+
+// templates in the order of their first record (i.e., in coordinate order),
+// stored in a ring of reusable buffers and indexed by QNAME. Since templates
+// are released from the front only, output order is preserved
+struct T_pending_buffer {
+  std::vector<T_pending> ring;                                                  // power-of-two ring of templates
+  uint64_t head = 0, count = 0;                                                 // serial number of the front template, number of templates
+  std::unordered_map<std::string, uint64_t> index;                              // QNAME -> serial number of incomplete template
+  
+  T_pending_buffer() : ring(1024) {}
+  inline T_pending& at(uint64_t serial) { return ring[serial & (ring.size()-1)]; }
+  inline T_pending& front() { return at(head); }
+  
+  T_pending& add(const char *qname) {                                           // new template at the back
+    if (count == ring.size()) {                                                 // grow the ring if it's full
+      std::vector<T_pending> grown (ring.size() << 1);
+      for (uint64_t s=head; s<head+count; s++)
+        std::swap(grown[s & (grown.size()-1)], at(s));
+      ring.swap(grown);
+    }
+    const uint64_t serial = head + count++;
+    T_pending &p = at(serial);
+    p.mates = 0;
+    p.done = (qname==NULL);                                                     // unpaired record: complete, neither indexed nor named
+    if (!p.done) {
+      index.emplace(qname, serial);
+      p.qname.assign(qname);
+    }
+    return p;
+  }
+  
+  inline T_pending* find(const char *qname) {                                   // incomplete template with this QNAME, if any
+    std::unordered_map<std::string, uint64_t>::iterator it = index.find(qname);
+    return it==index.end() ? NULL : &at(it->second);
+  }
+  
+  inline void pop() {                                                           // release the front template
+    T_pending &p = front();
+    if (!p.done) index.erase(p.qname);
+    head++; count--;
+  }
+};
+
+// HTSlib thread pool, shared by all files read by the same reader
+struct T_thread_pool {
+  htsThreadPool tp = {NULL, 0};                                                 // thread pool cuts time by 30%
+  T_thread_pool(int nthreads) {
+    if (nthreads>0) tp.pool = hts_tpool_init(nthreads);                         // when initiated for >0 threads
+  }
+  T_thread_pool(const T_thread_pool&) = delete;
+  ~T_thread_pool() { if (tp.pool) hts_tpool_destroy(tp.pool); }
+};
+
+// BAM file, header, index and iterator, released when going out of scope,
+// i.e. also on error or interrupt
+struct T_bam_file {
+  htsFile *fp = NULL;
+  bam_hdr_t *hdr = NULL;
+  hts_idx_t *idx = NULL;
+  hts_itr_t *itr = NULL;
+  ~T_bam_file() {
+    if (itr) hts_itr_destroy(itr);
+    if (idx) hts_idx_destroy(idx);
+    if (hdr) bam_hdr_destroy(hdr);
+    if (fp) hts_close(fp);
+  }
+};
+
+// BAM records, released when going out of scope
+struct T_records : std::vector<bam1_t*> {
+  ~T_records() { for (size_t r=0; r<size(); r++) bam_destroy1((*this)[r]); }
+};
+
+// worker threads, joined when going out of scope, i.e. also on error or
+// interrupt
+struct T_workers : std::vector<std::thread> {
+  ~T_workers() { for (size_t w=0; w<size(); w++) if ((*this)[w].joinable()) (*this)[w].join(); }
+};
+
+// results of reading BAM file. Filled without R API, therefore reading can
+// run in a background thread
+struct T_bam_data {
+  std::vector<int> rname, strand, start;                                        // id for RNAME, id for CT==1/GA==2, POS
+  std::unique_ptr<T_templates> templs {new T_templates};                        // SEQ+XM of all templates
+  std::vector<std::string> chromosomes;                                         // vector of reference names
+  bool in_order = false;                                                        // TRUE if templates are in coordinate order
+  uint64_t nrecs = 0, ntempls = 0;                                              // counters: BAM records, templates (read pairs)
+  uint64_t nunpaired = 0;                                                       // templates of unpaired records, if kept
+  T_read_stats stats;                                                           // skipped records, bytes, max width
+  T_timer timer;                                                                // stages: open, decode, assembly, output
+  std::string error;                                                            // error message, empty if none
+  std::exception_ptr exception;                                                 // thrown by the background thread, rethrown by the main one
+  T_template_sink *sink = NULL;                                                 // consumer of windows of templates, if streaming
+};
+
+// reads and preprocesses BAM file. Errors are returned within the results.
+// R API is used only by the main thread, to check for the interrupt
+static void read_bam (const std::string &fn,                                    // file name
+                      const int min_mapq,                                       // min read mapping quality
+                      const int min_baseq,                                      // min base quality
+                      const bool skip_duplicates,                               // skip marked duplicates
+                      const int nthreads,                                       // assembly threads, >1 for multiple
+                      const bool packed,                                        // store templates in compact form, 4+4 bits per base
+                      const bool sparse,                                        // store covered segments of templates only
+                      const bool keep_unpaired,                                 // records that are not a proper pair are templates of their own
+                      std::vector<std::string> regions,                         // read only these regions of indexed BAM, all if empty
+                      const double max_memory,                                  // approximate limit for templates in memory, bytes, 0 if none
+                      const std::string spill_prefix,                           // temporary files to spill templates to
+                      const double max_depth,                                   // max templates per bin of their starts, 0 if no capping
+                      const int depth_bin,                                      // size of bins, bases
+                      const double seed,                                        // seed of the depth capping sample
+                      htsThreadPool *thread_pool,                               // HTSlib thread pool, or NULL
+                      const bool main_thread,                                   // TRUE if called from the main R thread
+                      T_bam_data *data)                                         // results
+{
+  // constants
+  const size_t batch_size = 0x3FFFF;                                            // records per batch for assembly threads
+  const int nworkers = nthreads>1 ? nthreads : 1;                               // assembly threads, QNAME-sorted BAM only
+  T_timer &timer = data->timer;                                                 // stages: open, decode, assembly, output
+  T_read_stats &stats = data->stats;                                            // skipped records, bytes, max width
+  #define fail(msg) { data->error = (msg); return; }                            /* stop with the error */
+  #define check_interrupt if (main_thread) Rcpp::checkUserInterrupt()           /* only the main thread calls R */
+  
+  // file IO
+  T_bam_file bam;
+  bam.fp = hts_open(fn.c_str(), "r");                                           // try open file
+  if (bam.fp==NULL) fail("Unable to open BAM file for reading");                // fall back if error
+  htsFile *bam_fp = bam.fp;
+  if (thread_pool && thread_pool->pool)
+    hts_set_opt(bam_fp, HTS_OPT_THREAD_POOL, thread_pool);                      // thread pool bound to the file pointer
+  bam.hdr = sam_hdr_read(bam_fp);                                               // try read file header
+  if (bam.hdr==NULL) fail("Unable to read BAM header");                         // fall back if error  
+  bam_hdr_t *bam_hdr = bam.hdr;
+  data->chromosomes.assign(bam_hdr->target_name,
+                           bam_hdr->target_name + bam_hdr->n_targets);
+  if (data->sink) data->sink->chromosomes = data->chromosomes;
+  
+  // sorting order
+  kstring_t hd_so = {0, 0, NULL};                                               // SO tag of the @HD header line
+  const bool coord_sorted = !regions.empty() ||                                 // pair mates in memory if sorted by genomic location
+    ((sam_hdr_find_tag_hd(bam_hdr, "SO", &hd_so) == 0) &&                       // (which is always the case when reading through index)
+     (strcmp(hd_so.s, "coordinate") == 0));
+  free(hd_so.s);
+  
+  // regions
+  if (!regions.empty()) {
+    bam.idx = sam_index_load(bam_fp, fn.c_str());                               // try load BAI/CSI index
+    if (bam.idx==NULL) fail("Unable to load BAM index");
+    std::vector<char*> regarray;                                                // regions as 'chr:beg-end' strings
+    for (size_t i=0; i<regions.size(); i++) regarray.push_back(&regions[i][0]);
+    bam.itr = sam_itr_regarray(bam.idx, bam_hdr, regarray.data(), regarray.size());
+    if (bam.itr==NULL) fail("Unable to create iterator for given regions");
+  }
+  hts_itr_t *bam_itr = bam.itr;                                                 // multi-region iterator
+  #define read_next(rec)              /* next record of the file or regions */ \
+    ((bam_itr ? sam_itr_next(bam_fp, bam_itr, rec) :                           \
+                sam_read1(bam_fp, bam_hdr, rec)) > 0)
+  #define rec_bytes(rec) ((rec)->l_data + 36)   /* block_size, core and data */
+  timer.lap("open");
+  
+  // main containers
+  T_templates* templs = data->templs.get();                                     // SEQ+XM of all templates
+  templs->packed = packed;
+  templs->sparse = sparse;
+  std::vector<int> &rname = data->rname, &strand = data->strand,                // id for RNAME, id for CT==1/GA==2, POS
+                   &start = data->start;
+  uint64_t &nrecs = data->nrecs, &ntempls = data->ntempls;                      // counters: BAM records, templates (read pairs), 64-bit for deep WGBS
+  uint64_t &nunpaired = data->nunpaired;                                        // templates of unpaired records, if kept
+  
+  // reserve some memory, a small part of the budget if any
+  const size_t nreserved = max_memory > 0 ?
+    (size_t)std::min(max_memory / 0x400, (double)0xFFFFF) : 0xFFFFF;
+  rname.reserve(nreserved); strand.reserve(nreserved); start.reserve(nreserved);
+  templs->offset.reserve(nreserved); templs->width.reserve(nreserved);
+  templs->counts.reserve(nreserved);
+  templs->arena.reserve(nreserved << 4);
+  
+  // templates are spilled to disk as sorted runs when they take half of the
+  // budget, leaving room for the growth of buffers. Not needed if streaming
+  std::unique_ptr<T_spill> spill;
+  if ((max_memory > 0) && !data->sink)
+    spill.reset(new T_spill(spill_prefix, main_thread));
+  
+  // depth capping keeps the sample in memory, bounding it in the first place
+  std::unique_ptr<T_depth_cap> cap;
+  if ((max_depth > 0) && !data->sink) {
+    if (spill) fail("Depth capping can't be combined with the memory limit");
+    cap.reset(new T_depth_cap(max_depth, std::max(depth_bin, 1), (uint64_t)seed));
+  }
+  
+  // template holders
+  const uint8_t seq_blank = packed ? 15 : 'N';                                  // nt16 code or char for unknown base
+  const char nt16_codes[] = {0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15};           // nt16 codes are kept as they are if packed
+  const char *seq_lut = packed ? nt16_codes : seq_nt16_str;                     // nt16 code -> SEQ char otherwise
+  
+  // TRUE if no templates OR fraction of two-read templates is <67%, unpaired
+  // ones aside (one record each). 64-bit, and the product can't overflow
+  #define unsorted (ntempls==0) || ((ntempls>nunpaired) &&                     \
+    ((uint64_t)(nrecs-nunpaired) < (uint64_t)3*((ntempls-nunpaired)>>1)))
+  #define push_pending {                /* pushing front template of buffer */ \
+    T_pending &p = pending.front();                                            \
+    if (!p.sampled) cap->dropped++;                          /* not sampled */ \
+    else if (!cap || cap->add(p.rname + 1, p.start + 1, p.key, rname.size())) {\
+      rname.push_back(p.rname + 1);                              /* RNAME+1 */ \
+      strand.push_back(p.strand);                                 /* STRAND */ \
+      start.push_back(p.start + 1);                                /* POS+1 */ \
+      p.holder.push(templs, p.width);                             /* SEQ+XM */ \
+    }                                                                          \
+    if ((p.rname < last_templ_rname) || ((p.rname == last_templ_rname) &&      \
+        (p.start < last_templ_start))) in_order = false;          /* sorted */ \
+    last_templ_rname = p.rname; last_templ_start = p.start;                    \
+    safe_pos = p.first_pos + 1;                        /* for the streaming */ \
+    ntempls++;                                                        /* +1 */ \
+    pending.pop();                                                             \
+  }
+  
+  T_pending_buffer pending;                                                     // templates waiting for their mates, coordinate-sorted BAM only
+  int last_rname = -1, last_pos = -1;                                           // position of the last record, coordinate-sorted BAM only
+  bool &in_order = data->in_order;                                              // TRUE if templates are pushed in coordinate order
+  in_order = coord_sorted;
+  int last_templ_rname = -1, last_templ_start = -1;                             // last template pushed, coordinate-sorted BAM only
+  int safe_pos = 0;                                                             // POS+1 of the first record of the last template pushed
+  
+  // windows of templates go to the sink of streaming kernel and are released
+  if (data->sink && !coord_sorted)
+    fail("Streaming requires BAM file sorted by genomic location");
+  #define consume_window {         /* passing templates to the sink, if any */ \
+    if (data->sink && !rname.empty()) {                                        \
+      templs->sync();                                                          \
+      data->sink->consume(rname, strand, start, *templs, safe_pos);            \
+      rname.clear(); strand.clear(); start.clear();                            \
+      templs->clear();                                                         \
+    }                                                                          \
+  }
+  #define store_bytes (                        /* current size of templates */ \
+    (double)templs->arena.size() + (double)rname.size() *                      \
+    (3*sizeof(int) + sizeof(uint64_t) + sizeof(uint32_t) + sizeof(T_counts)))
+  #define spill_templates {              /* sorted run goes to disk, if any */ \
+    if (spill && (store_bytes * 2 > max_memory)) {                             \
+      const std::string spill_error = spill->write_run(                        \
+        data->chromosomes, rname, strand, start, *templs);                     \
+      if (!spill_error.empty()) fail(spill_error);                             \
+      rname.clear(); strand.clear(); start.clear();                            \
+      templs->clear();                                                         \
+      timer.lap("spill");                                                      \
+    }                                                                          \
+  }
+  
+  // process alignments
+  if (coord_sorted) {
+    // records are decoded in batches, so that both stages are timed without
+    // overhead per record
+    T_records recs;                                                             // batch of records, reused
+    bool eof = false;
+    while (!eof) {
+      size_t n = 0;
+      while (n < batch_size) {
+        if (n == recs.size()) recs.push_back(bam_init1());
+        if (!read_next(recs[n])) { eof = true; break; }
+        stats.bytes += rec_bytes(recs[n]);
+        n++;
+      }
+      timer.lap("decode");
       
-      // resize containers if necessary
-      if (templ_width > max_templ_width) {
-        max_templ_width = templ_width;                                          // expand template holders
-        templ_qual_rs = (uint8_t *) realloc(templ_qual_rs, max_templ_width);
-        templ_seq_rs  = (uint8_t *) realloc(templ_seq_rs,  max_templ_width);
-        templ_xm_rs   = (uint8_t *) realloc(templ_xm_rs,   max_templ_width);
-        if (templ_qual_rs==NULL || templ_seq_rs==NULL || templ_xm_rs==NULL)     // check memory allocation
-          Rcpp::stop("Unable to allocate memory for BAM record #%i", nrecs);
+      for (size_t r=0; r<n; r++) {                                              // rec by rec
+        const bam1_t *bam_rec = recs[r];
+        nrecs++;                                                                // BAM alignment records ++
+        const char *rec_strand, *rec_xm;
+        const int skip = filter_record(bam_rec, min_mapq, skip_duplicates, keep_unpaired, &rec_strand, &rec_xm);
+        if (skip != SKIP_NONE) {
+          stats.skipped[skip]++;
+          continue;
+        }
+        
+        // check the order and release templates that were passed by
+        const int rec_rname = bam_rec->core.tid, rec_pos = bam_rec->core.pos;
+        if ((rec_rname < last_rname) || ((rec_rname == last_rname) && (rec_pos < last_pos)))
+          fail("BAM header says it is sorted by genomic location, but BAM record #" + std::to_string(nrecs) + " is out of order");
+        last_rname = rec_rname; last_pos = rec_pos;
+        while ((pending.count > 0) &&                                           // front template is complete or its end is behind,
+               (pending.front().done || (pending.front().rname != rec_rname) || // therefore can't have any more records
+                (pending.front().start + pending.front().width <= rec_pos)))
+          push_pending;
+        
+        // find or initialize template. Unpaired record is a template of its
+        // own, which is complete and is never looked up
+        const bool single = !(bam_rec->core.flag & BAM_FPROPER_PAIR);           // unpaired record, kept
+        T_pending *p = single ? NULL : pending.find(bam_get_qname(bam_rec));
+        if (p==NULL) {
+          p = &pending.add(single ? NULL : bam_get_qname(bam_rec));
+          p->rname = rec_rname;                                                 // same values as for QNAME-sorted BAM
+          p->start = single || (rec_pos < bam_rec->core.mpos) ? rec_pos : bam_rec->core.mpos;
+          p->width = single ? unpaired_width(bam_rec) : abs(bam_rec->core.isize);
+          if (p->width > stats.max_width) stats.max_width = p->width;
+          p->strand = ( rec_strand[1] == 'C' ) ? 1 : 2 ;
+          p->first_pos = rec_pos;
+          p->key = cap ? cap->key(bam_get_qname(bam_rec)) : 0;
+          p->sampled = !cap || cap->admits(p->rname + 1, p->start + 1, p->key);  // not assembled if it can't get into the sample
+          p->holder.sparse = sparse;                                            // clean template holder, capacity is reused
+          p->holder.qual_blank = min_baseq;
+          p->holder.seq_blank = seq_blank;
+          if (p->sampled) p->holder.reset(p->width);
+        }
+        
+        // add another read to the template
+        if (p->sampled) {
+          T_holder::T_piece &piece = p->holder.place(bam_rec, p->start);
+          if (!apply_cigar(bam_rec, rec_xm, p->start + piece.start, piece.qual.size(),
+                           piece.qual.data(), piece.seq.data(), piece.xm.data(), seq_lut))
+            fail(std::string("Unknown CIGAR operation for BAM entry ") +        // unknown CIGAR operation
+                 bam_get_qname(bam_rec));
+        }
+        if (single) {
+          nunpaired++;
+          continue;
+        }
+        p->mates |= bam_rec->core.flag & (BAM_FREAD1 | BAM_FREAD2);
+        if (p->mates == (BAM_FREAD1 | BAM_FREAD2)) {                            // both mates are here - no need to keep it in the index
+          p->done = true;
+          pending.index.erase(p->qname);
+        }
       }
-      std::memset(templ_qual_rs, (uint8_t) min_baseq, templ_width);             // clean template holders
-      std::memset(templ_seq_rs, 'N', templ_width);
-      std::memset(templ_xm_rs,  '-', templ_width);
-      // std::fill_n(templ_qual_rs, templ_width, (uint8_t) min_baseq);             // clean template holders
-      // std::fill_n(templ_seq_rs,  templ_width, 'N');
-      // std::fill_n(templ_xm_rs,   templ_width, '-');
-     }
+      timer.lap("assembly");
+      consume_window;
+      timer.lap("streaming");
+      spill_templates;
+      check_interrupt;                                                          // checking for the interrupt
+    }
     
-    // add another read to the template
-    // source containers
-    uint8_t *rec_qual = bam_get_qual(bam_rec);                                  // quality string (Phred scale with no +33 offset)
-    // char *rec_xm = (char*) bam_aux_get(bam_rec, "XM");                          // methylation string
-    // if (rec_xm==NULL)                                                           // fall back if absent 
-    //   Rcpp::stop("Methylation string is missing for BAM record #%i", nrecs); 
-    rec_xm++;                                                                   // remove leading 'Z' from XM string
-    uint8_t *rec_pseq = bam_get_seq(bam_rec);                                   // packed sequence string (4 bit per base)
+    // release all remaining templates
+    while (pending.count > 0) push_pending;
+    timer.lap("assembly");
+    consume_window;
+    timer.lap("streaming");
     
-    // apply CIGAR
-    uint32_t n_cigar = bam_rec->core.n_cigar;                                   // number of CIGAR operations
-    uint32_t *rec_cigar = bam_get_cigar(bam_rec);                               // CIGAR array
-    uint32_t query_pos = 0;                                                     // starting position in query array
-    uint32_t dest_pos = bam_rec->core.pos - templ_start;                        // starting position in destination array
-    for (size_t i=0; i<n_cigar; i++) {                                          // op by op
-      uint32_t cigar_op = bam_cigar_op(rec_cigar[i]);                           // CIGAR operation
-      uint32_t cigar_oplen = bam_cigar_oplen(rec_cigar[i]);                     // CIGAR operation length
-      switch(cigar_op) {
-        case BAM_CMATCH :                                                       // 'M', 0
-        case BAM_CEQUAL :                                                       // '=', 7
-        case BAM_CDIFF :                                                        // 'X', 8
-          for (size_t j=0; j<cigar_oplen; j++) {
-            if (rec_qual[query_pos+j] > templ_qual_rs[dest_pos+j]) {
-              templ_qual_rs[dest_pos+j] = rec_qual[query_pos+j];
-              templ_seq_rs[dest_pos+j] = seq_nt16_str[bam_seqi(rec_pseq,query_pos+j)];
-              templ_xm_rs[dest_pos+j] = rec_xm[query_pos+j];
+    // stop if single-end, regions may have no reads at all
+    if ((bam_itr==NULL || ntempls>1) && (unsorted))
+      fail("BAM seems to be predominantly single-end. Please use 'keep.unpaired' option of preprocessBam to load single-end alignments");
+  } else {
+    // batches of records are read while the previous batch is being assembled
+    // by worker threads. Batches and chunks for workers end at QNAME boundary.
+    // With worker threads, "assembly" is the time of waiting for them
+    T_records batch[2];                                                         // current and next batch
+    size_t batch_n[2] = {0, 0};                                                 // records in batches
+    T_records carried;
+    carried.push_back(bam_init1());
+    bam1_t *&carry = carried[0];                                                // first record of the next batch
+    bool has_carry = false, eof = false;
+    std::vector<T_chunk> chunks (nworkers);                                     // per-thread results
+    for (int w=0; w<nworkers; w++) {
+      chunks[w].templs.packed = packed;
+      chunks[w].templs.sparse = sparse;
+      chunks[w].holder.sparse = sparse;
+      chunks[w].holder.qual_blank = min_baseq;
+      chunks[w].holder.seq_blank = seq_blank;
+      chunks[w].cap = cap.get();
+    }
+    
+    #define same_qname(a,b) (strcmp(bam_get_qname(a), bam_get_qname(b)) == 0)
+    #define read_batch(b) {              /* reading batch till QNAME change */ \
+      std::vector<bam1_t*> &recs = batch[b];                                   \
+      size_t n = 0;                                                            \
+      if (has_carry) {                                  /* carried record */   \
+        if (recs.empty()) recs.push_back(bam_init1());                         \
+        std::swap(recs[0], carry);                                             \
+        has_carry = false; n++;                                                \
+      }                                                                        \
+      while (!eof) {                                                           \
+        if (n == recs.size()) recs.push_back(bam_init1());                     \
+        if (sam_read1(bam_fp, bam_hdr, recs[n]) <= 0) { eof = true; break; }   \
+        nrecs++;                                                               \
+        stats.bytes += rec_bytes(recs[n]);                                     \
+        if ((n >= batch_size) && !same_qname(recs[n], recs[n-1])) {            \
+          std::swap(recs[n], carry);              /* goes to the next batch */ \
+          has_carry = true;                                                    \
+          break;                                                               \
+        }                                                                      \
+        n++;                                                                   \
+      }                                                                        \
+      batch_n[b] = n;                                                          \
+    }
+    
+    read_batch(0);
+    timer.lap("decode");
+    while (batch_n[0] > 0) {
+      // split current batch between workers
+      bam1_t **recs = batch[0].data();
+      const size_t n = batch_n[0];
+      std::vector<size_t> bounds (nworkers+1, n);
+      bounds[0] = 0;
+      for (int w=1; w<nworkers; w++) {
+        size_t b = std::max(bounds[w-1], n*w/nworkers);
+        while ((b > 0) && (b < n) && same_qname(recs[b], recs[b-1])) b++;
+        bounds[w] = b;
+      }
+      for (int w=0; w<nworkers; w++) {
+        T_chunk &c = chunks[w];
+        c.rname.clear(); c.strand.clear(); c.start.clear(); c.error.clear();
+        c.templs.clear(); c.key.clear();
+        c.nunpaired = 0;
+        c.exception = nullptr;
+      }
+      
+      // assemble templates, reading next batch meanwhile
+      if (nworkers > 1) {
+        T_workers workers;
+        for (int w=0; w<nworkers; w++)
+          workers.emplace_back([&, w] {
+            try {
+              assemble_templates(recs + bounds[w], bounds[w+1] - bounds[w],
+                                 min_mapq, skip_duplicates, keep_unpaired,
+                                 seq_lut, &chunks[w]);
+            } catch (...) {                                                     // thrown again by the reading thread
+              chunks[w].exception = std::current_exception();
             }
+          });
+        timer.lap("assembly");
+        read_batch(1);
+        timer.lap("decode");
+        for (int w=0; w<nworkers; w++) workers[w].join();
+      } else {
+        assemble_templates(recs, n, min_mapq, skip_duplicates, keep_unpaired,
+                           seq_lut, &chunks[0]);
+        timer.lap("assembly");
+        read_batch(1);
+        timer.lap("decode");
+      }
+      
+      // concatenate results in the input order
+      for (int w=0; w<nworkers; w++) {
+        T_chunk &c = chunks[w];
+        if (c.exception) std::rethrow_exception(c.exception);
+        if (!c.error.empty())
+          fail("Unknown CIGAR operation for BAM entry " + c.error);
+        if (cap) {                                                              // sampled templates only
+          c.templs.sync();
+          for (size_t i=0; i<c.rname.size(); i++) {
+            if (!cap->add(c.rname[i], c.start[i], c.key[i], rname.size())) continue;
+            rname.push_back(c.rname[i]);
+            strand.push_back(c.strand[i]);
+            start.push_back(c.start[i]);
+            templs->push_copy(c.templs, i);
           }
-          query_pos += cigar_oplen;
-          dest_pos += cigar_oplen;
-          break;
-        case BAM_CINS :                                                         // 'I', 1
-        case BAM_CSOFT_CLIP :                                                   // 'S', 4
-          query_pos += cigar_oplen;
-          break;
-        case BAM_CDEL :                                                         // 'D', 2
-        case BAM_CREF_SKIP :                                                    // 'N', 3
-          dest_pos += cigar_oplen;
-          break;
-        case BAM_CHARD_CLIP :                                                   // 'H', 5
-        case BAM_CPAD :                                                         // 'P', 6
-        case BAM_CBACK :
-          break;
-        default :
-          Rcpp::stop("Unknown CIGAR operation for BAM entry %s",                // unknown CIGAR operation
-                     bam_get_qname(bam_rec));
+        } else {
+          rname.insert(rname.end(), c.rname.begin(), c.rname.end());
+          strand.insert(strand.end(), c.strand.begin(), c.strand.end());
+          start.insert(start.end(), c.start.begin(), c.start.end());
+          templs->append(c.templs);
+        }
+        ntempls += c.rname.size();
+        nunpaired += c.nunpaired;
       }
+      timer.lap("assembly");
+      spill_templates;
+      
+      check_interrupt;                                                          // checking for the interrupt
+      if ((nrecs > 0xFFFFF) && (unsorted)) break;                               // break out if seemingly unsorted
+      std::swap(batch[0], batch[1]);
+      std::swap(batch_n[0], batch_n[1]);
     }
+    
+    for (int w=0; w<nworkers; w++) stats.add(chunks[w].stats);
+    
+    // stop if single-end or seemingly unsorted
+    if (unsorted)
+      fail("BAM seems to be predominantly single-end or not sorted. Please use 'keep.unpaired' option of preprocessBam to load single-end alignments. If paired-end, please sort using 'samtools sort -n -o out.bam in.bam' or 'samtools sort -o out.bam in.bam'");
   }
   
-  // stop if single-end or seemingly unsorted
-  if (unsorted)
-    Rcpp::stop("BAM seems to be predominantly single-end or not sorted by QNAME. Single-end alignments are not supported yet. If paired-end, please sort using 'samtools sort -n -o out.bam in.bam'");
+  // remove templates evicted from the depth-capped sample
+  if (cap && !cap->evicted.empty()) {
+    std::vector<uint8_t> keep (rname.size(), 1);
+    for (size_t i=0; i<cap->evicted.size(); i++) keep[cap->evicted[i]] = 0;
+    std::vector<int> order;
+    order.reserve(rname.size() - cap->evicted.size());
+    for (size_t x=0; x<rname.size(); x++) {
+      if (!keep[x]) continue;
+      rname[order.size()] = rname[x];
+      strand[order.size()] = strand[x];
+      start[order.size()] = start[x];
+      order.push_back(x);
+    }
+    rname.resize(order.size()); strand.resize(order.size()); start.resize(order.size());
+    templs->sync();
+    templs->relayout(order.data(), order.size());
+    timer.lap("capping");
+  }
+  if (cap) stats.capped = cap->dropped;
+  
+  // merge spilled runs, if any. Merged templates are in coordinate order
+  if (spill && !spill->files.empty()) {
+    const std::string spill_error = spill->merge(data->chromosomes, rname,
+                                                 strand, start, data->templs);
+    if (!spill_error.empty()) fail(spill_error);
+    in_order = true;
+    timer.lap("merge");
+  }
   
-  // push last, yet unsaved template
-  push_template;
+  // otherwise sort the rows and lay the templates out in the same order,
+  // thus templid is the row number and kernels read templates sequentially
+  if (!in_order && !data->sink) {
+    const std::vector<int> order = coordinate_order(rname, start);
+    std::vector<int> buf (order.size());
+    for (std::vector<int> *col : {&rname, &strand, &start}) {
+      for (size_t i=0; i<order.size(); i++) buf[i] = (*col)[order[i]];
+      col->swap(buf);
+    }
+    templs->sync();
+    templs->relayout(order.data(), order.size());
+    in_order = true;
+    timer.lap("sort");
+  }
   
-  // cleaning
-  bam_destroy1(bam_rec);                                                        // clean BAM alignment structure 
-  hts_close(bam_fp);                                                            // close BAM file
-  if (thread_pool.pool) hts_tpool_destroy(thread_pool.pool);                    // free thread pool
-  free(templ_qname);                                                            // and free manually allocated memory
-  free(templ_qual_rs);
-  free(templ_seq_rs);
-  free(templ_xm_rs);
+  #undef fail
+  #undef check_interrupt
+  #undef consume_window
+  #undef store_bytes
+  #undef spill_templates
+}
+
+
+// reads BAM file, reporting the lack of memory as an error instead of throwing
+// std::bad_alloc. Other exceptions of the background thread, which would
+// terminate the process, are kept to be rethrown by the main thread, while
+// those of the main thread (e.g., interrupts) are passed through
+static void try_read_bam (const std::string &fn, const int min_mapq,
+                          const int min_baseq, const bool skip_duplicates,
+                          const int nthreads, const bool packed,
+                          const bool sparse, const bool keep_unpaired,
+                          std::vector<std::string> regions,
+                          const double max_memory,
+                          const std::string spill_prefix,
+                          const double max_depth, const int depth_bin,
+                          const double seed,
+                          htsThreadPool *thread_pool, const bool main_thread,
+                          T_bam_data *data)
+{
+  try {
+    read_bam(fn, min_mapq, min_baseq, skip_duplicates, nthreads, packed, sparse,
+             keep_unpaired, regions, max_memory, spill_prefix, max_depth, depth_bin, seed,
+             thread_pool, main_thread, data);
+  } catch (const std::bad_alloc&) {
+    data->error = "Not enough memory to load BAM file. Consider limiting it using 'max.memory' option of preprocessBam";
+  } catch (...) {
+    if (main_thread) throw;
+    data->exception = std::current_exception();
+  }
+}
+
+
+// reader stats as a named vector, with timing attribute
+static Rcpp::NumericVector wrap_stats (T_bam_data &data)
+{
+  const T_read_stats &stats = data.stats;
+  Rcpp::NumericVector res = Rcpp::NumericVector::create(
+    Rcpp::Named("records") = (double)data.nrecs,                                // BAM records read
+    Rcpp::Named("templates") = (double)data.ntempls,                            // templates (read pairs)
+    Rcpp::Named("unpaired") = (double)data.nunpaired,                           // templates of unpaired records, if kept
+    Rcpp::Named("skipped.mapq") = (double)stats.skipped[SKIP_MAPQ],             // records skipped: mapping quality < min.mapq
+    Rcpp::Named("skipped.not.proper.pair") = (double)stats.skipped[SKIP_NOT_PROPER_PAIR],// not a proper pair
+    Rcpp::Named("skipped.duplicate") = (double)stats.skipped[SKIP_DUPLICATE],   // duplicates, if skip.duplicates
+    Rcpp::Named("skipped.no.tags") = (double)stats.skipped[SKIP_NO_TAGS],       // no XM/XG tags
+    Rcpp::Named("capped.depth") = (double)stats.capped,                         // templates dropped by depth capping
+    Rcpp::Named("bytes") = (double)stats.bytes,                                 // bytes of decompressed alignment records
+    Rcpp::Named("max.width") = (double)stats.max_width                          // max template width
+  );
+  data.timer.lap("output");
+  res.attr("timing") = data.timer.wrap();                                       // wall and CPU time of the stages
+  return res;
+}
+
+
+// wraps the results of reading into data frame, taking ownership of templates
+static Rcpp::DataFrame wrap_bam_data (T_bam_data &data)
+{
+  if (data.exception) std::rethrow_exception(data.exception);                   // reading failed in the background thread
+  if (!data.error.empty()) Rcpp::stop(data.error);                              // reading failed
   
   // wrap and return the results
   Rcpp::DataFrame res = Rcpp::DataFrame::create(                                // final DF
-    Rcpp::Named("rname") = rname,                                               // numeric ids (factor) for reference names
-    Rcpp::Named("strand") = strand,                                             // numeric ids (factor) for reference strands
-    Rcpp::Named("start") = start                                                // start positions of reads
+    Rcpp::Named("rname") = data.rname,                                          // numeric ids (factor) for reference names
+    Rcpp::Named("strand") = data.strand,                                        // numeric ids (factor) for reference strands
+    Rcpp::Named("start") = data.start                                           // start positions of reads
   );
   
   // factor levels
-  std::vector<std::string> chromosomes (                                        // vector of reference names
-      bam_hdr->target_name, bam_hdr->target_name + bam_hdr->n_targets);
   std::vector<std::string> strands = {"+", "-"};
   
   Rcpp::IntegerVector col_rname = res["rname"];                                 // make rname a factor
   col_rname.attr("class") = "factor";
-  col_rname.attr("levels") = chromosomes;
+  col_rname.attr("levels") = data.chromosomes;
   
   Rcpp::IntegerVector col_strand = res["strand"];                               // make strand a factor
   col_strand.attr("class") = "factor";
   col_strand.attr("levels") = strands;
   
-  Rcpp::XPtr<std::vector<std::string>> seq_xptr(seq, true);
-  res.attr("seq_xptr") = seq_xptr;                                              // external pointer to sequences
-  Rcpp::XPtr<std::vector<std::string>> xm_xptr(xm, true);
-  res.attr("xm_xptr") = xm_xptr;                                                // external pointer to methylation strings
+  if (data.templs->map_addr==NULL) data.templs->sync();                         // ready for kernels, unless merged from spilled runs
+  Rcpp::XPtr<T_templates> templ_xptr(data.templs.release(), true);
+  res.attr("templ_xptr") = templ_xptr;                                          // external pointer to sequences and methylation strings
+  res.attr("templ_sorted") = data.in_order;                                     // TRUE if already sorted by rname and start
+  
+  // counters and timing
+  Rcpp::NumericVector stats = wrap_stats(data);
+  res.attr("timing") = stats.attr("timing");                                    // wall and CPU time of the stages
+  stats.attr("timing") = R_NilValue;
+  res.attr("stats") = stats;                                                    // reader counters
   
   return(res);
 }
 
 
+// [[Rcpp::export]]
+Rcpp::DataFrame rcpp_read_bam_paired (std::string fn,                           // file name
+                                      int min_mapq,                             // min read mapping quality
+                                      int min_baseq,                            // min base quality
+                                      bool skip_duplicates,                     // skip marked duplicates
+                                      int nthreads,                             // HTSlib threads, >0 for multiple
+                                      bool packed,                              // store templates in compact form, 4+4 bits per base
+                                      bool sparse,                              // store covered segments of templates only
+                                      bool keep_unpaired,                       // records that are not a proper pair are templates of their own
+                                      std::vector<std::string> regions,         // read only these regions of indexed BAM, all if empty
+                                      double max_memory,                        // approximate limit for templates in memory, bytes, 0 if none
+                                      std::string spill_prefix,                 // temporary files to spill templates to
+                                      double max_depth,                         // max templates per bin of their starts, 0 if no capping
+                                      int depth_bin,                            // size of bins, bases
+                                      double seed)                              // seed of the depth capping sample
+{
+  T_thread_pool thread_pool (nthreads);
+  T_bam_data data;
+  try_read_bam(fn, min_mapq, min_baseq, skip_duplicates, nthreads, packed,
+               sparse, keep_unpaired, regions, max_memory, spill_prefix,
+               max_depth, depth_bin, seed, &thread_pool.tp, true, &data);
+  return wrap_bam_data(data);
+}
+
+
+// Streaming: templates are passed to the sink and released window by window,
+// used by the kernels that don't need all the templates at once
+Rcpp::NumericVector stream_bam (const std::string &fn,                          // file name
+                                int min_mapq,                                   // min read mapping quality
+                                int min_baseq,                                  // min base quality
+                                bool skip_duplicates,                           // skip marked duplicates
+                                int nthreads,                                   // HTSlib threads, >0 for multiple
+                                std::vector<std::string> regions,               // read only these regions of indexed BAM, all if empty
+                                T_template_sink *sink)                          // consumer of templates
+{
+  T_thread_pool thread_pool (nthreads);
+  T_bam_data data;
+  data.sink = sink;
+  try_read_bam(fn, min_mapq, min_baseq, skip_duplicates, nthreads, false,
+               false, false, regions, 0, "", 0, 1, 0, &thread_pool.tp, true,
+               &data);
+  if (!data.error.empty()) Rcpp::stop(data.error);                              // reading failed
+  return wrap_stats(data);
+}
+
+
+// Batch reading: the next BAM file is read in a background thread while R
+// processes the previous one. All files share the same HTSlib thread pool.
+// BAM data must be collected by rcpp_bam_prefetch_wait before the next file
+// is requested
+struct T_bam_prefetch {
+  T_thread_pool thread_pool;                                                    // shared HTSlib thread pool
+  int nthreads;                                                                 // assembly threads
+  std::thread reader;                                                           // background thread
+  std::unique_ptr<T_bam_data> data;                                             // its results
+  
+  T_bam_prefetch(int n) : thread_pool(n), nthreads(n) {}
+  ~T_bam_prefetch() { if (reader.joinable()) reader.join(); }
+};
+
+// [[Rcpp::export]]
+SEXP rcpp_bam_prefetch_init (int nthreads)                                      // HTSlib and assembly threads, >0 for multiple
+{
+  Rcpp::XPtr<T_bam_prefetch> prefetch_xptr(new T_bam_prefetch(nthreads), true);
+  return prefetch_xptr;
+}
+
+// [[Rcpp::export]]
+void rcpp_bam_prefetch_start (SEXP prefetch_xptr,                               // prefetching reader
+                              std::string fn,                                   // file name
+                              int min_mapq,                                     // min read mapping quality
+                              int min_baseq,                                    // min base quality
+                              bool skip_duplicates,                             // skip marked duplicates
+                              bool packed,                                      // store templates in compact form, 4+4 bits per base
+                              bool sparse,                                      // store covered segments of templates only
+                              bool keep_unpaired,                               // records that are not a proper pair are templates of their own
+                              std::vector<std::string> regions)                 // read only these regions of indexed BAM, all if empty
+{
+  T_bam_prefetch *prefetch = Rcpp::XPtr<T_bam_prefetch>(prefetch_xptr).get();
+  if (prefetch->reader.joinable())
+    Rcpp::stop("Previous BAM file was not collected");
+  prefetch->data.reset(new T_bam_data);
+  prefetch->reader = std::thread(try_read_bam, fn, min_mapq, min_baseq,
+                                 skip_duplicates, prefetch->nthreads, packed,
+                                 sparse, keep_unpaired, regions, 0, "", 0, 1, 0,
+                                 &prefetch->thread_pool.tp,
+                                 false, prefetch->data.get());
+}
+
+// [[Rcpp::export]]
+Rcpp::DataFrame rcpp_bam_prefetch_wait (SEXP prefetch_xptr)                     // prefetching reader
+{
+  T_bam_prefetch *prefetch = Rcpp::XPtr<T_bam_prefetch>(prefetch_xptr).get();
+  if (!prefetch->reader.joinable())
+    Rcpp::stop("No BAM file is being read");
+  prefetch->reader.join();
+  std::unique_ptr<T_bam_data> data (prefetch->data.release());
+  return wrap_bam_data(*data);
+}
+
+
 // #############################################################################
 // test code and sourcing don't work on OS X
 /*** R
@@ -0,0 +1,255 @@
+#include <Rcpp.h>
+#include <htslib/hts.h>
+#include <htslib/sam.h>
+#include <algorithm>
+#include <cstdio>
+#include "epialleleR.h"
+// using namespace Rcpp;
+
+// [[Rcpp::depends(Rhtslib)]]
+
+// Writes synthetic paired-end (or single-end) BAM with Bismark-style XM/XR/XG
+// tags. Reads of a directional library are simulated for a random reference
+// of a single chromosome with targets placed at regular intervals. Every template
+// is either fully methylated or fully unmethylated in CpG context (with the
+// given probability), while cytosines in other contexts are always
+// unmethylated. Output: number of templates and records written
+//
+// Values are drawn from a counter-based generator (splitmix64 of seed and
+// template index), therefore every template is simulated independently, and
+// the BAM file is the same for the same seed regardless of the sort order.
+
+
+// splitmix64 by Sebastiano Vigna, public domain
+static inline uint64_t splitmix64 (uint64_t x)
+{
+  x += 0x9E3779B97F4A7C15ULL;
+  x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+  return x ^ (x >> 31);
+}
+
+// stream of random values for the key
+struct T_sim_rng {
+  uint64_t state;
+  
+  T_sim_rng(uint64_t seed, uint64_t key) : state(splitmix64(seed ^ splitmix64(key))) {}
+  inline uint64_t next() { state = splitmix64(state); return state; }
+  inline uint32_t uniform(uint32_t n) { return ((next() >> 32) * n) >> 32; }    // [0, n)
+  inline double uniform01() { return (next() >> 11) * 0x1.0p-53; }              // [0, 1)
+};
+
+// parameters of simulation and the reference
+struct T_sim {
+  uint64_t seed;
+  int ntargets, target_width, target_spacing;
+  int depth, read_length, min_insert, max_insert;
+  double methylation;
+  bool amplicon, single_end;                                                    // single-end: read 1 of every template only
+  std::string ref;                                                              // reference sequence, 0-based
+  
+  inline int target_start(int k) const { return (k+1) * target_spacing; }       // 0-based
+};
+
+// single template
+struct T_sim_template {
+  int start, isize, rl;                                                         // 0-based start, insert size, read length
+  bool ot, meth;                                                                // original top strand, methylated
+};
+
+static inline T_sim_template sim_template (const T_sim &sim, const uint64_t j)
+{
+  T_sim_rng rng (sim.seed, j << 2);
+  T_sim_template t;
+  const int ts = sim.target_start(j / sim.depth);
+  if (sim.amplicon) {                                                           // exactly the amplicon
+    t.isize = sim.target_width;
+    t.start = ts;
+  } else {                                                                      // overlapping the target by at least one base
+    t.isize = sim.min_insert + rng.uniform(sim.max_insert - sim.min_insert + 1);
+    t.start = std::max(0, ts - t.isize + 1 + (int)rng.uniform(sim.target_width + t.isize - 1));
+  }
+  t.rl = std::min(sim.read_length, t.isize);
+  t.ot = rng.next() & 1;
+  t.meth = rng.uniform01() < sim.methylation;
+  return t;
+}
+
+// bisulfite-converted base and its methylation call at 0-based position
+static inline void sim_base (const std::string &ref, const size_t i,
+                             const bool ot, const bool meth, char *base,
+                             char *call)
+{
+  const char b = ref[i];
+  *base = b; *call = '.';
+  if (ot && (b=='C')) {                                                         // top strand, C followed by
+    if (ref[i+1]=='G') *call = meth ? 'Z' : 'z';                                // G
+    else if (ref[i+2]=='G') *call = 'x';                                        // HG
+    else *call = 'h';                                                           // HH
+    if (*call!='Z') *base = 'T';
+  } else if (!ot && (b=='G')) {                                                 // bottom strand, G preceded by
+    if (ref[i-1]=='C') *call = meth ? 'Z' : 'z';                                // C
+    else if (ref[i-2]=='C') *call = 'x';                                        // DC
+    else *call = 'h';                                                           // DD
+    if (*call!='Z') *base = 'A';
+  }
+}
+
+// fills BAM record for the left (mate=0) or right (mate=1) read of template j
+static inline int sim_record (const T_sim &sim, const uint64_t j,
+                              const int mate, bam1_t *bam_rec,
+                              std::string &seq, std::string &qual,
+                              std::string &xm)
+{
+  const T_sim_template t = sim_template(sim, j);
+  const int pos = mate==0 ? t.start : t.start + t.isize - t.rl;
+  const int mpos = mate==0 ? t.start + t.isize - t.rl : t.start;
+  const bool read1 = t.ot == (mate==0);                                         // OT: R1 is left, OB: R1 is right
+  const uint16_t flag = sim.single_end ? (mate==0 ? 0 : BAM_FREVERSE) :
+    BAM_FPAIRED | BAM_FPROPER_PAIR |
+    (mate==0 ? BAM_FMREVERSE : BAM_FREVERSE) | (read1 ? BAM_FREAD1 : BAM_FREAD2);
+  
+  T_sim_rng rng (sim.seed, (j << 2) | (mate+1));                                // base qualities of this mate
+  seq.resize(t.rl); qual.resize(t.rl); xm.resize(t.rl);
+  for (int i=0; i<t.rl; i++) {
+    sim_base(sim.ref, pos + i, t.ot, t.meth, &seq[i], &xm[i]);
+    qual[i] = 20 + rng.uniform(21);                                             // Phred 20..40
+  }
+  
+  char qname[32];
+  const int l_qname = snprintf(qname, sizeof(qname), "sim%llu", (unsigned long long)j);
+  const uint32_t cigar = (uint32_t)t.rl << 4 | BAM_CMATCH;
+  const char *xr = read1 ? "CT" : "GA";
+  const char *xg = t.ot ? "CT" : "GA";
+  if (bam_set1(bam_rec, l_qname, qname, flag, 0, pos, 60, 1, &cigar,
+               sim.single_end ? -1 : 0, sim.single_end ? -1 : mpos,
+               sim.single_end ? 0 : (mate==0 ? t.isize : -t.isize), t.rl,
+               seq.data(), qual.data(), t.rl + 16) < 0) return -1;
+  if (bam_aux_append(bam_rec, "XM", 'Z', t.rl + 1, (const uint8_t*) xm.c_str()) < 0) return -1;
+  if (bam_aux_append(bam_rec, "XR", 'Z', 3, (const uint8_t*) xr) < 0) return -1;
+  if (bam_aux_append(bam_rec, "XG", 'Z', 3, (const uint8_t*) xg) < 0) return -1;
+  return 0;
+}
+
+// output BAM file, header and record, released when going out of scope. The
+// file is removed unless closed successfully, i.e. also on error or interrupt
+struct T_sim_output {
+  std::string fn;
+  htsFile *fp = NULL;
+  sam_hdr_t *hdr = NULL;
+  bam1_t *bam_rec = NULL;
+  
+  T_sim_output(const std::string &fn) : fn(fn) {}
+  T_sim_output(const T_sim_output&) = delete;
+  ~T_sim_output() {
+    if (bam_rec) bam_destroy1(bam_rec);
+    if (hdr) sam_hdr_destroy(hdr);
+    if (fp) { hts_close(fp); std::remove(fn.c_str()); }
+  }
+  
+  bool close(bool ok) {                                                         // TRUE if everything was written
+    ok = (hts_close(fp) == 0) && ok;
+    fp = NULL;
+    if (!ok) std::remove(fn.c_str());
+    return ok;
+  }
+};
+
+
+// [[Rcpp::export("rcpp_simulate_bam")]]
+Rcpp::NumericVector rcpp_simulate_bam(std::string fn,                           // output file name
+                                      int ntargets,                             // number of targets
+                                      int target_width,                         // width of targets
+                                      int target_spacing,                       // distance between starts of targets
+                                      int depth,                                // templates per target
+                                      int read_length,                          // max length of reads
+                                      int min_insert,                           // insert size range, capture only
+                                      int max_insert,
+                                      double methylation,                       // fraction of methylated templates
+                                      bool amplicon,                            // reads match targets exactly
+                                      bool single_end,                          // read 1 of every template only
+                                      bool sorted,                              // coordinate-sorted and indexed, or grouped by QNAME
+                                      double seed,                              // seed of the generator
+                                      int nthreads)                             // HTSlib threads, >1 for multiple
+{
+  T_timer timer;
+  T_sim sim;
+  sim.seed = (uint64_t)seed;
+  sim.ntargets = ntargets; sim.target_width = target_width;
+  sim.target_spacing = target_spacing; sim.depth = depth;
+  sim.read_length = read_length; sim.min_insert = min_insert;
+  sim.max_insert = max_insert; sim.methylation = methylation;
+  sim.amplicon = amplicon; sim.single_end = single_end;
+  
+  // reference with a margin for templates overlapping the last target
+  const size_t ref_len = (size_t)(ntargets+1) * target_spacing +
+    target_width + max_insert;
+  sim.ref.resize(ref_len);
+  T_sim_rng ref_rng (sim.seed, ~(uint64_t)0);
+  for (size_t i=0; i<ref_len; i++) sim.ref[i] = "ACGT"[ref_rng.next() >> 62];
+  sim.ref[0] = sim.ref[1] = 'A';                                                // no context lookups beyond the edges
+  sim.ref[ref_len-1] = sim.ref[ref_len-2] = 'A';
+  timer.lap("reference");
+  
+  // records in the order of writing: (pos, template, mate). Single-end
+  // templates have read 1 only, which is the left mate for OT strand
+  const uint64_t ntempls = (uint64_t)ntargets * depth;
+  const uint64_t nrecs = single_end ? ntempls : ntempls*2;
+  std::vector<std::pair<int,uint64_t>> order;
+  if (sorted || single_end) {
+    order.reserve(nrecs);
+    for (uint64_t j=0; j<ntempls; j++) {
+      const T_sim_template t = sim_template(sim, j);
+      if (!single_end || t.ot) order.emplace_back(t.start, j << 1);
+      if (!single_end || !t.ot) order.emplace_back(t.start + t.isize - t.rl, (j << 1) | 1);
+    }
+    if (sorted) std::sort(order.begin(), order.end());
+    timer.lap("sort");
+  }
+  
+  T_sim_output out (fn);
+  out.fp = hts_open(fn.c_str(), "wb");
+  if (out.fp==NULL) Rcpp::stop("Unable to open BAM file for writing");
+  if (nthreads>1) hts_set_threads(out.fp, nthreads);
+  out.hdr = sam_hdr_init();
+  out.bam_rec = bam_init1();
+  std::string lines = std::string("@HD\tVN:1.6\tSO:") + (sorted ? "coordinate" : "unsorted") +
+    "\n@SQ\tSN:chrS\tLN:" + std::to_string(ref_len) +
+    "\n@PG\tID:epialleleR\tPN:epialleleR\tCL:simulateBam\n";
+  bool ok = (out.hdr!=NULL) && (out.bam_rec!=NULL) &&
+    (sam_hdr_add_lines(out.hdr, lines.c_str(), lines.size()) == 0) &&
+    (sam_hdr_write(out.fp, out.hdr) == 0);
+  
+  std::string seq, qual, xm;
+  for (uint64_t r=0; ok && (r<nrecs); r++) {
+    if ((r & 0xFFFFF) == 0) Rcpp::checkUserInterrupt();                         // file is removed then
+    const uint64_t key = order.empty() ? r : order[r].second;                   // QNAME-grouped: mates one after another
+    ok = (sim_record(sim, key >> 1, key & 1, out.bam_rec, seq, qual, xm) == 0) &&
+      (sam_write1(out.fp, out.hdr, out.bam_rec) >= 0);
+  }
+  
+  if (!out.close(ok)) Rcpp::stop("Unable to write BAM file");
+  timer.lap("write");
+  
+  if (sorted && (sam_index_build(fn.c_str(), 0) != 0))
+    Rcpp::stop("Unable to index BAM file");
+  
+  Rcpp::NumericVector res = Rcpp::NumericVector::create(
+    Rcpp::Named("templates") = ntempls,
+    Rcpp::Named("records") = nrecs
+  );
+  return with_timing<Rcpp::NumericVector>(res, timer, "index");
+}
+
+
+// test code in R
+//
+
+/*** R
+rcpp_simulate_bam(tempfile(), 1000, 300, 1000, 100, 150, 150, 300, 0.1, FALSE, FALSE, TRUE, 1, 1)
+*/
+
+// Sourcing:
+// Rcpp::sourceCpp("rcpp_simulate_bam.cpp")
+
+// #############################################################################
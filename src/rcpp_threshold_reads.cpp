@@ -1,82 +1,110 @@
 #include <Rcpp.h>
+#include "epialleleR.h"
 // using namespace Rcpp;
 
 // Read thresholding
-// Output: bool vector with "true" for reads passing/above thresholding criteria
+// Output: bit-packed mask (raw vector, see T_pass_mask) with bits set for reads
+// passing/above thresholding criteria
 //
 // This one would def benefit from:
-// [ ] SIMD
-// [ ] fewer branches
-// [ ] FALSE as a default
+// [+] SIMD: masked sums of 8 x uint32 counts, vectorised by compiler
+// [+] fewer branches: none per template
+// [+] FALSE as a default: mask is built 8 templates at a time
+// [+] O(1) per template: XM char counts are computed while loading
+// [+] multithreading: blocks of reads are independent
 
-// thresholding, vectorised, ascii-based
+// thresholding, vectorised, using XM char counts precomputed at load time
 // [[Rcpp::export("rcpp_threshold_reads")]]
-std::vector<bool> rcpp_threshold_reads(Rcpp::DataFrame &df,                     // BAM data
-                                       std::string ctx_meth,                    // methylated context string, e.g. "XZ". NON-EMPTY
-                                       std::string ctx_unmeth,                  // unmethylated context string, e.g. "xz". NON-EMPTY
-                                       std::string ooctx_meth,                  // methylated out-of-context string, e.g. "HU". Can be empty
-                                       std::string ooctx_unmeth,                // unmethylated out-of-context string, e.g. "hu". Can be empty
-                                       unsigned int min_n_ctx,                  // minimum number of context bases in xm field
-                                       double min_ctx_meth_frac,                // minimum fraction of methylated to total context bases (min context beta value)
-                                       double max_ooctx_meth_frac)              // maximum fraction of methylated to total out-of-context bases (max out-of-context beta value)
+Rcpp::RawVector rcpp_threshold_reads(Rcpp::DataFrame &df,                       // BAM data
+                                     std::string ctx_meth,                      // methylated context string, e.g. "XZ". NON-EMPTY
+                                     std::string ctx_unmeth,                    // unmethylated context string, e.g. "xz". NON-EMPTY
+                                     std::string ooctx_meth,                    // methylated out-of-context string, e.g. "HU". Can be empty
+                                     std::string ooctx_unmeth,                  // unmethylated out-of-context string, e.g. "hu". Can be empty
+                                     unsigned int min_n_ctx,                    // minimum number of context bases in xm field
+                                     double min_ctx_meth_frac,                  // minimum fraction of methylated to total context bases (min context beta value)
+                                     double max_ooctx_meth_frac,                // maximum fraction of methylated to total out-of-context bases (max out-of-context beta value)
+                                     int nthreads)                              // threads, >1 for multiple
 {
-  // Rcpp::CharacterVector xm = df["XM"];                                          // merged refspaced template XMs
-  Rcpp::XPtr<std::vector<std::string>> xm((SEXP)df.attr("xm_xptr"));            // merged refspaced template XMs, as a pointer to std::vector<std::string>
-  Rcpp::IntegerVector templid = df["templid"];                                  // template id, effectively holds indexes of corresponding std::string in std::vector
+  T_timer timer;
+  Rcpp::IntegerVector templid = df["templid"];                                  // template id, effectively holds indexes of corresponding templates
+  const int *templid_p = templid.begin();
+  const T_counts *counts = get_templates(df)->counts_p;                         // XM char counts of merged refspaced templates
   
-  std::vector<bool> res (xm->size(), true);
-  for (unsigned int x=0; x<xm->size(); x++) {
-    // checking for the interrupt
-    if ((x & 0xFFFFF) == 0) Rcpp::checkUserInterrupt();
-    
-    unsigned int ascii_map [128] = {0};
-    std::for_each(xm->at(templid[x]).begin(), xm->at(templid[x]).end(), [&ascii_map] (unsigned int const &c) {
-      ascii_map[c]++;
-    });
-    
-    unsigned int n_ctx_meth = 0;
-    std::for_each(ctx_meth.begin(), ctx_meth.end(), [&n_ctx_meth, &ascii_map] (unsigned int const &c) {
-      n_ctx_meth += ascii_map[c];
-    });
-    if (n_ctx_meth==0) {
-      res[x] = false;
-      continue;
-    }
-    
-    unsigned int n_ctx_unmeth = 0;
-    std::for_each(ctx_unmeth.begin(), ctx_unmeth.end(), [&n_ctx_unmeth, &ascii_map] (unsigned int const &c) {
-      n_ctx_unmeth += ascii_map[c];
-    });
-    unsigned int n_ctx_all = n_ctx_meth + n_ctx_unmeth;
-    if (n_ctx_all<min_n_ctx) {
-      res[x] = false;
-      continue;
-    }
-    double ctx_meth_frac = (double)n_ctx_meth / n_ctx_all;
-    if (ctx_meth_frac<min_ctx_meth_frac) {
-      res[x] = false;
-      continue;
+  const T_threshold threshold (ctx_meth, ctx_unmeth, ooctx_meth, ooctx_unmeth,
+                               min_n_ctx, min_ctx_meth_frac,
+                               max_ooctx_meth_frac);
+  
+  const size_t n = templid.size();
+  Rcpp::RawVector res ((n+7)>>3);                                               // zero-initialised, i.e. FALSE as a default
+  uint8_t *res_p = res.begin();
+  parallel_blocks(res.size(), nthreads, [&] (size_t from, size_t to) {          // blocks of 64K reads
+    for (size_t b=from; b<to; b++) {                                            // byte by byte, 8 templates each
+      const size_t last = std::min(n, (b+1)<<3);
+      uint8_t bits = 0;
+      for (size_t x=b<<3; x<last; x++)
+        bits |= threshold.pass(counts[templid_p[x]]) << (x&7);                  // counts of the current template
+      res_p[b] = bits;
     }
-    
-    unsigned int n_ooctx_meth = 0;
-    std::for_each(ooctx_meth.begin(), ooctx_meth.end(), [&n_ooctx_meth, &ascii_map] (unsigned int const &c) {
-      n_ooctx_meth += ascii_map[c];
-    });
-    if (n_ooctx_meth>0) {
-      unsigned int n_ooctx_unmeth = 0;
-      std::for_each(ooctx_unmeth.begin(), ooctx_unmeth.end(), [&n_ooctx_unmeth, &ascii_map] (unsigned int const &c) {
-        n_ooctx_unmeth += ascii_map[c];
-      });
-      
-      unsigned int n_ooctx_all = n_ooctx_meth + n_ooctx_unmeth;
-      double ooctx_meth_frac = (double)n_ooctx_meth / n_ooctx_all;
-      if (ooctx_meth_frac>max_ooctx_meth_frac) {
-        res[x] = false;
+  }, 0x2000);
+  
+  return with_timing<Rcpp::RawVector>(res, timer, "threshold");
+}
+
+// thresholding by several criteria at once: XM char counts of every template
+// are loaded once and checked against all of them. Criteria are given as
+// vectors of the same length, one element per criterion.
+// Output: list of bit-packed masks, one per criterion
+// [[Rcpp::export("rcpp_threshold_reads_multi")]]
+Rcpp::List rcpp_threshold_reads_multi(Rcpp::DataFrame &df,                      // BAM data
+                                      std::vector<std::string> ctx_meth,        // methylated context strings, e.g. "XZ". NON-EMPTY
+                                      std::vector<std::string> ctx_unmeth,      // unmethylated context strings, e.g. "xz". NON-EMPTY
+                                      std::vector<std::string> ooctx_meth,      // methylated out-of-context strings, e.g. "HU". Can be empty
+                                      std::vector<std::string> ooctx_unmeth,    // unmethylated out-of-context strings, e.g. "hu". Can be empty
+                                      std::vector<unsigned int> min_n_ctx,      // minimum numbers of context bases in xm field
+                                      std::vector<double> min_ctx_meth_frac,    // minimum fractions of methylated to total context bases (min context beta value)
+                                      std::vector<double> max_ooctx_meth_frac,  // maximum fractions of methylated to total out-of-context bases (max out-of-context beta value)
+                                      int nthreads)                             // threads, >1 for multiple
+{
+  T_timer timer;
+  const size_t nmasks = ctx_meth.size();
+  if ((ctx_unmeth.size()!=nmasks) || (ooctx_meth.size()!=nmasks) ||
+      (ooctx_unmeth.size()!=nmasks) || (min_n_ctx.size()!=nmasks) ||
+      (min_ctx_meth_frac.size()!=nmasks) || (max_ooctx_meth_frac.size()!=nmasks))
+    Rcpp::stop("Thresholding criteria must be of the same length");
+  Rcpp::IntegerVector templid = df["templid"];                                  // template id, effectively holds indexes of corresponding templates
+  const int *templid_p = templid.begin();
+  const T_counts *counts = get_templates(df)->counts_p;                         // XM char counts of merged refspaced templates
+  
+  std::vector<T_threshold> thresholds;
+  for (size_t j=0; j<nmasks; j++)
+    thresholds.emplace_back(ctx_meth[j], ctx_unmeth[j], ooctx_meth[j],
+                            ooctx_unmeth[j], min_n_ctx[j], min_ctx_meth_frac[j],
+                            max_ooctx_meth_frac[j]);
+  
+  const size_t n = templid.size();
+  const size_t nbytes = (n+7)>>3;
+  Rcpp::List res (nmasks);
+  std::vector<uint8_t*> res_p (nmasks);                                         // raw pointers for worker threads
+  for (size_t j=0; j<nmasks; j++) {
+    Rcpp::RawVector mask (nbytes);                                              // zero-initialised, i.e. FALSE as a default
+    res_p[j] = mask.begin();
+    res[j] = mask;
+  }
+  parallel_blocks(nbytes, nthreads, [&] (size_t from, size_t to) {              // blocks of 64K reads
+    std::vector<uint8_t> bits (nmasks);
+    for (size_t b=from; b<to; b++) {                                            // byte by byte, 8 templates each
+      const size_t last = std::min(n, (b+1)<<3);
+      std::fill(bits.begin(), bits.end(), 0);
+      for (size_t x=b<<3; x<last; x++) {
+        const T_counts &counts_x = counts[templid_p[x]];                        // counts of the current template
+        for (size_t j=0; j<nmasks; j++)
+          bits[j] |= thresholds[j].pass(counts_x) << (x&7);
       }
+      for (size_t j=0; j<nmasks; j++) res_p[j][b] = bits[j];
     }
-  }
+  }, 0x2000);
   
-  return res;
+  return with_timing<Rcpp::List>(res, timer, "threshold");
 }
 
 
@@ -92,7 +120,7 @@ ooctx.unmeth <- "xh"
 min.n.ctx    <- 2
 min.ctx.meth.frac   <- 0.5
 max.ooctx.meth.frac <- 0.1
-microbenchmark::microbenchmark(rcpp_threshold_reads(bam, ctx.meth, ctx.unmeth, ooctx.meth, ooctx.unmeth, min.n.ctx, min.ctx.meth.frac, max.ooctx.meth.frac), times=10)
+microbenchmark::microbenchmark(rcpp_threshold_reads(bam, ctx.meth, ctx.unmeth, ooctx.meth, ooctx.unmeth, min.n.ctx, min.ctx.meth.frac, max.ooctx.meth.frac, 1), times=10)
 */
 
 // Sourcing:
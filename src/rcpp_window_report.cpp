@@ -0,0 +1,228 @@
+#include <Rcpp.h>
+#include <deque>
+#include "epialleleR.h"
+// using namespace Rcpp;
+
+// Genome-wide report for fixed tiles or sliding windows
+// PRE-SORTED DATASET IS A REQUIREMENT.
+//
+// Windows of window_size bases start at positions 1, 1+window_step,
+// 1+2*window_step, ... of every reference. Template is counted in every
+// window it overlaps by at least min_overlap bases, as passing or failing the
+// threshold, by strand. Within-the-context beta values of templates are
+// summed up as well.
+// Output is a data.frame of windows with at least one template: rname
+// (factor), start, TRUE+, TRUE-, FALSE+, FALSE-, beta (mean)
+//
+// No list of targets: as templates are sorted, windows before the first
+// window of the current template can't get more templates, and are saved as
+// the sweep goes. Thus it is one linear pass with a small deque of open
+// windows. Chunks end where no window is shared with the next template
+// (another reference or a gap), and are counted by nthreads threads.
+
+// counts of one window
+struct T_window_counts {
+  uint32_t n[4] = {0, 0, 0, 0};                                                 // TRUE+, TRUE-, FALSE+, FALSE-
+  double beta = 0;                                                              // sum of beta values
+};
+
+// sliding windows of one chunk
+struct T_window_accumulator {
+  const int size, step, min_overlap;
+  std::deque<T_window_counts> open;                                             // windows first_k, first_k+1, ...
+  int cur_rname = NA_INTEGER, first_k = 0;
+  
+  // result
+  std::vector<int> res_rname, res_start;
+  std::vector<int> res_n[4];
+  std::vector<double> res_beta;
+  
+  T_window_accumulator(int size, int step, int min_overlap) :
+    size(size), step(step), min_overlap(min_overlap) {}
+  
+  // windows of the template, [k_lo, k_hi]; empty if k_lo > k_hi
+  inline void range(int start, int end, int *k_lo, int *k_hi) const {
+    const int lo = start + min_overlap - 1 - size;                              // window ends at or after start + min_overlap - 1
+    *k_lo = lo <= 0 ? 0 : (lo + step - 1) / step;
+    *k_hi = (end - min_overlap) < 0 || (end - start + 1 < min_overlap) ||
+      (size < min_overlap) ? -1 : (end - min_overlap) / step;                   // window starts at or before end - min_overlap + 1
+  }
+  
+  // save windows before k, drop them
+  void spit(int k) {
+    while (!open.empty() && (first_k < k)) {
+      const T_window_counts &w = open.front();
+      if (w.n[0] + w.n[1] + w.n[2] + w.n[3] > 0) {
+        res_rname.push_back(cur_rname);
+        res_start.push_back(first_k * step + 1);
+        for (int i=0; i<4; i++) res_n[i].push_back(w.n[i]);
+        res_beta.push_back(w.beta);
+      }
+      open.pop_front();
+      first_k++;
+    }
+    if (open.empty()) first_k = k;
+  }
+  
+  inline void spit_all() {
+    spit(first_k + open.size());
+  }
+  
+  // one template
+  inline void add(int rname, int strand, int start, int end, bool pass,
+                  double beta) {
+    int k_lo, k_hi;
+    range(start, end, &k_lo, &k_hi);
+    if (rname!=cur_rname) {
+      spit_all();
+      cur_rname = rname;
+      first_k = k_lo;
+    }
+    spit(k_lo);                                                                 // nothing before k_lo can change
+    if (k_hi < k_lo) return;
+    if ((int)open.size() < k_hi - first_k + 1) open.resize(k_hi - first_k + 1);
+    const int slot = (!pass)*2 + (strand==2);
+    for (int k=k_lo; k<=k_hi; k++) {
+      T_window_counts &w = open[k - first_k];
+      w.n[slot]++;
+      w.beta += beta;
+    }
+  }
+};
+
+
+template <class T_view>
+Rcpp::DataFrame window_report(const T_view &templs,                             // templates, either layout
+                              Rcpp::DataFrame &df,
+                              int window_size,
+                              int window_step,
+                              int min_overlap,
+                              const T_threshold *threshold,                     // NULL if all reads pass
+                              const std::string &ctx_meth,
+                              const std::string &ctx_unmeth,
+                              int nthreads)
+{
+  Rcpp::IntegerVector rname   = df["rname"];                                    // template rname
+  Rcpp::IntegerVector strand  = df["strand"];                                   // template strand
+  Rcpp::IntegerVector start   = df["start"];                                    // template start
+  Rcpp::IntegerVector templid = df["templid"];                                  // template id, effectively holds indexes of corresponding templates
+  const int *rname_p = rname.begin();                                           // raw pointers for worker threads
+  const int *strand_p = strand.begin();
+  const int *start_p = start.begin();
+  const int *templid_p = templid.begin();
+  const T_counts *counts = templs.templs->counts_p;                             // XM char counts of merged refspaced templates
+  const std::vector<uint8_t> ctx_meth_slots = ctx_to_slots(ctx_meth);
+  const std::vector<uint8_t> ctx_unmeth_slots = ctx_to_slots(ctx_unmeth);
+  const size_t n = rname.size();
+  
+  // chunks of roughly equal number of templates, not more than nthreads,
+  // ending where the next template shares no window with the previous ones
+  const T_window_accumulator proto (window_size, window_step, min_overlap);
+  std::vector<size_t> bounds = {0};
+  if (nthreads > 1) {
+    const size_t target = n / nthreads + 1;
+    int max_k = -1;                                                             // last window of this reference so far
+    for (size_t x=0, last=0; x<n; x++) {
+      int k_lo, k_hi;
+      proto.range(start_p[x], start_p[x] + templs.size(templid_p[x]) - 1, &k_lo, &k_hi);
+      const bool new_rname = (x==0) || (rname_p[x]!=rname_p[x-1]);
+      if ((x - last >= target) && ((int)bounds.size() < nthreads) &&
+          (new_rname || (k_lo > max_k))) {
+        bounds.push_back(x);
+        last = x;
+      }
+      if (new_rname || (max_k < k_hi)) max_k = k_hi;
+    }
+  }
+  bounds.push_back(n);
+  const size_t nchunks = bounds.size() - 1;
+  
+  std::vector<T_window_accumulator> accs (nchunks, proto);
+  parallel_blocks(nchunks, nthreads, [&] (size_t from, size_t to, size_t thread) {
+    for (size_t c=from; c<to; c++) {
+      T_window_accumulator &acc = accs[c];
+      for (size_t x=bounds[c]; x<bounds[c+1]; x++) {
+        if ((thread==0) && ((x & 0xFFFF) == 0)) Rcpp::checkUserInterrupt();     // every ~65k reads
+        const T_counts &counts_x = counts[templid_p[x]];                        // counts of the current template
+        const unsigned int n_ctx_meth = sum_counts(counts_x, ctx_meth_slots);
+        const unsigned int n_ctx_all = n_ctx_meth + sum_counts(counts_x, ctx_unmeth_slots);
+        const double beta = (double)n_ctx_meth / std::max(n_ctx_all, 1U);
+        const bool pass = (threshold==NULL) || threshold->pass(counts_x);
+        acc.add(rname_p[x], strand_p[x], start_p[x],
+                start_p[x] + templs.size(templid_p[x]) - 1, pass, beta);
+      }
+      acc.spit_all();
+    }
+  }, 1);
+  
+  size_t nrows = 0;                                                             // columns are filled chunk by chunk, in order
+  for (size_t c=0; c<nchunks; c++) nrows += accs[c].res_start.size();
+  Rcpp::IntegerVector col_rname (Rcpp::no_init(nrows)), col_start (Rcpp::no_init(nrows));
+  Rcpp::IntegerVector col_n[4];
+  for (int i=0; i<4; i++) col_n[i] = Rcpp::IntegerVector(Rcpp::no_init(nrows));
+  Rcpp::NumericVector col_beta (Rcpp::no_init(nrows));
+  for (size_t c=0, row=0; c<nchunks; c++) {
+    const T_window_accumulator &acc = accs[c];
+    for (size_t i=0; i<acc.res_start.size(); i++, row++) {
+      col_rname[row] = acc.res_rname[i];
+      col_start[row] = acc.res_start[i];
+      for (int j=0; j<4; j++) col_n[j][row] = acc.res_n[j][i];
+      col_beta[row] = acc.res_beta[i] /                                         // mean within-the-context beta value
+        (acc.res_n[0][i] + acc.res_n[1][i] + acc.res_n[2][i] + acc.res_n[3][i]);
+    }
+  }
+  
+  col_rname.attr("class") = "factor";                                           // making rname a factor
+  col_rname.attr("levels") = rname.attr("levels");
+  
+  Rcpp::DataFrame res = Rcpp::DataFrame::create(                                // final window report
+    Rcpp::Named("rname") = col_rname,                                           // numeric ids (factor) for reference names
+    Rcpp::Named("start") = col_start,                                           // start of the window
+    Rcpp::Named("TRUE+") = col_n[0],                                            // passing, '+' strand
+    Rcpp::Named("TRUE-") = col_n[1],                                            // passing, '-' strand
+    Rcpp::Named("FALSE+") = col_n[2],                                           // failing, '+' strand
+    Rcpp::Named("FALSE-") = col_n[3],                                           // failing, '-' strand
+    Rcpp::Named("beta") = col_beta                                              // mean within-the-context beta value
+  );
+  
+  return res;
+}
+
+// [[Rcpp::export("rcpp_window_report")]]
+Rcpp::DataFrame rcpp_window_report(Rcpp::DataFrame &df,                         // data frame with BAM data
+                                   int window_size,                             // width of windows
+                                   int window_step,                             // distance between starts of windows
+                                   signed int min_overlap,                      // min overlap of reads and windows
+                                   bool threshold_reads,                        // FALSE if all reads pass
+                                   std::string ctx_meth,                        // methylated context string, e.g. "XZ". NON-EMPTY
+                                   std::string ctx_unmeth,                      // unmethylated context string, e.g. "xz". NON-EMPTY
+                                   std::string ooctx_meth,                      // methylated out-of-context string, e.g. "HU". Can be empty
+                                   std::string ooctx_unmeth,                    // unmethylated out-of-context string, e.g. "hu". Can be empty
+                                   unsigned int min_n_ctx,                      // minimum number of context bases in xm field
+                                   double min_ctx_meth_frac,                    // minimum fraction of methylated to total context bases (min context beta value)
+                                   double max_ooctx_meth_frac,                  // maximum fraction of methylated to total out-of-context bases (max out-of-context beta value)
+                                   int nthreads)                                // threads, >1 for multiple
+{
+  T_timer timer;
+  if ((window_size<1) || (window_step<1)) Rcpp::stop("Window size and step must be positive");
+  const T_threshold threshold (ctx_meth, ctx_unmeth, ooctx_meth, ooctx_unmeth,
+                               min_n_ctx, min_ctx_meth_frac,
+                               max_ooctx_meth_frac);
+  Rcpp::DataFrame res = dispatch_view(df, window_report, df, window_size,       // merged refspaced templates, either layout
+                                      window_step, min_overlap,
+                                      threshold_reads ? &threshold : NULL,
+                                      ctx_meth, ctx_unmeth, nthreads);
+  return with_timing<Rcpp::DataFrame>(res, timer, "report");
+}
+
+
+// test code in R
+//
+
+/*** R
+*/
+
+// Sourcing:
+// Rcpp::sourceCpp("rcpp_window_report.cpp")
+
+// #############################################################################